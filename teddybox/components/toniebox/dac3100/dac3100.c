@@ -23,6 +23,8 @@
  */
 
 #include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "driver/i2c.h"
 #include "i2c_bus.h"
@@ -37,6 +39,8 @@ static bool codec_init_flag;
 static i2c_bus_handle_t i2c_handle;
 static uint8_t reg_cache[14][256];
 static uint8_t reg_page = 0;
+/* the page select is shared state, so every page select and the writes following it happen under this lock */
+static SemaphoreHandle_t reg_lock;
 
 uint16_t ofwButtonFreqTable[5][4][2] = {
     {
@@ -75,6 +79,19 @@ uint16_t ofwButtonFreqTable[5][4][2] = {
         {0x0506, 0x7FE6}  //--
     }};
 
+/* PLL_CLKIN is BCLK (32 * fs), so every row divides down to the same fs while keeping
+   PLL_CLK within 80..110 MHz and DAC_MOD_CLK below 6.758 MHz. rows match ofwButtonFreqTable */
+static const dac3100_clock_t dac3100_clocks[] = {
+    {16000, 48, 0x94, 6, 4, 256},
+    {22050, 32, 0x94, 4, 4, 256},
+    {32000, 48, 0x92, 6, 4, 128},
+    {44100, 32, 0x92, 4, 4, 128},
+    {48000, 32, 0x92, 4, 4, 128}};
+
+/* row of dac3100_clocks the DAC currently runs with */
+static int dac3100_clock_index = -1;
+static uint32_t dac3100_clock_changes;
+
 audio_hal_func_t AUDIO_CODEC_DAC3100_DEFAULT_HANDLE = {
     .audio_codec_initialize = dac3100_init,
     .audio_codec_deinitialize = dac3100_deinit,
@@ -116,6 +133,16 @@ static esp_err_t dac3100_write_reg(uint8_t reg_add, uint8_t data)
     return i2c_bus_write_bytes(i2c_handle, DAC3100_ADDR, &reg_add, sizeof(reg_add), &data, sizeof(data));
 }
 
+static void dac3100_lock()
+{
+    xSemaphoreTake(reg_lock, portMAX_DELAY);
+}
+
+static void dac3100_unlock()
+{
+    xSemaphoreGive(reg_lock);
+}
+
 static esp_err_t dac3100_read_reg(uint8_t reg_add, uint8_t *p_data)
 {
     esp_err_t err = i2c_bus_read_bytes(i2c_handle, DAC3100_ADDR, &reg_add, sizeof(reg_add), p_data, 1);
@@ -146,8 +173,10 @@ void dac3100_read_all()
 esp_err_t dac3100_dump_reg(enum PAGE page, uint8_t reg)
 {
     uint8_t val = 0;
+    dac3100_lock();
     dac3100_write_reg(PAGE_CONTROL, page);
     esp_err_t ret = dac3100_read_reg(reg, &val);
+    dac3100_unlock();
     ESP_LOGW(TAG, "  %x: %x", reg, val);
 
     return ret;
@@ -156,16 +185,19 @@ esp_err_t dac3100_dump_reg(enum PAGE page, uint8_t reg)
 uint8_t dac3100_headset_detected()
 {
     uint8_t val = 0;
+    dac3100_lock();
     dac3100_write_reg(PAGE_CONTROL, SERIAL_IO);
     /* reset flags  */
     dac3100_read_reg(DAC_INTR_FLAGS, &val);
     dac3100_read_reg(HEADSET_DETECT, &val);
+    dac3100_unlock();
 
     return (val >> 5) & 0x03;
 }
 
 esp_err_t dac3100_beep_generate(uint16_t sin, uint16_t cos, uint32_t length)
 {
+    dac3100_lock();
     dac3100_write_reg(PAGE_CONTROL, SERIAL_IO);
 
     dac3100_write_reg(BEEP_LEN_MSB, length >> 16);
@@ -179,21 +211,95 @@ esp_err_t dac3100_beep_generate(uint16_t sin, uint16_t cos, uint32_t length)
     dac3100_write_reg(BEEP_COS_LSB, cos);
 
     dac3100_write_reg(BEEP_L_GEN, 0x80);
+    dac3100_unlock();
 
     return ESP_OK;
 }
 
 esp_err_t dac3100_beep(uint16_t index, uint32_t length)
 {
-    uint16_t(*pBeep)[2] = ofwButtonFreqTable[4];
+    int clock = (dac3100_clock_index >= 0) ? dac3100_clock_index : DAC3100_CLOCK_DEFAULT;
+    uint16_t(*pBeep)[2] = ofwButtonFreqTable[clock];
+
+    /* length is given in samples at 48 kHz, keep the beep as long at other rates */
+    length = (uint64_t)length * dac3100_clocks[clock].sample_rate / 48000;
 
     return dac3100_beep_generate(pBeep[index][0], pBeep[index][1], length);
 }
 
+/* with the DAC running, soft mute it and stop the dividers while the PLL changes, so nothing clicks.
+   the lock is held across the delays, so no other task switches the page in between */
+static void dac3100_apply_clock(const dac3100_clock_t *clock, bool running)
+{
+    dac3100_lock();
+    uint8_t mute_bits = reg_cache[0][DAC_VOL_CTRL] & 0x0C;
+
+    dac3100_write_reg(PAGE_CONTROL, SERIAL_IO);
+    if (running)
+    {
+        dac3100_write_reg(DAC_VOL_CTRL, reg_cache[0][DAC_VOL_CTRL] | 0x0C);
+        vTaskDelay(DAC3100_SOFT_MUTE_MS / portTICK_RATE_MS);
+        dac3100_write_reg(DAC_NDAC_VAL, clock->ndac);
+        dac3100_write_reg(DAC_MDAC_VAL, clock->mdac);
+        dac3100_write_reg(PLL_P_R_VAL, clock->p_r & 0x7F);
+    }
+
+    dac3100_write_reg(PLL_J_VAL, clock->j);
+    dac3100_write_reg(PLL_D_VAL_MSB, 0x00);
+    dac3100_write_reg(PLL_D_VAL_LSB, 0x00);
+    dac3100_write_reg(PLL_P_R_VAL, clock->p_r);
+    dac3100_write_reg(DAC_DOSR_VAL_MSB, clock->dosr >> 8);
+    dac3100_write_reg(DAC_DOSR_VAL_LSB, clock->dosr & 0xFF);
+
+    /* PLL lock time */
+    vTaskDelay(10 / portTICK_RATE_MS);
+
+    dac3100_write_reg(DAC_NDAC_VAL, 0x80 | clock->ndac);
+    dac3100_write_reg(DAC_MDAC_VAL, 0x80 | clock->mdac);
+
+    /* only undo the mute, the rest of the register is taken as it is now */
+    if (running)
+    {
+        dac3100_write_reg(DAC_VOL_CTRL, (reg_cache[0][DAC_VOL_CTRL] & ~0x0C) | mute_bits);
+    }
+    dac3100_unlock();
+}
+
+esp_err_t dac3100_set_sample_rate(uint32_t sample_rate)
+{
+    for (int pos = 0; pos < sizeof(dac3100_clocks) / sizeof(dac3100_clocks[0]); pos++)
+    {
+        if (dac3100_clocks[pos].sample_rate != sample_rate)
+        {
+            continue;
+        }
+        /* same rate as before, nothing to send */
+        if (pos == dac3100_clock_index)
+        {
+            return ESP_OK;
+        }
+        ESP_LOGI(TAG, "Clock for %d Hz", sample_rate);
+        dac3100_apply_clock(&dac3100_clocks[pos], dac3100_clock_index >= 0);
+        dac3100_clock_index = pos;
+        dac3100_clock_changes++;
+        return ESP_OK;
+    }
+
+    /* the DAC follows BCLK anyway, only the PLL range and the beeps are off */
+    ESP_LOGW(TAG, "No clock for %d Hz, keeping the current one", sample_rate);
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+uint32_t dac3100_get_clock_changes(void)
+{
+    return dac3100_clock_changes;
+}
+
 esp_err_t dac3100_init(audio_hal_codec_config_t *cfg)
 {
     ESP_LOGI(TAG, "dac3100 init");
 
+    reg_lock = xSemaphoreCreateMutex();
     i2c_init();
 
     /* from datasheet */
@@ -239,16 +345,9 @@ esp_err_t dac3100_init(audio_hal_codec_config_t *cfg)
     dac3100_write_reg(PAGE_CONTROL, SERIAL_IO);
     // dac3100_write_reg(SOFTWARE_RESET, 0x01);
     dac3100_write_reg(CLOCKGEN_MUX, 0x07);     // 0000:reserved, 01:PLL_CLKIN=BCLK, 11:CODEC_CLKIN=PLL_CLK
-    dac3100_write_reg(PLL_J_VAL, 0x20);        // 00:reserved, 100000:PLL multiplier J=32 (0x20)
-    dac3100_write_reg(PLL_D_VAL_MSB, 0x00);    // 00:reserved, 000000:fraktional multiplier D-value = 0
-    dac3100_write_reg(PLL_D_VAL_LSB, 0x00);    // 00:reserved, 000000:fraktional multiplier D-value = 0
-    dac3100_write_reg(PLL_P_R_VAL, 0x96);      // 1:PLL is power up, 001:PLL divider P=1, 110:PLL multiplier R=6
-    dac3100_write_reg(DAC_NDAC_VAL, 0x84);     // 1:NDAC divider powered up, 0000100:DAC NDAC divider=4
-    dac3100_write_reg(DAC_MDAC_VAL, 0x86);     // 1:MDAC divider powered up, 0000100:DAC MDAC divider=6
-    dac3100_write_reg(DAC_DOSR_VAL_MSB, 0x01); // 000000:reserved, 01:DAC OSR MSB =256
-    dac3100_write_reg(DAC_DOSR_VAL_LSB, 0x00); // 00000000:DAC OSR LSB
-
-    vTaskDelay(10 / portTICK_RATE_MS);
+    // PLL J/D/P/R, NDAC, MDAC and DOSR per sample rate, see dac3100_clocks
+    dac3100_clock_index = -1;
+    dac3100_set_sample_rate(dac3100_clocks[DAC3100_CLOCK_DEFAULT].sample_rate);
 
     dac3100_write_reg(CODEC_IF_CTRL1, 0x00); // 00:Codec IF=I2S, 00: Codec IF WL=16 bits, 0:BCLK=Input, 0:WCKL=Output, 0:reserved        // w IF statt INT
 
@@ -322,8 +421,10 @@ esp_err_t dac3100_init(audio_hal_codec_config_t *cfg)
 
 esp_err_t dac3100_deinit(void)
 {
+    dac3100_lock();
     dac3100_write_reg(PAGE_CONTROL, SERIAL_IO);
     dac3100_write_reg(SOFTWARE_RESET, 0x01);
+    dac3100_unlock();
     return ESP_OK;
 }
 
@@ -339,19 +440,23 @@ esp_err_t dac3100_config_i2s(audio_hal_codec_mode_t mode, audio_hal_codec_i2s_if
 
 esp_err_t dac3100_set_mute(bool mute)
 {
+    dac3100_lock();
     uint8_t reg_val = (reg_cache[1][0x2A] & ~0x04) | (mute ? 0 : 0x04);
 
     dac3100_write_reg(PAGE_CONTROL, DAC_OUT_VOL);
     dac3100_write_reg(SPK_DRIVER, reg_val);
+    dac3100_unlock();
     return ESP_OK;
 }
 
 esp_err_t dac3100_set_gain(int gain)
 {
+    dac3100_lock();
     uint8_t reg_val = (reg_cache[1][0x2A] & ~0x18) | (gain << 3);
 
     dac3100_write_reg(PAGE_CONTROL, DAC_OUT_VOL);
     dac3100_write_reg(SPK_DRIVER, reg_val);
+    dac3100_unlock();
     return ESP_OK;
 }
 
@@ -362,10 +467,12 @@ esp_err_t dac3100_set_volume(int volume)
     int beep_value = ((100 - volume) * 0x3F / 100);
     uint8_t reg_beep = beep_value & 0x3F;
 
+    dac3100_lock();
     dac3100_write_reg(PAGE_CONTROL, SERIAL_IO);
     dac3100_write_reg(DAC_VOL_L_CTRL, reg_val);
     dac3100_write_reg(DAC_VOL_R_CTRL, reg_val);
     dac3100_write_reg(BEEP_R_GEN, 0x40 | (reg_beep));
+    dac3100_unlock();
     return ESP_OK;
 }
 
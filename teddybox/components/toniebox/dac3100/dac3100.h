@@ -103,6 +103,21 @@ enum ADDR_P3_MCLK {
     TIMER_CLK_MCLK_DIV = 0x10,
 };
 
+/* row of the clock and beep tables used until the stream tells its rate, 48 kHz */
+#define DAC3100_CLOCK_DEFAULT 4
+/* time for the DAC's soft stepping to reach mute before the clock changes */
+#define DAC3100_SOFT_MUTE_MS 10
+
+typedef struct {
+    uint32_t sample_rate;
+    uint8_t j;
+    /* P and R with the PLL power bit, as written to PLL_P_R_VAL */
+    uint8_t p_r;
+    uint8_t ndac;
+    uint8_t mdac;
+    uint16_t dosr;
+} dac3100_clock_t;
+
 /**
  * @brief Initialize dac3100 chip
  *
@@ -190,6 +205,20 @@ esp_err_t dac3100_get_volume(int *volume);
 
 esp_err_t dac3100_set_gain(int gain);
 
+/**
+ * @brief Switch PLL, dividers and beep coefficients to a stream's sample rate
+ *
+ * Nothing is sent if the DAC already runs with that rate.
+ *
+ * @param sample_rate:  16000, 22050, 32000, 44100 or 48000
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_NOT_SUPPORTED  unknown rate, the current clock is kept
+ */
+esp_err_t dac3100_set_sample_rate(uint32_t sample_rate);
+uint32_t dac3100_get_clock_changes(void);
+
 esp_err_t dac3100_beep_generate(uint16_t sin, uint16_t cos, uint32_t length);
 esp_err_t dac3100_beep(uint16_t index, uint32_t length);
 esp_err_t dac3100_dump_reg(enum PAGE page, uint8_t reg);
@@ -112,6 +112,12 @@ bool board_headset_irq()
     return false;
 }
 
+/* for waiting on headset changes together with other sources */
+QueueHandle_t board_headset_queue()
+{
+    return gpio_evt_queue;
+}
+
 audio_board_handle_t audio_board_init(void)
 {
     if (board_handle)
@@ -25,6 +25,8 @@
 #ifndef _AUDIO_BOARD_H_
 #define _AUDIO_BOARD_H_
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "audio_hal.h"
 #include "board_def.h"
 #include "board_pins_config.h"
@@ -141,6 +143,7 @@ esp_err_t audio_board_deinit(audio_board_handle_t audio_board);
 bool audio_board_ear_big(void);
 bool audio_board_ear_small(void);
 bool board_headset_irq(void);
+QueueHandle_t board_headset_queue(void);
 void audio_board_power(bool state);
 void audio_board_poweroff(void);
 esp_err_t audio_board_sdcard_unmount(void);
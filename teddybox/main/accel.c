@@ -5,10 +5,12 @@
 
 #include "freertos/FreeRTOS.h"
 #include "esp_log.h"
+#include "esp_event.h"
 
 #include "accel.h"
 #include "board.h"
 #include "playback.h"
+#include "evscript.h"
 
 static const char *TAG = "[ACC]";
 
@@ -36,6 +38,10 @@ typedef enum
 static accel_state_t current_state = STATE_UNKNOWN;
 uint32_t state_counter = 0;
 
+/* chapter being played, as posted by the playback */
+static volatile int32_t accel_chapter = 0;
+static volatile int32_t accel_chapters = 0;
+
 bool accel_within(float val, float target, float limit)
 {
     float difference = fabs(fabs(val) - target);
@@ -53,6 +59,44 @@ bool accel_within(float val, float target, float limit)
     return false;
 }
 
+static void accel_chapter_handler(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+    pb_event_chapter_t *event = (pb_event_chapter_t *)data;
+
+    accel_chapter = event->chapter;
+    accel_chapters = event->chapters;
+}
+
+/* go on from the chapter asked for last, so two quick tilts move two chapters before the playback got there */
+static void accel_chapter_step(int32_t direction)
+{
+    int32_t target = accel_chapter + direction;
+
+    if (target >= accel_chapters)
+    {
+        target = accel_chapters - 1;
+    }
+    if (target < 0)
+    {
+        target = 0;
+    }
+    if (accel_chapters && pb_set_chapter(target) == ESP_OK)
+    {
+        accel_chapter = target;
+    }
+}
+
+/* seek by time through the index, content that has none yet is seeked by blocks */
+static void accel_seek(int32_t direction)
+{
+    int64_t time_ms = (int64_t)pb_get_play_time() + direction * ACCEL_SEEK_MS;
+
+    if (pb_seek_time((time_ms < 0) ? 0 : time_ms) != ESP_OK)
+    {
+        pb_seek(direction * ACCEL_SEEK_BLOCKS);
+    }
+}
+
 void accel_handle_angle(float roll, float pitch)
 {
     static float target_roll = 0;
@@ -119,7 +163,7 @@ void accel_handle_angle(float roll, float pitch)
             {
                 was_stable = false;
                 ESP_LOGI(TAG, "emit CHAPTER -");
-                pb_seek_chapter(-1);
+                accel_chapter_step(-1);
             }
         }
         if (roll < 0 && pitch < 0)
@@ -128,7 +172,7 @@ void accel_handle_angle(float roll, float pitch)
             {
                 was_stable = false;
                 ESP_LOGI(TAG, "emit CHAPTER +");
-                pb_seek_chapter(1);
+                accel_chapter_step(1);
             }
         }
         if (roll < 0 && pitch > 0)
@@ -137,7 +181,7 @@ void accel_handle_angle(float roll, float pitch)
             {
                 was_stable = false;
                 ESP_LOGI(TAG, "emit SEEK +");
-                pb_seek(ACCEL_SEEK_BLOCKS);
+                accel_seek(1);
             }
             /* repeat action */
             if (state_counter > ACCEL_SEEK_REPEAT)
@@ -151,7 +195,7 @@ void accel_handle_angle(float roll, float pitch)
             {
                 was_stable = false;
                 ESP_LOGI(TAG, "emit SEEK -");
-                pb_seek(-ACCEL_SEEK_BLOCKS);
+                accel_seek(-1);
             }
             /* repeat action */
             if (state_counter > ACCEL_SEEK_REPEAT)
@@ -184,6 +228,15 @@ void accel_mainthread(void *arg)
         vTaskDelay(ACCEL_LOOP_MS / portTICK_RATE_MS);
 
         esp_err_t err = board->lis3dh->fetch(board->lis3dh, accel);
+        float roll;
+        float pitch;
+
+        /* a replayed script takes precedence over the sensor */
+        if (evscript_get_angle(&roll, &pitch))
+        {
+            accel_handle_angle(roll, pitch);
+            continue;
+        }
         if(err != ESP_OK)
         {
             continue;
@@ -192,8 +245,8 @@ void accel_mainthread(void *arg)
         float y = accel[1];
         float z = -accel[0];
 
-        float roll = getRoll(x, y, z);
-        float pitch = getPitch(x, y, z);
+        roll = getRoll(x, y, z);
+        pitch = getPitch(x, y, z);
 
         // ESP_LOGI(TAG, "Accel: X %2.2f, Y %2.2f, Z %2.2f, R %2.2f, P %2.2f", x, y, z, roll, pitch);
 
@@ -206,5 +259,6 @@ void accel_init(audio_board_handle_t board)
 {
     esp_log_level_set(TAG, ESP_LOG_INFO);
 
+    ESP_ERROR_CHECK(esp_event_handler_register(PB_EVENT, PB_EVENT_CHAPTER_CHANGED, &accel_chapter_handler, NULL));
     xTaskCreatePinnedToCore(accel_mainthread, "[TB] accel", 2048, (void *)board, ACCEL_TASK_PRIO, NULL, tskNO_AFFINITY);
 }
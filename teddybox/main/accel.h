@@ -3,7 +3,8 @@
 
 #define ACCEL_TASK_PRIO 5
 
-#define ACCEL_SEEK_BLOCKS 5 /* blocks to seek when tilted */
+#define ACCEL_SEEK_BLOCKS 5 /* blocks to seek when tilted and the content is not indexed yet */
+#define ACCEL_SEEK_MS 2000 /* time to seek when tilted, about ACCEL_SEEK_BLOCKS at the usual bit rate */
 #define ACCEL_SEEK_REPEAT 10 /* number of ACCEL_LOOP_MS until to seek again */
 
 #define ACCEL_DATA_RATE 20 /* 20 samples/s -> 50 ms */
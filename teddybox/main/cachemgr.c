@@ -0,0 +1,609 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "cachemgr.h"
+#include "playback.h"
+#include "cloud.h"
+#include "tafcache.h"
+#include "tafindex.h"
+#include "tafverify.h"
+#include "dlseg.h"
+#include "dljournal.h"
+#include "freshness.h"
+
+#define CACHEMGR_MASK (CACHEMGR_ENTRIES - 1)
+/* keep the probe sequences of the hash table short */
+#define CACHEMGR_MAX_COUNT (CACHEMGR_ENTRIES * 7 / 8)
+
+static const char *TAG = "[CM]";
+
+/* open addressing with linear probing, a slot with CACHEMGR_EMPTY is free */
+static cachemgr_entry_t cachemgr_table[CACHEMGR_ENTRIES];
+static uint32_t cachemgr_count = 0;
+static uint64_t cachemgr_bytes = 0;
+/* counts plays, ordering the entries by the time they were played */
+static uint32_t cachemgr_clock = 0;
+static bool cachemgr_ready = false;
+static bool cachemgr_dirty = false;
+static SemaphoreHandle_t cachemgr_mutex;
+static cachemgr_stats_t cachemgr_stats;
+
+/* files next to the content, which have to go along with it */
+static const char *cachemgr_sidecars[] = {TAFINDEX_EXTENSION, DLSEG_EXTENSION, TAFVERIFY_EXTENSION, DLJOURNAL_EXTENSION, FRESHNESS_EXTENSION, FRESHNESS_TEMP_EXTENSION, TAFINDEX_TEMP_EXTENSION};
+
+/********************************************************/
+/* hash table, to be called with the mutex taken        */
+/********************************************************/
+
+static uint32_t cachemgr_hash(uint64_t nfc_uid)
+{
+    nfc_uid ^= nfc_uid >> 33;
+    nfc_uid *= 0xFF51AFD7ED558CCDULL;
+    nfc_uid ^= nfc_uid >> 33;
+
+    return nfc_uid & CACHEMGR_MASK;
+}
+
+/* the entry of the uid, or the free slot it would go to */
+static cachemgr_entry_t *cachemgr_slot(uint64_t nfc_uid)
+{
+    uint32_t pos = cachemgr_hash(nfc_uid);
+
+    for (int probe = 0; probe < CACHEMGR_ENTRIES; probe++)
+    {
+        cachemgr_entry_t *entry = &cachemgr_table[pos];
+        if (entry->state == CACHEMGR_EMPTY || entry->nfc_uid == nfc_uid)
+        {
+            return entry;
+        }
+        pos = (pos + 1) & CACHEMGR_MASK;
+    }
+    return NULL;
+}
+
+static cachemgr_entry_t *cachemgr_find(uint64_t nfc_uid)
+{
+    cachemgr_entry_t *entry = cachemgr_slot(nfc_uid);
+
+    return (entry && entry->state != CACHEMGR_EMPTY) ? entry : NULL;
+}
+
+/* the entry of the uid, a new one if there was none */
+static cachemgr_entry_t *cachemgr_insert(uint64_t nfc_uid)
+{
+    cachemgr_entry_t *entry = cachemgr_slot(nfc_uid);
+
+    if (!entry || entry->state != CACHEMGR_EMPTY)
+    {
+        return entry;
+    }
+    if (cachemgr_count >= CACHEMGR_MAX_COUNT)
+    {
+        ESP_LOGW(TAG, "Index full, not tracking %016llX", nfc_uid);
+        return NULL;
+    }
+
+    memset(entry, 0x00, sizeof(cachemgr_entry_t));
+    entry->nfc_uid = nfc_uid;
+    entry->state = CACHEMGR_PARTIAL;
+    cachemgr_count++;
+
+    return entry;
+}
+
+/* move the following entries of the probe sequence up, so no lookup stops at the freed slot */
+static void cachemgr_delete(cachemgr_entry_t *entry)
+{
+    uint32_t hole = entry - cachemgr_table;
+    uint32_t pos = hole;
+
+    cachemgr_bytes -= entry->size;
+    cachemgr_count--;
+
+    while (true)
+    {
+        pos = (pos + 1) & CACHEMGR_MASK;
+        cachemgr_entry_t *next = &cachemgr_table[pos];
+        if (next->state == CACHEMGR_EMPTY)
+        {
+            break;
+        }
+
+        /* it may only move if its home slot is not between the hole and its position */
+        uint32_t home = cachemgr_hash(next->nfc_uid);
+        if (((pos - home) & CACHEMGR_MASK) >= ((pos - hole) & CACHEMGR_MASK))
+        {
+            memcpy(&cachemgr_table[hole], next, sizeof(cachemgr_entry_t));
+            hole = pos;
+        }
+    }
+    memset(&cachemgr_table[hole], 0x00, sizeof(cachemgr_entry_t));
+    cachemgr_dirty = true;
+}
+
+/********************************************************/
+/* lookups and updates                                  */
+/********************************************************/
+
+/* complete content, known without touching the card */
+bool cachemgr_playable(uint64_t nfc_uid)
+{
+    return cachemgr_get_state(nfc_uid) == CACHEMGR_COMPLETE;
+}
+
+cachemgr_state_t cachemgr_get_state(uint64_t nfc_uid)
+{
+    cachemgr_state_t state = CACHEMGR_EMPTY;
+
+    xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+    cachemgr_entry_t *entry = cachemgr_ready ? cachemgr_find(nfc_uid) : NULL;
+    if (entry)
+    {
+        state = entry->state;
+        cachemgr_stats.hits++;
+    }
+    else
+    {
+        cachemgr_stats.misses++;
+    }
+    xSemaphoreGive(cachemgr_mutex);
+
+    return state;
+}
+
+/* take over the result of pb_check_file() */
+void cachemgr_update(uint64_t nfc_uid, esp_err_t file_state)
+{
+    cachemgr_state_t state;
+
+    switch (file_state)
+    {
+    case PB_ERR_GOOD_FILE:
+        state = CACHEMGR_COMPLETE;
+        break;
+    case PB_ERR_PARTIAL_FILE:
+        state = CACHEMGR_PARTIAL;
+        break;
+    case PB_ERR_OUTDATED_FILE:
+        state = CACHEMGR_OUTDATED;
+        break;
+    case PB_ERR_CORRUPTED_FILE:
+        state = CACHEMGR_CORRUPTED;
+        break;
+    case ESP_ERR_NO_MEM:
+        /* the file was not looked at, so the entry is as good as it was */
+        return;
+    default:
+        state = CACHEMGR_EMPTY;
+        break;
+    }
+
+    /* called on the playback task, keep the header off its stack */
+    struct stat st;
+    pb_taf_header_t *taf = malloc(sizeof(pb_taf_header_t));
+    uint32_t audio_id = 0;
+    char *filename = pb_build_filename(nfc_uid);
+
+    if (!taf || !filename)
+    {
+        ESP_LOGE(TAG, "Out of memory updating %016llX", nfc_uid);
+        free(taf);
+        free(filename);
+        return;
+    }
+    if (state != CACHEMGR_EMPTY && stat(filename, &st) != 0)
+    {
+        state = CACHEMGR_EMPTY;
+    }
+    if (state != CACHEMGR_EMPTY && tafcache_get(filename, &st, NULL, taf) == ESP_OK)
+    {
+        audio_id = taf->audio_id;
+    }
+    free(taf);
+    free(filename);
+
+    xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+    if (state == CACHEMGR_EMPTY)
+    {
+        cachemgr_entry_t *entry = cachemgr_find(nfc_uid);
+        if (entry)
+        {
+            cachemgr_delete(entry);
+        }
+    }
+    else
+    {
+        cachemgr_entry_t *entry = cachemgr_insert(nfc_uid);
+        if (entry)
+        {
+            cachemgr_bytes -= entry->size;
+            entry->size = st.st_size;
+            cachemgr_bytes += entry->size;
+            entry->audio_id = audio_id;
+            entry->state = state;
+            cachemgr_dirty = true;
+        }
+    }
+    xSemaphoreGive(cachemgr_mutex);
+}
+
+/* CONTENT/<uid bytes 0-3>/<uid bytes 4-7>, the inverse of pb_build_filename() */
+static uint64_t cachemgr_parse_uid(const char *dir, const char *file)
+{
+    uint32_t low = strtoul(dir, NULL, 16);
+    uint32_t high = strtoul(file, NULL, 16);
+    uint64_t uid = 0;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        uid |= (uint64_t)((low >> (24 - i * 8)) & 0xFF) << (i * 8);
+        uid |= (uint64_t)((high >> (24 - i * 8)) & 0xFF) << ((i + 4) * 8);
+    }
+    return uid;
+}
+
+esp_err_t cachemgr_parse_filename(const char *filename, uint64_t *nfc_uid)
+{
+    size_t prefix = strlen(CACHEMGR_CONTENT_DIR);
+
+    /* <dir>/XXXXXXXX/XXXXXXXX */
+    if (strlen(filename) != prefix + 18 || strncmp(filename, CACHEMGR_CONTENT_DIR, prefix) ||
+        filename[prefix] != '/' || filename[prefix + 9] != '/')
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char dir[9];
+    memcpy(dir, &filename[prefix + 1], 8);
+    dir[8] = 0;
+    *nfc_uid = cachemgr_parse_uid(dir, &filename[prefix + 10]);
+
+    return ESP_OK;
+}
+
+void cachemgr_refresh_file(const char *filename)
+{
+    uint64_t nfc_uid;
+
+    if (cachemgr_parse_filename(filename, &nfc_uid) == ESP_OK)
+    {
+        cachemgr_update(nfc_uid, pb_check_file(filename));
+    }
+}
+
+void cachemgr_played(uint64_t nfc_uid)
+{
+    xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+    cachemgr_entry_t *entry = cachemgr_find(nfc_uid);
+    if (entry)
+    {
+        entry->last_played = ++cachemgr_clock;
+        if (entry->play_count < UINT16_MAX)
+        {
+            entry->play_count++;
+        }
+        cachemgr_dirty = true;
+    }
+    xSemaphoreGive(cachemgr_mutex);
+}
+
+/* pinned content is never evicted */
+esp_err_t cachemgr_pin(uint64_t nfc_uid, bool pinned)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+
+    xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+    cachemgr_entry_t *entry = cachemgr_find(nfc_uid);
+    if (entry)
+    {
+        if (pinned)
+        {
+            entry->flags |= CACHEMGR_FLAG_PINNED;
+        }
+        else
+        {
+            entry->flags &= ~CACHEMGR_FLAG_PINNED;
+        }
+        cachemgr_dirty = true;
+        ret = ESP_OK;
+    }
+    xSemaphoreGive(cachemgr_mutex);
+
+    return ret;
+}
+
+static size_t cachemgr_list_locked(cachemgr_entry_t *entries, size_t max)
+{
+    size_t count = 0;
+
+    for (int pos = 0; pos < CACHEMGR_ENTRIES && count < max; pos++)
+    {
+        if (cachemgr_table[pos].state != CACHEMGR_EMPTY)
+        {
+            memcpy(&entries[count++], &cachemgr_table[pos], sizeof(cachemgr_entry_t));
+        }
+    }
+    return count;
+}
+
+/* copy of the tracked entries, in no particular order */
+size_t cachemgr_list(cachemgr_entry_t *entries, size_t max)
+{
+    xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+    size_t count = cachemgr_list_locked(entries, max);
+    xSemaphoreGive(cachemgr_mutex);
+
+    return count;
+}
+
+/********************************************************/
+/* eviction                                             */
+/********************************************************/
+
+static void cachemgr_remove_files(uint64_t nfc_uid)
+{
+    char *filename = pb_build_filename(nfc_uid);
+    char *sidecar = malloc(strlen(filename) + 8);
+
+    for (int pos = 0; pos < sizeof(cachemgr_sidecars) / sizeof(cachemgr_sidecars[0]); pos++)
+    {
+        sprintf(sidecar, "%s%s", filename, cachemgr_sidecars[pos]);
+        unlink(sidecar);
+    }
+    unlink(filename);
+    tafcache_invalidate(filename);
+
+    free(sidecar);
+    free(filename);
+}
+
+/* least recently played first, but every play pushes an entry back by CACHEMGR_LFU_WEIGHT plays */
+static void cachemgr_evict()
+{
+    const uint64_t quota = CACHEMGR_QUOTA_MB * 1024ULL * 1024ULL;
+
+    while (cachemgr_bytes > quota)
+    {
+        uint64_t playing = pb_get_current_uid();
+        uint64_t downloading = cloud_get_active_uid();
+        cachemgr_entry_t victim = {0};
+        uint64_t victim_score = UINT64_MAX;
+
+        xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+        for (int pos = 0; pos < CACHEMGR_ENTRIES; pos++)
+        {
+            cachemgr_entry_t *entry = &cachemgr_table[pos];
+            if (entry->state == CACHEMGR_EMPTY || (entry->flags & CACHEMGR_FLAG_PINNED) ||
+                entry->nfc_uid == playing || entry->nfc_uid == downloading)
+            {
+                continue;
+            }
+
+            uint64_t score = entry->last_played + (uint64_t)entry->play_count * CACHEMGR_LFU_WEIGHT;
+            if (score < victim_score)
+            {
+                victim_score = score;
+                memcpy(&victim, entry, sizeof(victim));
+            }
+        }
+        xSemaphoreGive(cachemgr_mutex);
+
+        if (victim_score == UINT64_MAX)
+        {
+            ESP_LOGW(TAG, "Over quota, but nothing can be evicted");
+            return;
+        }
+
+        ESP_LOGI(TAG, "Evict %016llX, %d bytes, played %d times", victim.nfc_uid, victim.size, victim.play_count);
+        cachemgr_remove_files(victim.nfc_uid);
+
+        xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+        cachemgr_entry_t *entry = cachemgr_find(victim.nfc_uid);
+        if (entry)
+        {
+            cachemgr_delete(entry);
+        }
+        cachemgr_stats.evictions++;
+        cachemgr_stats.evicted_bytes += victim.size;
+        xSemaphoreGive(cachemgr_mutex);
+    }
+}
+
+/********************************************************/
+/* index file                                           */
+/********************************************************/
+
+/* written to a temporary file first, so there is always one complete index on the card */
+static void cachemgr_save()
+{
+    xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+    cachemgr_header_t header = {
+        .magic = CACHEMGR_MAGIC,
+        .version = CACHEMGR_VERSION,
+        .count = cachemgr_count,
+        .clock = cachemgr_clock};
+    cachemgr_entry_t *entries = malloc(cachemgr_count * sizeof(cachemgr_entry_t) + 1);
+    if (entries)
+    {
+        header.count = cachemgr_list_locked(entries, cachemgr_count);
+    }
+    cachemgr_dirty = false;
+    xSemaphoreGive(cachemgr_mutex);
+
+    if (!entries)
+    {
+        cachemgr_dirty = true;
+        return;
+    }
+
+    FILE *fd = fopen(CACHEMGR_INDEX_TMP, "wb");
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to create '%s'", CACHEMGR_INDEX_TMP);
+        free(entries);
+        return;
+    }
+    bool failed = (fwrite(&header, sizeof(header), 1, fd) != 1);
+    if (header.count)
+    {
+        failed |= (fwrite(entries, sizeof(cachemgr_entry_t), header.count, fd) != header.count);
+    }
+    fclose(fd);
+    free(entries);
+
+    if (failed)
+    {
+        ESP_LOGE(TAG, "Failed to write index");
+        return;
+    }
+    unlink(CACHEMGR_INDEX_FILE);
+    rename(CACHEMGR_INDEX_TMP, CACHEMGR_INDEX_FILE);
+    cachemgr_stats.saves++;
+}
+
+static esp_err_t cachemgr_load(const char *path)
+{
+    FILE *fd = fopen(path, "rb");
+    if (!fd)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t ret = ESP_FAIL;
+    cachemgr_header_t header;
+    if (fread(&header, sizeof(header), 1, fd) == 1 && header.magic == CACHEMGR_MAGIC && header.version == CACHEMGR_VERSION)
+    {
+        ret = ESP_OK;
+        xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+        cachemgr_clock = header.clock;
+        for (uint32_t pos = 0; pos < header.count; pos++)
+        {
+            cachemgr_entry_t loaded;
+            if (fread(&loaded, sizeof(loaded), 1, fd) != 1)
+            {
+                ret = ESP_FAIL;
+                break;
+            }
+            if (loaded.state == CACHEMGR_EMPTY)
+            {
+                continue;
+            }
+            cachemgr_entry_t *entry = cachemgr_insert(loaded.nfc_uid);
+            if (entry)
+            {
+                cachemgr_bytes -= entry->size;
+                memcpy(entry, &loaded, sizeof(loaded));
+                cachemgr_bytes += entry->size;
+            }
+        }
+        xSemaphoreGive(cachemgr_mutex);
+    }
+    fclose(fd);
+
+    if (ret == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Loaded index with %d entries, %llu MiB", cachemgr_count, cachemgr_bytes / 1024 / 1024);
+    }
+    return ret;
+}
+
+/* no index yet, look at every content file once */
+static void cachemgr_rebuild()
+{
+    DIR *dir = opendir(CACHEMGR_CONTENT_DIR);
+    if (!dir)
+    {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Building index");
+    char *path = malloc(64);
+    struct dirent *de;
+    while ((de = readdir(dir)))
+    {
+        if (strlen(de->d_name) != 8 || strchr(de->d_name, '.'))
+        {
+            continue;
+        }
+        snprintf(path, 64, "%s/%s", CACHEMGR_CONTENT_DIR, de->d_name);
+
+        DIR *subdir = opendir(path);
+        if (!subdir)
+        {
+            continue;
+        }
+
+        struct dirent *sub_de;
+        while ((sub_de = readdir(subdir)))
+        {
+            /* default content is in the same place, but with small ids */
+            if (strlen(sub_de->d_name) != 8 || strchr(sub_de->d_name, '.') || strtoul(sub_de->d_name, NULL, 16) <= CONTENT_DEFAULT_CODE_ELEPHANT)
+            {
+                continue;
+            }
+            snprintf(path, 64, "%s/%s/%s", CACHEMGR_CONTENT_DIR, de->d_name, sub_de->d_name);
+            cachemgr_update(cachemgr_parse_uid(de->d_name, sub_de->d_name), pb_check_file(path));
+
+            /* leave the card to the playback */
+            vTaskDelay(1);
+        }
+        closedir(subdir);
+    }
+    closedir(dir);
+    free(path);
+
+    ESP_LOGI(TAG, "Index built, %d entries, %llu MiB", cachemgr_count, cachemgr_bytes / 1024 / 1024);
+}
+
+static void cachemgr_task(void *arg)
+{
+    int64_t last_save = 0;
+
+    if (cachemgr_load(CACHEMGR_INDEX_FILE) != ESP_OK && cachemgr_load(CACHEMGR_INDEX_TMP) != ESP_OK)
+    {
+        cachemgr_rebuild();
+        cachemgr_dirty = true;
+    }
+    xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+    cachemgr_ready = true;
+    xSemaphoreGive(cachemgr_mutex);
+
+    while (true)
+    {
+        cachemgr_evict();
+
+        int64_t now = esp_timer_get_time();
+        if (cachemgr_dirty && now - last_save >= CACHEMGR_SAVE_MS * 1000LL)
+        {
+            cachemgr_save();
+            last_save = now;
+        }
+        vTaskDelay(CACHEMGR_EVICT_MS / portTICK_PERIOD_MS);
+    }
+}
+
+void cachemgr_get_stats(cachemgr_stats_t *stats)
+{
+    xSemaphoreTake(cachemgr_mutex, portMAX_DELAY);
+    memcpy(stats, &cachemgr_stats, sizeof(cachemgr_stats_t));
+    stats->entries = cachemgr_count;
+    stats->bytes = cachemgr_bytes;
+    xSemaphoreGive(cachemgr_mutex);
+}
+
+void cachemgr_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    cachemgr_mutex = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(cachemgr_task, "[TB] Cache", 3072, NULL, CACHEMGR_TASK_PRIO, NULL, tskNO_AFFINITY);
+}
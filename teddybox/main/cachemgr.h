@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define CACHEMGR_TASK_PRIO 1
+#define CACHEMGR_CONTENT_DIR "/sdcard/CONTENT"
+/* kept in the content dir, the scanners there only look at names with 8 characters */
+#define CACHEMGR_INDEX_FILE "/sdcard/CONTENT/CACHE.IDX"
+#define CACHEMGR_INDEX_TMP "/sdcard/CONTENT/CACHE.TMP"
+#define CACHEMGR_MAGIC 0x58444943 /* "CIDX" */
+#define CACHEMGR_VERSION 1
+
+/* tags tracked, the index is a hash table of this size in RAM */
+#define CACHEMGR_ENTRIES 256
+/* content beyond this gets evicted, least recently played first */
+#define CACHEMGR_QUOTA_MB 4096
+/* every play counts as being played this many plays later, so favourites stay longer */
+#define CACHEMGR_LFU_WEIGHT 4
+/* write the index back after changes at most this often */
+#define CACHEMGR_SAVE_MS 60000
+#define CACHEMGR_EVICT_MS 10000
+
+typedef enum
+{
+    CACHEMGR_EMPTY = 0,
+    CACHEMGR_COMPLETE,
+    CACHEMGR_PARTIAL,
+    CACHEMGR_OUTDATED,
+    CACHEMGR_CORRUPTED
+} cachemgr_state_t;
+
+#define CACHEMGR_FLAG_PINNED 0x01
+
+typedef struct
+{
+    uint64_t nfc_uid;
+    uint32_t size;
+    uint32_t audio_id;
+    /* value of the play clock when played last */
+    uint32_t last_played;
+    uint16_t play_count;
+    uint8_t state;
+    uint8_t flags;
+} cachemgr_entry_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t clock;
+} cachemgr_header_t;
+
+typedef struct
+{
+    uint32_t entries;
+    uint64_t bytes;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint64_t evicted_bytes;
+    uint32_t saves;
+} cachemgr_stats_t;
+
+void cachemgr_init(void);
+bool cachemgr_playable(uint64_t nfc_uid);
+cachemgr_state_t cachemgr_get_state(uint64_t nfc_uid);
+void cachemgr_update(uint64_t nfc_uid, esp_err_t file_state);
+void cachemgr_refresh_file(const char *filename);
+void cachemgr_played(uint64_t nfc_uid);
+esp_err_t cachemgr_pin(uint64_t nfc_uid, bool pinned);
+size_t cachemgr_list(cachemgr_entry_t *entries, size_t max);
+esp_err_t cachemgr_parse_filename(const char *filename, uint64_t *nfc_uid);
+void cachemgr_get_stats(cachemgr_stats_t *stats);
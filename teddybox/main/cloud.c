@@ -13,6 +13,7 @@
 #include "esp_netif.h"
 #include "esp_ota_ops.h"
 #include "esp_tls.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 
 #include "lwip/err.h"
@@ -24,6 +25,14 @@
 #include "cloud.h"
 #include "wifi.h"
 #include "playback.h"
+#include "tafcache.h"
+#include "dlcache.h"
+#include "dlseg.h"
+#include "tafverify.h"
+#include "dljournal.h"
+#include "cachemgr.h"
+#include "freshness.h"
+#include "rtnl.h"
 
 #define CLOUD_HOST "tc.fritz.box"
 
@@ -36,7 +45,39 @@ size_t ca_der_len = 0;
 size_t client_der_len = 0;
 size_t private_der_len = 0;
 static esp_app_desc_t running_app_info;
-static QueueHandle_t cloud_request_queue;
+
+/* connection kept between requests, one per task doing requests. index 0 is the cloud task's own */
+typedef struct
+{
+    struct esp_tls *tls;
+    char *host;
+    uint16_t port;
+    int64_t last_used;
+} cloud_conn_t;
+
+static cloud_conn_t cloud_conns[CLOUD_DL_CONNECTIONS];
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+/* the TLS session of the last handshake, shared by all connections */
+static esp_tls_client_session_t *cloud_session;
+#endif
+/* serializes handshakes, so a second connection resumes the session of the first */
+static SemaphoreHandle_t cloud_session_mutex;
+static cloud_stats_t cloud_stats;
+static bool cloud_available = false;
+
+/* content requests waiting for the cloud task, one queue per priority */
+typedef struct
+{
+    cloud_content_req_t *reqs[CLOUD_QUEUE_SIZE];
+    uint32_t count;
+} cloud_queue_t;
+
+static cloud_queue_t cloud_queues[CLOUD_PRIO_COUNT];
+/* the request the cloud task is working on */
+static cloud_content_req_t *cloud_active;
+/* protects the queues, cloud_active and the cancel tokens */
+static SemaphoreHandle_t cloud_sched_mutex;
+static TaskHandle_t cloud_task_handle;
 
 /********************************************************/
 /* HTTP parser handling routines                        */
@@ -46,6 +87,13 @@ esp_err_t http_parser_closed_cbr(void *ctx)
 {
     http_parser_t *parser_ctx = (http_parser_t *)ctx;
 
+    /* a complete response was reported already */
+    if (parser_ctx->state == HTTP_STATE_DONE)
+    {
+        return ESP_OK;
+    }
+    parser_ctx->state = HTTP_STATE_DONE;
+
     if (parser_ctx->http_end_cbr)
     {
         parser_ctx->http_end_cbr(parser_ctx->ctx);
@@ -54,103 +102,417 @@ esp_err_t http_parser_closed_cbr(void *ctx)
     return ESP_OK;
 }
 
+static esp_err_t http_parser_done(http_parser_t *parser_ctx)
+{
+    parser_ctx->state = HTTP_STATE_DONE;
+
+    if (parser_ctx->http_end_cbr)
+    {
+        parser_ctx->http_end_cbr(parser_ctx->ctx);
+    }
+    return parser_ctx->keep_alive ? CBR_CLOSE_OK : CBR_CLOSE_CONN;
+}
+
+static bool http_parser_contains(const char *value, const char *token)
+{
+    size_t token_len = strlen(token);
+
+    for (; *value; value++)
+    {
+        if (!strncasecmp(value, token, token_len))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* parse the value of the header line just finished, only the few ones we are interested in */
+static void http_parser_header(http_parser_t *parser_ctx)
+{
+    char *value = parser_ctx->value;
+
+    parser_ctx->value[parser_ctx->value_len] = 0;
+    while (*value == ' ' || *value == '\t')
+    {
+        value++;
+    }
+
+    switch (parser_ctx->header)
+    {
+    case HTTP_HEADER_CONTENT_LENGTH:
+        parser_ctx->content_length = strtoul(value, NULL, 10);
+        parser_ctx->has_length = true;
+        ESP_LOGI(TAG, "Parsed Content-Length: %zu", parser_ctx->content_length);
+        break;
+
+    case HTTP_HEADER_CONTENT_RANGE:
+    {
+        /* bytes <start>-<end>/<total> */
+        char *pos = strchr(value, ' ');
+        if (pos)
+        {
+            parser_ctx->range_start = strtoul(pos + 1, &pos, 10);
+            if (*pos == '-')
+            {
+                strtoul(pos + 1, &pos, 10);
+            }
+            if (*pos == '/')
+            {
+                parser_ctx->range_total = strtoul(pos + 1, NULL, 10);
+            }
+        }
+        ESP_LOGI(TAG, "Parsed Content-Range: start=%zu, total=%zu", parser_ctx->range_start, parser_ctx->range_total);
+        break;
+    }
+
+    case HTTP_HEADER_TRANSFER_ENCODING:
+        parser_ctx->chunked = http_parser_contains(value, "chunked");
+        break;
+
+    case HTTP_HEADER_CONNECTION:
+        if (http_parser_contains(value, "close"))
+        {
+            parser_ctx->keep_alive = false;
+        }
+        else if (http_parser_contains(value, "keep-alive"))
+        {
+            parser_ctx->keep_alive = true;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+static http_header_t http_parser_header_id(const char *name)
+{
+    if (!strcasecmp(name, "Content-Length"))
+    {
+        return HTTP_HEADER_CONTENT_LENGTH;
+    }
+    if (!strcasecmp(name, "Content-Range"))
+    {
+        return HTTP_HEADER_CONTENT_RANGE;
+    }
+    if (!strcasecmp(name, "Transfer-Encoding"))
+    {
+        return HTTP_HEADER_TRANSFER_ENCODING;
+    }
+    if (!strcasecmp(name, "Connection"))
+    {
+        return HTTP_HEADER_CONNECTION;
+    }
+    return HTTP_HEADER_OTHER;
+}
+
+/* the empty line after the headers was reached, tell the handlers what is coming */
+static esp_err_t http_parser_headers_done(http_parser_t *parser_ctx)
+{
+    esp_err_t ret = ESP_OK;
+
+    /* interim responses are followed by the real one */
+    if (parser_ctx->status_code >= 100 && parser_ctx->status_code < 200)
+    {
+        parser_ctx->state = HTTP_STATE_STATUS;
+        parser_ctx->version = 0;
+        parser_ctx->status_code = 0;
+        parser_ctx->status_field = 0;
+        return ESP_OK;
+    }
+
+    ESP_LOGI(TAG, "Parsed HTTP Status Code: %d", parser_ctx->status_code);
+    if (parser_ctx->http_status_cbr)
+    {
+        ret = parser_ctx->http_status_cbr(parser_ctx->ctx, parser_ctx->status_code);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    /* without a length, a chunked body still might tell the full size in its range */
+    size_t content_length = parser_ctx->content_length;
+    if (!parser_ctx->has_length && parser_ctx->range_total > parser_ctx->range_start)
+    {
+        content_length = parser_ctx->range_total - parser_ctx->range_start;
+    }
+    size_t total_length = parser_ctx->range_total ? parser_ctx->range_total : parser_ctx->range_start + content_length;
+
+    if (parser_ctx->content_length_cbr)
+    {
+        ret = parser_ctx->content_length_cbr(parser_ctx->ctx, parser_ctx->range_start, content_length, total_length);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    if (parser_ctx->status_code == 204 || parser_ctx->status_code == 304)
+    {
+        return http_parser_done(parser_ctx);
+    }
+    if (parser_ctx->chunked)
+    {
+        parser_ctx->state = HTTP_STATE_CHUNK_SIZE;
+        parser_ctx->chunk_remaining = 0;
+        parser_ctx->name_len = 0;
+        parser_ctx->header_bytes = 0;
+        return ESP_OK;
+    }
+    if (parser_ctx->has_length && parser_ctx->content_length == 0)
+    {
+        return http_parser_done(parser_ctx);
+    }
+    parser_ctx->state = HTTP_STATE_BODY;
+
+    return ESP_OK;
+}
+
+static esp_err_t http_parser_data(http_parser_t *parser_ctx, uint8_t *data, size_t length)
+{
+    parser_ctx->received_data_length += length;
+
+    if (parser_ctx->http_data_cbr)
+    {
+        return parser_ctx->http_data_cbr(parser_ctx->ctx, data, length);
+    }
+    return ESP_OK;
+}
+
+/* streaming HTTP/1.1 response parser. header bytes are looked at once, body data is passed on in one piece per call */
 esp_err_t http_parser_received_cbr(void *ctx, uint8_t *data, size_t length)
 {
     esp_err_t ret = ESP_OK;
     http_parser_t *parser_ctx = (http_parser_t *)ctx;
+    size_t pos = 0;
 
-    if (!parser_ctx->header_parsed)
+    while (pos < length)
     {
-        if (parser_ctx->header_size + length > MAX_HTTP_HEADER_SIZE)
+        switch (parser_ctx->state)
         {
-            ESP_LOGI(TAG, "Buffer overflow");
-            return ESP_FAIL;
+        case HTTP_STATE_BODY:
+        {
+            size_t chunk = length - pos;
+
+            /* without a length, the body ends when the connection gets closed */
+            if (parser_ctx->has_length && chunk > parser_ctx->content_length - parser_ctx->received_data_length)
+            {
+                chunk = parser_ctx->content_length - parser_ctx->received_data_length;
+            }
+            ret = http_parser_data(parser_ctx, &data[pos], chunk);
+            pos += chunk;
+            if (ret)
+            {
+                return ret;
+            }
+            if (parser_ctx->has_length && parser_ctx->received_data_length >= parser_ctx->content_length)
+            {
+                return http_parser_done(parser_ctx);
+            }
+            continue;
+        }
+
+        case HTTP_STATE_CHUNK_DATA:
+        {
+            size_t chunk = length - pos;
+
+            if (chunk > parser_ctx->chunk_remaining)
+            {
+                chunk = parser_ctx->chunk_remaining;
+            }
+            ret = http_parser_data(parser_ctx, &data[pos], chunk);
+            pos += chunk;
+            parser_ctx->chunk_remaining -= chunk;
+            if (ret)
+            {
+                return ret;
+            }
+            if (!parser_ctx->chunk_remaining)
+            {
+                parser_ctx->state = HTTP_STATE_CHUNK_END;
+            }
+            continue;
+        }
+
+        case HTTP_STATE_DONE:
+            /* anything behind the response does not belong to us */
+            return parser_ctx->keep_alive ? CBR_CLOSE_OK : CBR_CLOSE_CONN;
+
+        default:
+            break;
         }
 
-        memcpy(parser_ctx->header_buffer + parser_ctx->header_size, data, length);
-        parser_ctx->header_size += length;
+        /* everything else is line based */
+        char c = data[pos++];
 
-        char *header_end = strstr((char *)parser_ctx->header_buffer, "\r\n\r\n");
-        if (header_end)
+        /* counted per section, the header, each chunk size line and the trailers each have to fit */
+        if (++parser_ctx->header_bytes > MAX_HTTP_HEADER_SIZE)
         {
-            uint32_t status_code = 0;
-            uint32_t content_length = 0;
+            ESP_LOGE(TAG, "Header too long");
+            return ESP_FAIL;
+        }
+        if (c == '\r')
+        {
+            continue;
+        }
 
-            if (sscanf((char *)parser_ctx->header_buffer, "HTTP/1.1 %d ", &status_code) == 1)
+        switch (parser_ctx->state)
+        {
+        case HTTP_STATE_STATUS:
+            /* HTTP/1.1 <code> <reason> */
+            if (c == '\n')
+            {
+                /* HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only when told so */
+                parser_ctx->keep_alive = (parser_ctx->version >= 11);
+                parser_ctx->state = HTTP_STATE_HEADER_NAME;
+                parser_ctx->name_len = 0;
+            }
+            else if (c == ' ')
             {
-                ESP_LOGI(TAG, "Parsed HTTP Status Code: %d", status_code);
-                if (parser_ctx->http_status_cbr)
+                parser_ctx->status_field++;
+            }
+            else if (parser_ctx->status_field == 0 && c >= '0' && c <= '9' && parser_ctx->version < 100)
+            {
+                parser_ctx->version = parser_ctx->version * 10 + (c - '0');
+            }
+            else if (parser_ctx->status_field == 1 && c >= '0' && c <= '9')
+            {
+                parser_ctx->status_code = parser_ctx->status_code * 10 + (c - '0');
+            }
+            break;
+
+        case HTTP_STATE_HEADER_NAME:
+            if (c == '\n')
+            {
+                /* an empty line ends the header */
+                if (parser_ctx->name_len == 0)
                 {
-                    ret = parser_ctx->http_status_cbr(parser_ctx->ctx, status_code);
+                    parser_ctx->header_bytes = 0;
+                    ret = http_parser_headers_done(parser_ctx);
                     if (ret)
                     {
                         return ret;
                     }
                 }
+                parser_ctx->name_len = 0;
             }
-
-            size_t start_byte = 0;
-            size_t end_byte = 0;
-            size_t total_bytes = 0;
-            char *content_range_str = strstr((char *)parser_ctx->header_buffer, "Content-Range: ");
-            if (content_range_str)
+            else if (c == ':')
+            {
+                parser_ctx->name[parser_ctx->name_len] = 0;
+                parser_ctx->header = http_parser_header_id(parser_ctx->name);
+                parser_ctx->value_len = 0;
+                parser_ctx->state = HTTP_STATE_HEADER_VALUE;
+            }
+            else if (parser_ctx->name_len < sizeof(parser_ctx->name) - 1)
             {
-                sscanf(content_range_str, "Content-Range: bytes %zu-%zu/%zu", &start_byte, &end_byte, &total_bytes);
-                ESP_LOGI(TAG, "Parsed Content-Range: start=%zu, end=%zu, total=%zu", start_byte, end_byte, total_bytes);
+                parser_ctx->name[parser_ctx->name_len++] = c;
             }
+            break;
 
-            char *content_length_str = strstr((char *)parser_ctx->header_buffer, "Content-Length: ");
-            if (content_length_str)
+        case HTTP_STATE_HEADER_VALUE:
+            if (c == '\n')
+            {
+                http_parser_header(parser_ctx);
+                parser_ctx->name_len = 0;
+                parser_ctx->state = HTTP_STATE_HEADER_NAME;
+            }
+            else if (parser_ctx->header != HTTP_HEADER_OTHER && parser_ctx->value_len < sizeof(parser_ctx->value) - 1)
             {
-                sscanf(content_length_str, "Content-Length: %zu", &content_length);
-                ESP_LOGI(TAG, "Parsed Content-Length: %zu", content_length);
+                parser_ctx->value[parser_ctx->value_len++] = c;
             }
+            break;
 
-            parser_ctx->content_length = content_length;
-            parser_ctx->header_parsed = 1;
+        case HTTP_STATE_CHUNK_SIZE:
+        {
+            /* name_len tells whether a digit was seen, a size line without any is as broken as one with other characters */
+            int digit = -1;
 
-            if (parser_ctx->content_length_cbr)
+            if (c >= '0' && c <= '9')
+            {
+                digit = c - '0';
+            }
+            else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
             {
-                ret = parser_ctx->content_length_cbr(parser_ctx->ctx, start_byte, parser_ctx->content_length);
-                if (ret)
+                digit = (c | 0x20) - 'a' + 10;
+            }
+
+            if (digit >= 0)
+            {
+                if (parser_ctx->chunk_remaining > (SIZE_MAX >> 4))
                 {
-                    return ret;
+                    ESP_LOGE(TAG, "Chunk size too large");
+                    return ESP_FAIL;
                 }
+                parser_ctx->chunk_remaining = parser_ctx->chunk_remaining * 16 + digit;
+                parser_ctx->name_len = 1;
+                break;
+            }
+            if ((c != '\n' && c != ';') || !parser_ctx->name_len)
+            {
+                ESP_LOGE(TAG, "Invalid chunk size");
+                return ESP_FAIL;
             }
 
-            uint8_t *content_start = (uint8_t *)(header_end + 4);
-            size_t content_size = parser_ctx->header_size - (content_start - parser_ctx->header_buffer);
-
-            if (parser_ctx->http_data_cbr)
+            if (c == '\n')
             {
-                ret = parser_ctx->http_data_cbr(parser_ctx->ctx, content_start, content_size);
-                if (ret)
+                if (parser_ctx->chunk_remaining == 0)
                 {
-                    return ret;
+                    /* last chunk, only trailers and an empty line follow */
+                    parser_ctx->state = HTTP_STATE_TRAILER;
+                    parser_ctx->name_len = 0;
+                    parser_ctx->header_bytes = 0;
                 }
+                else
+                {
+                    parser_ctx->state = HTTP_STATE_CHUNK_DATA;
+                }
+            }
+            else
+            {
+                parser_ctx->state = HTTP_STATE_CHUNK_EXT;
             }
+            break;
         }
-    }
-    else
-    {
-        parser_ctx->received_data_length += length;
 
-        if (parser_ctx->http_data_cbr)
-        {
-            ret = parser_ctx->http_data_cbr(parser_ctx->ctx, data, length);
-            if (ret)
+        case HTTP_STATE_CHUNK_EXT:
+            if (c == '\n')
             {
-                return ret;
+                parser_ctx->state = (parser_ctx->chunk_remaining == 0) ? HTTP_STATE_TRAILER : HTTP_STATE_CHUNK_DATA;
+                parser_ctx->name_len = 0;
+                parser_ctx->header_bytes = 0;
             }
-        }
+            break;
 
-        if (parser_ctx->received_data_length >= parser_ctx->content_length)
-        {
-            if (parser_ctx->http_end_cbr)
+        case HTTP_STATE_CHUNK_END:
+            /* the line break after the chunk data */
+            if (c == '\n')
+            {
+                parser_ctx->state = HTTP_STATE_CHUNK_SIZE;
+                parser_ctx->chunk_remaining = 0;
+                parser_ctx->name_len = 0;
+                parser_ctx->header_bytes = 0;
+            }
+            break;
+
+        case HTTP_STATE_TRAILER:
+            if (c == '\n')
             {
-                parser_ctx->http_end_cbr(parser_ctx->ctx);
+                if (parser_ctx->name_len == 0)
+                {
+                    return http_parser_done(parser_ctx);
+                }
+                parser_ctx->name_len = 0;
             }
-            return CBR_CLOSE_OK;
+            else
+            {
+                parser_ctx->name_len = 1;
+            }
+            break;
+
+        default:
+            break;
         }
     }
 
@@ -161,12 +523,165 @@ esp_err_t http_parser_received_cbr(void *ctx, uint8_t *data, size_t length)
 /* TLS connection handling                              */
 /********************************************************/
 
+static void cloud_conn_close(cloud_conn_t *conn)
+{
+    if (conn->tls)
+    {
+        esp_tls_conn_delete(conn->tls);
+        conn->tls = NULL;
+    }
+}
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+static void cloud_conn_free_session()
+{
+    if (cloud_session)
+    {
+        mbedtls_ssl_session_free(&cloud_session->saved_session);
+        free(cloud_session);
+        cloud_session = NULL;
+    }
+}
+#endif
+
+/* the server drops idle connections anyway, do not keep the socket and TLS buffers for that long */
+static void cloud_conn_expire(cloud_conn_t *conn)
+{
+    if (conn->tls && esp_timer_get_time() - conn->last_used > CLOUD_KEEPALIVE_MS * 1000LL)
+    {
+        ESP_LOGI(TAG, "Close idle connection to '%s'", conn->host);
+        cloud_conn_close(conn);
+    }
+}
+
+/* returns the kept connection to the given host if there is one, else connects, resuming the last TLS session */
+static struct esp_tls *cloud_conn_get(cloud_conn_t *conn, const char *host, uint16_t port, const char *url, bool *reused)
+{
+    cloud_conn_expire(conn);
+    if (conn->tls && (strcmp(conn->host, host) || conn->port != port))
+    {
+        cloud_conn_close(conn);
+    }
+
+    if (conn->tls)
+    {
+        cloud_stats.reused++;
+        *reused = true;
+        return conn->tls;
+    }
+    *reused = false;
+
+    xSemaphoreTake(cloud_session_mutex, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+
+    esp_tls_cfg_t cfg = {
+        .cacert_buf = ca_der,
+        .cacert_bytes = ca_der_len,
+        .clientcert_buf = client_der,
+        .clientcert_bytes = client_der_len,
+        .clientkey_buf = private_der,
+        .clientkey_bytes = private_der_len,
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        .client_session = cloud_session,
+#endif
+        .skip_common_name = true};
+
+    struct esp_tls *tls = esp_tls_conn_http_new(url, &cfg);
+    if (!tls)
+    {
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        /* do not insist on a session the server might have problems with */
+        cloud_conn_free_session();
+#endif
+        xSemaphoreGive(cloud_session_mutex);
+        return NULL;
+    }
+
+    uint32_t handshake_ms = (esp_timer_get_time() - now) / 1000;
+    cloud_stats.handshakes++;
+    cloud_stats.handshake_ms_total += handshake_ms;
+    cloud_stats.handshake_ms_last = handshake_ms;
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    if (cloud_session)
+    {
+        cloud_stats.resumptions++;
+    }
+    cloud_conn_free_session();
+    cloud_session = esp_tls_get_client_session(tls);
+#endif
+    xSemaphoreGive(cloud_session_mutex);
+
+    ESP_LOGI(TAG, "Handshake with '%s' took %d ms", host, handshake_ms);
+
+    free(conn->host);
+    conn->host = strdup(host);
+    conn->port = port;
+    conn->tls = tls;
+
+    return tls;
+}
+
+/* remember the socket, so cloud_cancel() can shut it down. fails if the request was cancelled already */
+static bool cloud_cancel_attach(cloud_cancel_t *cancel, uint8_t conn, struct esp_tls *tls)
+{
+    if (!cancel)
+    {
+        return true;
+    }
+
+    int sockfd = -1;
+    esp_tls_get_conn_sockfd(tls, &sockfd);
+
+    xSemaphoreTake(cloud_sched_mutex, portMAX_DELAY);
+    bool cancelled = cancel->cancelled;
+    if (!cancelled)
+    {
+        cancel->sockfd[conn] = sockfd;
+    }
+    xSemaphoreGive(cloud_sched_mutex);
+
+    return !cancelled;
+}
+
+/* has to happen before the connection gets closed, else the descriptor might belong to someone else */
+static void cloud_cancel_detach(cloud_cancel_t *cancel, uint8_t conn)
+{
+    if (!cancel)
+    {
+        return;
+    }
+
+    xSemaphoreTake(cloud_sched_mutex, portMAX_DELAY);
+    cancel->sockfd[conn] = -1;
+    xSemaphoreGive(cloud_sched_mutex);
+}
+
+static bool cloud_cancelled(cloud_req_t *req)
+{
+    return req->cancel && req->cancel->cancelled;
+}
+
+/* a blocking read on the socket returns right away, no need to wait for the next data or a timeout */
+static void cloud_cancel_locked(cloud_cancel_t *cancel)
+{
+    cancel->cancelled = true;
+    for (int conn = 0; conn < CLOUD_DL_CONNECTIONS; conn++)
+    {
+        if (cancel->sockfd[conn] >= 0)
+        {
+            shutdown(cancel->sockfd[conn], SHUT_RDWR);
+        }
+    }
+}
+
 static esp_err_t cloud_request(cloud_req_t *req)
 {
     esp_err_t ret = ESP_FAIL;
 
     char *auth_line = strdup("");
     char *range_line = strdup("");
+    char *body_line = strdup("");
     char *request;
     char *url;
 
@@ -175,31 +690,42 @@ static esp_err_t cloud_request(cloud_req_t *req)
         free(auth_line);
         asprintf(&auth_line, "Authorization: BD %s\r\n", req->auth);
     }
-    if (req->range_start)
+    if (req->range_end)
+    {
+        free(range_line);
+        asprintf(&range_line, "Range: bytes=%d-%d\r\n", req->range_start, req->range_end - 1);
+    }
+    else if (req->range_start)
     {
         free(range_line);
         asprintf(&range_line, "Range: bytes=%d-\r\n", req->range_start);
     }
+    if (req->body)
+    {
+        free(body_line);
+        asprintf(&body_line, "Content-Type: application/octet-stream\r\n"
+                             "Content-Length: %d\r\n",
+                 req->body_length);
+    }
     asprintf(&url, "https://%s:%d%s", req->host, req->port, req->path);
     ESP_LOGI(TAG, "Connect to %s...", url);
 
-    asprintf(&request, "GET %s HTTP/1.1\r\n"
-                       "Host: %s\r\n"
-                       "%s"
-                       "%s"
-                       "User-Agent: teddybox/1.0 (ESP32) %s\r\n"
-                       "\r\n",
-             req->path, req->host, auth_line, range_line, running_app_info.version);
-
-    // ESP_LOGI(TAG, "Header %s...", request);
-    esp_tls_cfg_t cfg = {
-        .cacert_buf = ca_der,
-        .cacert_bytes = ca_der_len,
-        .clientcert_buf = client_der,
-        .clientcert_bytes = client_der_len,
-        .clientkey_buf = private_der,
-        .clientkey_bytes = private_der_len,
-        .skip_common_name = true};
+    int request_len = asprintf(&request, "%s %s HTTP/1.1\r\n"
+                                         "Host: %s\r\n"
+                                         "%s"
+                                         "%s"
+                                         "%s"
+                                         "User-Agent: teddybox/1.0 (ESP32) %s\r\n"
+                                         "\r\n",
+                               req->body ? "POST" : "GET", req->path, req->host, auth_line, range_line, body_line, running_app_info.version);
+
+    /* the body is sent together with the header */
+    if (req->body)
+    {
+        request = realloc(request, request_len + req->body_length);
+        memcpy(&request[request_len], req->body, req->body_length);
+        request_len += req->body_length;
+    }
 
     uint8_t *receive_buffer = malloc(HTTP_RECEIVE_SIZE);
     if (!receive_buffer)
@@ -208,94 +734,180 @@ static esp_err_t cloud_request(cloud_req_t *req)
         return ESP_FAIL;
     }
 
-    struct esp_tls *tls = esp_tls_conn_http_new(url, &cfg);
-    if (!tls)
+    cloud_stats.requests++;
+    cloud_conn_t *conn = &cloud_conns[req->conn];
+
+    /* a kept connection might have been closed by the server meanwhile, then try once more with a new one */
+    bool retry = true;
+    while (retry)
     {
-        ESP_LOGE(TAG, "Connection failed...");
-        goto exit;
-    }
+        bool reused = false;
+        bool keep = false;
+        bool received = false;
+        int64_t sent_time = 0;
 
-    ESP_LOGI(TAG, "Connection to '%s' established...", req->host);
+        retry = false;
 
-    size_t written_bytes = 0;
-    size_t request_len = strlen(request);
-    do
-    {
-        int ret = esp_tls_conn_write(tls, request + written_bytes, request_len - written_bytes);
-        if (ret >= 0)
+        if (cloud_cancelled(req))
         {
-            written_bytes += ret;
+            ret = ESP_FAIL;
+            break;
         }
-        else if (ret != ESP_TLS_ERR_SSL_WANT_READ && ret != ESP_TLS_ERR_SSL_WANT_WRITE)
+
+        struct esp_tls *tls = cloud_conn_get(conn, req->host, req->port, url, &reused);
+        if (!tls)
         {
-            ESP_LOGE(TAG, "esp_tls_conn_write returned: [0x%02X](%s)", ret, esp_err_to_name(ret));
-            goto exit;
+            ESP_LOGE(TAG, "Connection failed...");
+            ret = ESP_FAIL;
+            break;
         }
-    } while (written_bytes < request_len);
-
-    bool connected = true;
-
-    ret = ESP_OK;
 
-    while (connected)
-    {
-        int len = esp_tls_conn_read(tls, receive_buffer, HTTP_RECEIVE_SIZE);
-
-        if (len == ESP_TLS_ERR_SSL_WANT_WRITE || len == ESP_TLS_ERR_SSL_WANT_READ)
+        if (!cloud_cancel_attach(req->cancel, req->conn, tls))
         {
-            ESP_LOGI(TAG, "TLS socket idle");
-            continue;
+            cloud_conn_close(conn);
+            ret = ESP_FAIL;
+            break;
         }
 
-        if (len < 0)
+        ESP_LOGI(TAG, "Connection to '%s' %s...", req->host, reused ? "reused" : "established");
+
+        size_t written_bytes = 0;
+        ret = ESP_OK;
+        do
         {
-            ESP_LOGE(TAG, "esp_tls_conn_read returned [-0x%02X](%s)", -len, esp_err_to_name(len));
-            if (req->connection_closed_cbr)
+            int ret = esp_tls_conn_write(tls, request + written_bytes, request_len - written_bytes);
+            if (ret >= 0)
             {
-                req->connection_closed_cbr(req->connection_closed_ctx);
+                written_bytes += ret;
             }
-            ret = ESP_FAIL;
-            connected = false;
-            continue;
-        }
+            else if (ret != ESP_TLS_ERR_SSL_WANT_READ && ret != ESP_TLS_ERR_SSL_WANT_WRITE)
+            {
+                ESP_LOGE(TAG, "esp_tls_conn_write returned: [0x%02X](%s)", ret, esp_err_to_name(ret));
+                break;
+            }
+        } while (written_bytes < request_len);
 
-        if (len == 0)
+        if (written_bytes < request_len)
         {
-            connected = false;
+            cloud_cancel_detach(req->cancel, req->conn);
+            cloud_conn_close(conn);
+            retry = reused && !cloud_cancelled(req);
+            ret = ESP_FAIL;
             continue;
         }
+        sent_time = esp_timer_get_time();
+
+        bool connected = true;
 
-        if (req->data_received_cbr)
+        while (connected)
         {
-            esp_err_t cbr_ret = req->data_received_cbr(req->data_received_ctx, receive_buffer, len);
+            int len = esp_tls_conn_read(tls, receive_buffer, HTTP_RECEIVE_SIZE);
 
-            switch (cbr_ret)
+            if (len == ESP_TLS_ERR_SSL_WANT_WRITE || len == ESP_TLS_ERR_SSL_WANT_READ)
             {
-            case ESP_OK:
-                break;
+                ESP_LOGI(TAG, "TLS socket idle");
+                continue;
+            }
+
+            if (cloud_cancelled(req))
+            {
+                ESP_LOGI(TAG, "Request cancelled");
+                ret = ESP_FAIL;
+                connected = false;
+                continue;
+            }
 
-            case ESP_FAIL:
+            /* nothing received on a kept connection, the server closed it */
+            if (len <= 0 && reused && !received)
+            {
+                ESP_LOGI(TAG, "Kept connection was closed, reconnecting");
+                retry = true;
+                connected = false;
+                continue;
+            }
+
+            if (len < 0)
+            {
+                ESP_LOGE(TAG, "esp_tls_conn_read returned [-0x%02X](%s)", -len, esp_err_to_name(len));
+                if (req->connection_closed_cbr)
+                {
+                    req->connection_closed_cbr(req->connection_closed_ctx);
+                }
                 ret = ESP_FAIL;
                 connected = false;
                 continue;
+            }
 
-            case CBR_CLOSE_OK:
+            if (len == 0)
+            {
                 connected = false;
                 continue;
             }
+
+            if (!received)
+            {
+                received = true;
+                uint32_t ttfb_ms = (esp_timer_get_time() - sent_time) / 1000;
+                cloud_stats.ttfb_ms_last = ttfb_ms;
+                if (ttfb_ms > cloud_stats.ttfb_ms_max)
+                {
+                    cloud_stats.ttfb_ms_max = ttfb_ms;
+                }
+            }
+
+            if (req->data_received_cbr)
+            {
+                esp_err_t cbr_ret = req->data_received_cbr(req->data_received_ctx, receive_buffer, len);
+
+                switch (cbr_ret)
+                {
+                case ESP_OK:
+                    break;
+
+                case ESP_FAIL:
+                    ret = ESP_FAIL;
+                    connected = false;
+                    continue;
+
+                case CBR_CLOSE_OK:
+                    /* the response is complete, the connection can serve the next request */
+                    keep = true;
+                    connected = false;
+                    continue;
+
+                case CBR_CLOSE_CONN:
+                    connected = false;
+                    continue;
+                }
+            }
         }
-    }
 
-    ESP_LOGI(TAG, "connection closed");
-    if (req->connection_closed_cbr)
-    {
-        req->connection_closed_cbr(req->connection_closed_ctx);
-    }
+        cloud_cancel_detach(req->cancel, req->conn);
+        /* a cancelled request left the connection in an unknown state */
+        if (keep && !cloud_cancelled(req))
+        {
+            conn->last_used = esp_timer_get_time();
+        }
+        else
+        {
+            cloud_conn_close(conn);
+        }
 
-exit:
-    esp_tls_conn_delete(tls);
+        if (retry)
+        {
+            continue;
+        }
+
+        ESP_LOGI(TAG, "connection %s", keep ? "kept" : "closed");
+        if (req->connection_closed_cbr)
+        {
+            req->connection_closed_cbr(req->connection_closed_ctx);
+        }
+    }
 
     free(auth_line);
+    free(range_line);
+    free(body_line);
     free(request);
     free(url);
     free(receive_buffer);
@@ -303,67 +915,146 @@ exit:
     return ret;
 }
 
+void cloud_get_stats(cloud_stats_t *stats)
+{
+    memcpy(stats, &cloud_stats, sizeof(cloud_stats_t));
+}
+
 /********************************************************/
 /* time request handler                                 */
 /********************************************************/
 
 esp_err_t cloud_set_time_cbr(void *ctx, uint8_t *data, size_t length)
 {
-    if (length <= 5 || length > 32)
-    {
-        return ESP_OK;
-    }
+    if (length <= 5 || length > 32)
+    {
+        return ESP_OK;
+    }
+
+    char str[33];
+    memcpy(str, data, length);
+    str[length] = 0;
+    ESP_LOGI(TAG, "Received time string: %s", str);
+
+    time_t unixTime = atol(str);
+    if (unixTime == 0 && strcmp(str, "0") != 0)
+    {
+        return ESP_FAIL;
+    }
+
+    struct timeval tv = {
+        .tv_sec = unixTime,
+        .tv_usec = 0};
+
+    if (settimeofday(&tv, NULL) == -1)
+    {
+        return ESP_FAIL;
+    }
+
+    time_t currentTime;
+    struct tm *timeInfo;
+    char buffer[80];
+
+    time(&currentTime);
+    timeInfo = localtime(&currentTime);
+
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", timeInfo);
+    ESP_LOGI(TAG, "Current Date and Time: %s", buffer);
+
+    return CBR_CLOSE_OK;
+}
+
+esp_err_t cloud_set_time(void)
+{
+    http_parser_t http_parser_handler_ctx = {
+        .http_data_cbr = &cloud_set_time_cbr};
+    cloud_req_t req = {
+        .host = CLOUD_HOST,
+        .port = 443,
+        .path = "/v1/time",
+        .data_received_cbr = &http_parser_received_cbr,
+        .data_received_ctx = &http_parser_handler_ctx};
+
+    esp_err_t ret = cloud_request(&req);
+
+    return ret;
+}
+
+/********************************************************/
+/* generic POST request with a small response           */
+/********************************************************/
+
+typedef struct
+{
+    uint8_t *data;
+    size_t length;
+    size_t max_length;
+    int status_code;
+} cloud_post_ctx_t;
 
-    char str[33];
-    memcpy(str, data, length);
-    str[length] = 0;
-    ESP_LOGI(TAG, "Received time string: %s", str);
+static esp_err_t cloud_post_status_cbr(void *ctx, int status_code)
+{
+    cloud_post_ctx_t *post = (cloud_post_ctx_t *)ctx;
 
-    time_t unixTime = atol(str);
-    if (unixTime == 0 && strcmp(str, "0") != 0)
+    post->status_code = status_code;
+    if (status_code != 200)
     {
+        ESP_LOGE(TAG, "POST failed: HTTP %d", status_code);
         return ESP_FAIL;
     }
+    return ESP_OK;
+}
 
-    struct timeval tv = {
-        .tv_sec = unixTime,
-        .tv_usec = 0};
+static esp_err_t cloud_post_cbr(void *ctx, uint8_t *data, size_t length)
+{
+    cloud_post_ctx_t *post = (cloud_post_ctx_t *)ctx;
 
-    if (settimeofday(&tv, NULL) == -1)
+    if (post->length + length > post->max_length)
     {
+        ESP_LOGE(TAG, "POST response larger than %d bytes", post->max_length);
         return ESP_FAIL;
     }
+    memcpy(&post->data[post->length], data, length);
+    post->length += length;
 
-    time_t currentTime;
-    struct tm *timeInfo;
-    char buffer[80];
-
-    time(&currentTime);
-    timeInfo = localtime(&currentTime);
-
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", timeInfo);
-    ESP_LOGI(TAG, "Current Date and Time: %s", buffer);
-
-    return CBR_CLOSE_OK;
+    return ESP_OK;
 }
 
-esp_err_t cloud_set_time(void)
+/* only to be called from the cloud task, it uses its connection */
+esp_err_t cloud_post(const char *path, const uint8_t *body, size_t length, uint8_t *response, size_t *response_length)
 {
+    cloud_post_ctx_t post = {
+        .data = response,
+        .max_length = *response_length};
     http_parser_t http_parser_handler_ctx = {
-        .http_data_cbr = &cloud_set_time_cbr,
-        .header_buffer = malloc(MAX_HTTP_HEADER_SIZE)};
+        .http_status_cbr = &cloud_post_status_cbr,
+        .http_data_cbr = &cloud_post_cbr,
+        .ctx = &post};
     cloud_req_t req = {
         .host = CLOUD_HOST,
         .port = 443,
-        .path = "/v1/time",
+        .path = path,
+        .body = body,
+        .body_length = length,
         .data_received_cbr = &http_parser_received_cbr,
-        .data_received_ctx = &http_parser_handler_ctx};
+        .data_received_ctx = &http_parser_handler_ctx,
+        .connection_closed_cbr = &http_parser_closed_cbr,
+        .connection_closed_ctx = &http_parser_handler_ctx};
 
     esp_err_t ret = cloud_request(&req);
 
-    free(http_parser_handler_ctx.header_buffer);
+    if (ret != ESP_OK || post.status_code != 200 || http_parser_handler_ctx.state != HTTP_STATE_DONE)
+    {
+        return ESP_FAIL;
+    }
+    *response_length = post.length;
 
-    return ret;
+    return ESP_OK;
+}
+
+bool cloud_is_available()
+{
+    return cloud_available;
 }
 
 /********************************************************/
@@ -405,7 +1096,11 @@ esp_err_t cloud_content_status_cbr(void *ctx, int status_code)
     case 206:
         ESP_LOGI(TAG, "[CDL] HTTP %d received, partial content", req->status_code);
 
-        req->state = CC_STATE_CONNECTED;
+        /* further ranges of a split download do not go back to connected */
+        if (req->state < CC_STATE_CONNECTED)
+        {
+            req->state = CC_STATE_CONNECTED;
+        }
         xSemaphoreGive(req->update_sem);
         return ESP_OK;
 
@@ -418,7 +1113,7 @@ esp_err_t cloud_content_status_cbr(void *ctx, int status_code)
     }
 }
 
-esp_err_t cloud_content_length_cbr(void *ctx, size_t content_range, size_t content_length)
+esp_err_t cloud_content_length_cbr(void *ctx, size_t content_range, size_t content_length, size_t total_length)
 {
     cloud_content_req_t *req = (cloud_content_req_t *)ctx;
 
@@ -433,11 +1128,28 @@ esp_err_t cloud_content_length_cbr(void *ctx, size_t content_range, size_t conte
         return ESP_FAIL;
     }
 
-    cloud_create_directories(req->filename);
-    req->handle = fopen(req->filename, "wb+");
+    /* a split download comes in several responses, the file gets opened with the first one */
     if (!req->handle)
     {
-        ESP_LOGE(TAG, "[CDL] Failed to create '%s'", req->filename);
+        req->total_length = total_length;
+
+        cloud_create_directories(req->filename);
+        tafcache_invalidate(req->filename);
+        /* when continuing a partial download, keep what is there already */
+        req->handle = fopen(req->filename, (req->received || dlseg_pending(req->filename)) ? "rb+" : "wb+");
+        if (!req->handle)
+        {
+            ESP_LOGE(TAG, "[CDL] Failed to create '%s'", req->filename);
+            return ESP_FAIL;
+        }
+        /* only whole blocks get written, those should go to the card without being copied again */
+        setvbuf(req->handle, NULL, _IONBF, 0);
+        req->verify = tafverify_start(req->filename, req->received);
+        dlseg_begin(req);
+    }
+    if (dlcache_start(req) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "[CDL] Failed to continue '%s'", req->filename);
         return ESP_FAIL;
     }
 
@@ -463,25 +1175,17 @@ esp_err_t cloud_content_cbr(void *ctx, uint8_t *data, size_t length)
         return ESP_FAIL;
     }
 
-    while (!xSemaphoreTake(req->file_sem, 1000 / portTICK_PERIOD_MS))
-    {
-        ESP_LOGE(TAG, "[CDL] Timed out waiting for file lock...");
-    }
-    fseek(req->handle, req->received, SEEK_SET);
-
-    req->received += length;
-    if (fwrite(data, length, 1, req->handle) != 1)
+    /* playback takes the blocks from RAM, they get written to the card in the background */
+    if (dlcache_put(req, data, length) != ESP_OK)
     {
-        xSemaphoreGive(req->file_sem);
         ESP_LOGE(TAG, "[CDL] Write failed, bailing out");
         return ESP_FAIL;
     }
-    xSemaphoreGive(req->file_sem);
+    tafverify_update(req->verify, req->received, data, length);
+    req->received += length;
+    tafverify_commit(req->verify, req->filename, dlcache_get_synced());
     xSemaphoreGive(req->update_sem);
 
-    /* give others the chance to react */
-    vTaskDelay(1 / portTICK_RATE_MS);
-
     time_t current = time(NULL);
     static time_t start = 0;
     static time_t last = 0;
@@ -496,8 +1200,8 @@ esp_err_t cloud_content_cbr(void *ctx, uint8_t *data, size_t length)
 
         float elapsed = difftime(current, start);
         float speed = (req->received / elapsed) / 1024.0; // KiB/s
-        float percent_complete = (req->received * 100.0f / req->content_length);
-        float eta = ((req->content_length - req->received) / (req->received / elapsed));
+        float percent_complete = (req->received * 100.0f / req->total_length);
+        float eta = ((req->total_length - req->received) / (req->received / elapsed));
 
         ESP_LOGI(TAG, "[CDL] %d bytes received (%2.2f%%), Speed: %2.2f KiB/s, ETA: %2.2f s", req->received, percent_complete, speed, eta);
     }
@@ -507,24 +1211,16 @@ esp_err_t cloud_content_cbr(void *ctx, uint8_t *data, size_t length)
 esp_err_t cloud_content_end_cbr(void *ctx)
 {
     cloud_content_req_t *req = (cloud_content_req_t *)ctx;
-    ESP_LOGI(TAG, "[CDL] End transfer, %d/%d received", req->received, req->content_length);
+    ESP_LOGI(TAG, "[CDL] End transfer, %d/%d received", req->received, req->total_length);
 
-/* playback handler initiated the download, it shall close handles
-    if (req->handle)
-    {
-        fclose(req->handle);
-        req->handle = NULL;
-    }
-*/
-    if (req->state == CC_STATE_ABORTED)
+    /* everything up to req->received has to be readable before the next range or the final state */
+    if (dlcache_finish(req) != ESP_OK && req->state == CC_STATE_RECEIVING)
     {
+        ESP_LOGE(TAG, "[CDL] Failed to write '%s'", req->filename);
         req->state = CC_STATE_ERROR;
     }
-    else
-    {
-        req->state = CC_STATE_FINISHED;
-    }
     xSemaphoreGive(req->update_sem);
+
     return ESP_OK;
 }
 
@@ -532,44 +1228,372 @@ esp_err_t cloud_process_request(cloud_content_req_t *content_req)
 {
     ESP_LOGI(TAG, "[CDL] Request for '%s' -> '%s'", content_req->location, content_req->filename);
 
-    http_parser_t http_parser_handler_ctx = {
-        .http_status_cbr = &cloud_content_status_cbr,
-        .http_data_cbr = &cloud_content_cbr,
-        .http_end_cbr = &cloud_content_end_cbr,
-        .content_length_cbr = &cloud_content_length_cbr,
-        .ctx = content_req,
-        .header_buffer = malloc(MAX_HTTP_HEADER_SIZE)};
+    /* cancelled while the cloud task was picking it up */
+    if (content_req->abort)
+    {
+        content_req->state = CC_STATE_ERROR;
+        xSemaphoreGive(content_req->update_sem);
+        return ESP_FAIL;
+    }
 
-    cloud_req_t req = {
-        .host = CLOUD_HOST,
-        .port = 443,
-        .path = content_req->location,
-        .auth = content_req->auth,
-        .range_start = content_req->received,
-        .data_received_cbr = &http_parser_received_cbr,
-        .data_received_ctx = &http_parser_handler_ctx,
-        .connection_closed_cbr = &http_parser_closed_cbr,
-        .connection_closed_ctx = &http_parser_handler_ctx};
+    esp_err_t ret = ESP_OK;
+    int64_t start_time = esp_timer_get_time();
+    uint32_t start_pos = content_req->received;
+    uint32_t range_end = dlseg_first(content_req);
 
-    esp_err_t ret = cloud_request(&req);
+    /* fetch the file range by range, the helpers fill in what the next ranges skip */
+    do
+    {
+        uint32_t range_start = content_req->received;
+        http_parser_t http_parser_handler_ctx = {
+            .http_status_cbr = &cloud_content_status_cbr,
+            .http_data_cbr = &cloud_content_cbr,
+            .http_end_cbr = &cloud_content_end_cbr,
+            .content_length_cbr = &cloud_content_length_cbr,
+            .ctx = content_req};
+
+        cloud_req_t req = {
+            .host = CLOUD_HOST,
+            .port = 443,
+            .path = content_req->location,
+            .auth = content_req->auth,
+            .range_start = range_start,
+            .range_end = range_end,
+            .cancel = &content_req->cancel,
+            .data_received_cbr = &http_parser_received_cbr,
+            .data_received_ctx = &http_parser_handler_ctx,
+            .connection_closed_cbr = &http_parser_closed_cbr,
+            .connection_closed_ctx = &http_parser_handler_ctx};
+
+        ret = cloud_request(&req);
+
+        if (ret != ESP_OK || content_req->state != CC_STATE_RECEIVING || content_req->abort || content_req->received == range_start)
+        {
+            break;
+        }
+        range_end = dlseg_next(content_req);
+
+        /* hash what the helpers wrote in the meantime, it is still in the card's cache */
+        if (content_req->verify && content_req->verify->valid && content_req->verify->pos < content_req->received)
+        {
+            xSemaphoreTake(content_req->file_sem, portMAX_DELAY);
+            tafverify_update_file(content_req->verify, content_req->handle, content_req->received);
+            xSemaphoreGive(content_req->file_sem);
+            /* dlseg_next synced the helpers' blocks before skipping them */
+            tafverify_commit(content_req->verify, content_req->filename, content_req->received);
+        }
+    } while (range_end);
+
+    dlseg_stop(content_req);
+
+    if (content_req->verify)
+    {
+        if (content_req->total_length && content_req->received >= content_req->total_length)
+        {
+            if (tafverify_finish(content_req->verify, content_req->filename) == ESP_ERR_INVALID_STATE)
+            {
+                tafverify_request(content_req->filename);
+            }
+        }
+        else
+        {
+            /* after a failed write, only trust what was synced before */
+            uint32_t synced = (content_req->state == CC_STATE_RECEIVING) ? content_req->received : dlcache_get_synced();
+            tafverify_save(content_req->verify, content_req->filename, synced);
+        }
+        tafverify_free(content_req->verify);
+        content_req->verify = NULL;
+    }
+
+    /* complete or not, the index has to know */
+    cachemgr_refresh_file(content_req->filename);
 
-    free(http_parser_handler_ctx.header_buffer);
+    /* uid and rate in bytes per second */
+    uint32_t duration_ms = (esp_timer_get_time() - start_time) / 1000;
+    uint32_t report[3] = {
+        (uint32_t)content_req->nfc_uid,
+        (uint32_t)(content_req->nfc_uid >> 32),
+        duration_ms ? (uint32_t)((uint64_t)(content_req->received - start_pos) * 1000 / duration_ms) : 0};
+
+    /* playback handler initiated the download, it shall close handles */
+    if (content_req->state == CC_STATE_RECEIVING && !content_req->abort)
+    {
+        content_req->state = CC_STATE_FINISHED;
+        rtnl_log(RTNL_GROUP_DOWNLOAD, RTNL_DL_DONE, content_req->received, report, sizeof(report));
+    }
+    else
+    {
+        content_req->state = CC_STATE_ERROR;
+        rtnl_log(RTNL_GROUP_DOWNLOAD, RTNL_DL_FAILED, content_req->status_code, report, sizeof(report));
+    }
+    xSemaphoreGive(content_req->update_sem);
 
     return ret;
 }
 
+/********************************************************/
+/* helper connections for split downloads               */
+/********************************************************/
+
+typedef struct
+{
+    cloud_content_req_t *req;
+    uint32_t start;
+    uint32_t end;
+    /* bytes expected and received from the start of the range */
+    uint32_t length;
+    uint32_t received;
+    uint32_t written_blocks;
+    size_t fill;
+    uint8_t *block;
+} cloud_segment_t;
+
+static esp_err_t cloud_segment_status_cbr(void *ctx, int status_code)
+{
+    if (status_code != 206)
+    {
+        ESP_LOGE(TAG, "[SEG] Range not supported, HTTP %d", status_code);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t cloud_segment_length_cbr(void *ctx, size_t content_range, size_t content_length, size_t total_length)
+{
+    cloud_segment_t *seg = (cloud_segment_t *)ctx;
+
+    if (content_range != seg->start * TONIEFILE_FRAME_SIZE || total_length != seg->req->total_length)
+    {
+        ESP_LOGE(TAG, "[SEG] Got range %d of %d, expected %d of %d", content_range, total_length, seg->start * TONIEFILE_FRAME_SIZE, seg->req->total_length);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t cloud_segment_flush(cloud_segment_t *seg)
+{
+    if (dlseg_write(seg->req, seg->start + seg->written_blocks, seg->block, seg->fill) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    seg->written_blocks++;
+    seg->fill = 0;
+
+    return ESP_OK;
+}
+
+static esp_err_t cloud_segment_cbr(void *ctx, uint8_t *data, size_t length)
+{
+    cloud_segment_t *seg = (cloud_segment_t *)ctx;
+
+    if (dlseg_cancelled(seg->req))
+    {
+        return ESP_FAIL;
+    }
+
+    while (length > 0 && seg->received < seg->length)
+    {
+        size_t chunk = TONIEFILE_FRAME_SIZE - seg->fill;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        if (chunk > seg->length - seg->received)
+        {
+            chunk = seg->length - seg->received;
+        }
+        memcpy(&seg->block[seg->fill], data, chunk);
+        seg->fill += chunk;
+        seg->received += chunk;
+        data += chunk;
+        length -= chunk;
+
+        /* the last block of the file might be a short one */
+        if (seg->fill == TONIEFILE_FRAME_SIZE || seg->received == seg->length)
+        {
+            if (cloud_segment_flush(seg) != ESP_OK)
+            {
+                return ESP_FAIL;
+            }
+        }
+    }
+
+    return ESP_OK;
+}
+
+static void cloud_segment_fetch(uint8_t conn, cloud_content_req_t *content_req, uint32_t start, uint32_t end)
+{
+    uint32_t end_pos = end * TONIEFILE_FRAME_SIZE;
+    if (end_pos > content_req->total_length)
+    {
+        end_pos = content_req->total_length;
+    }
+
+    cloud_segment_t seg = {
+        .req = content_req,
+        .start = start,
+        .end = end,
+        .length = end_pos - start * TONIEFILE_FRAME_SIZE,
+        .block = malloc(TONIEFILE_FRAME_SIZE)};
+
+    if (seg.block)
+    {
+        http_parser_t http_parser_handler_ctx = {
+            .http_status_cbr = &cloud_segment_status_cbr,
+            .http_data_cbr = &cloud_segment_cbr,
+            .content_length_cbr = &cloud_segment_length_cbr,
+            .ctx = &seg};
+
+        cloud_req_t req = {
+            .host = CLOUD_HOST,
+            .port = 443,
+            .path = content_req->location,
+            .auth = content_req->auth,
+            .range_start = start * TONIEFILE_FRAME_SIZE,
+            .range_end = end_pos,
+            .conn = conn,
+            .cancel = &content_req->cancel,
+            .data_received_cbr = &http_parser_received_cbr,
+            .data_received_ctx = &http_parser_handler_ctx,
+            .connection_closed_cbr = &http_parser_closed_cbr,
+            .connection_closed_ctx = &http_parser_handler_ctx};
+
+        ESP_LOGI(TAG, "[SEG] Fetch blocks %d-%d on connection %d", start, end - 1, conn);
+        cloud_request(&req);
+        free(seg.block);
+    }
+
+    dlseg_complete(content_req, start, end, start + seg.written_blocks);
+}
+
+static void cloud_helper_task(void *ctx)
+{
+    uint8_t conn = (uint32_t)ctx;
+    bool connected = false;
+
+    while (true)
+    {
+        cloud_content_req_t *req;
+        uint32_t start;
+        uint32_t end;
+
+        /* after the last segment, do not wait for the next split download with the connection open */
+        if (dlseg_claim(&req, &start, &end, connected ? 0 : portMAX_DELAY) == ESP_OK)
+        {
+            cloud_segment_fetch(conn, req, start, end);
+            connected = true;
+        }
+        else
+        {
+            cloud_conn_close(&cloud_conns[conn]);
+            connected = false;
+        }
+    }
+}
+
 /********************************************************/
 /* cloud request code, called from external code        */
 /********************************************************/
 
-cloud_content_req_t *cloud_content_download(uint64_t nfc_uid, const uint8_t *nfc_token)
+/* the next request to work on, by priority and in the order they were queued */
+static cloud_content_req_t *cloud_queue_next()
+{
+    cloud_content_req_t *req = NULL;
+
+    xSemaphoreTake(cloud_sched_mutex, portMAX_DELAY);
+    for (int prio = 0; prio < CLOUD_PRIO_COUNT && !req; prio++)
+    {
+        cloud_queue_t *queue = &cloud_queues[prio];
+
+        if (queue->count)
+        {
+            req = queue->reqs[0];
+            queue->count--;
+            memmove(&queue->reqs[0], &queue->reqs[1], queue->count * sizeof(cloud_content_req_t *));
+        }
+    }
+    cloud_active = req;
+    xSemaphoreGive(cloud_sched_mutex);
+
+    return req;
+}
+
+static void cloud_queue_done()
+{
+    xSemaphoreTake(cloud_sched_mutex, portMAX_DELAY);
+    cloud_active = NULL;
+    xSemaphoreGive(cloud_sched_mutex);
+}
+
+/* take a request out of its queue, returns false if it is not queued (anymore) */
+static bool cloud_queue_remove(cloud_content_req_t *req)
+{
+    cloud_queue_t *queue = &cloud_queues[req->prio];
+
+    for (uint32_t pos = 0; pos < queue->count; pos++)
+    {
+        if (queue->reqs[pos] == req)
+        {
+            queue->count--;
+            memmove(&queue->reqs[pos], &queue->reqs[pos + 1], (queue->count - pos) * sizeof(cloud_content_req_t *));
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cloud_queue_add(cloud_content_req_t *req)
+{
+    cloud_queue_t *queue = &cloud_queues[req->prio];
+    bool queued = false;
+
+    xSemaphoreTake(cloud_sched_mutex, portMAX_DELAY);
+    if (queue->count < CLOUD_QUEUE_SIZE)
+    {
+        queue->reqs[queue->count++] = req;
+        queued = true;
+
+        /* a tag waits for its content, a background download has to free the link */
+        if (cloud_active && !cloud_active->abort && cloud_active->prio > req->prio)
+        {
+            ESP_LOGI(TAG, "[CDL] Preempt download of '%s'", cloud_active->filename);
+            cloud_active->abort = true;
+            cloud_cancel_locked(&cloud_active->cancel);
+            cloud_stats.preempted++;
+        }
+    }
+    xSemaphoreGive(cloud_sched_mutex);
+
+    if (!queued)
+    {
+        ESP_LOGE(TAG, "[CDL] Queue full, dropping request for '%s'", req->filename);
+        cloud_stats.rejected++;
+        req->state = CC_STATE_ERROR;
+        xSemaphoreGive(req->update_sem);
+        return;
+    }
+    xTaskNotifyGive(cloud_task_handle);
+}
+
+cloud_content_req_t *cloud_content_download(uint64_t nfc_uid, const uint8_t *nfc_token, cloud_prio_t prio)
+{
+    return cloud_content_download_file(nfc_uid, nfc_token, prio, NULL);
+}
+
+/* like cloud_content_download(), but into the given file instead of the one that gets played */
+cloud_content_req_t *cloud_content_download_file(uint64_t nfc_uid, const uint8_t *nfc_token, cloud_prio_t prio, const char *filename)
 {
     cloud_content_req_t *req = calloc(1, sizeof(cloud_content_req_t));
 
-    ESP_LOGI(TAG, "[CDL] Queue request for UID %llX", nfc_uid);
+    ESP_LOGI(TAG, "[CDL] Queue request for UID %llX, priority %d", nfc_uid, prio);
 
     /* fill input fields */
     req->nfc_uid = nfc_uid;
+    req->prio = prio;
+    for (int conn = 0; conn < CLOUD_DL_CONNECTIONS; conn++)
+    {
+        req->cancel.sockfd[conn] = -1;
+    }
 
     /* fill working variables based on input fields */
     req->state = CC_STATE_INIT;
@@ -579,14 +1603,43 @@ cloud_content_req_t *cloud_content_download(uint64_t nfc_uid, const uint8_t *nfc
     req->content_length = 0;
     req->received = 0;
     req->location = malloc(64);
-    req->filename = pb_build_filename(nfc_uid);
+    req->filename = filename ? strdup(filename) : pb_build_filename(nfc_uid);
     req->auth = malloc(65);
 
     /* when the file already exists, do a partial download */
     struct stat st;
     if (stat(req->filename, &st) == 0)
     {
-        req->received = st.st_size;
+        req->received = dlseg_resume_pos(req->filename, st.st_size);
+
+        /* only what the journal recorded is known to be on the card, the tail after a power cut might be garbage */
+        dljournal_entry_t journal;
+        if (dljournal_load(req->filename, &journal) == ESP_OK)
+        {
+            if (journal.pos < req->received)
+            {
+                ESP_LOGW(TAG, "[CDL] Journal ends at %d, not trusting the rest", journal.pos);
+                req->received = journal.pos;
+            }
+        }
+        /* cut off before the first commit, only the header block or what the segments recorded is known to be there */
+        else if (!dlseg_pending(req->filename) && req->received > TONIEFILE_FRAME_SIZE)
+        {
+            ESP_LOGW(TAG, "[CDL] No journal, not trusting anything behind the header");
+            req->received = TONIEFILE_FRAME_SIZE;
+        }
+
+        /* a download that did not match its hash is not worth continuing */
+        if (tafverify_check(req->filename, st.st_size) == ESP_ERR_INVALID_CRC)
+        {
+            req->received = 0;
+        }
+        /* the cloud has newer content, start over */
+        if (freshness_outdated(req->filename))
+        {
+            freshness_clear(req->filename);
+            req->received = 0;
+        }
         ESP_LOGI(TAG, "[CDL] Partial file, continue at %d", req->received);
     }
 
@@ -621,7 +1674,7 @@ cloud_content_req_t *cloud_content_download(uint64_t nfc_uid, const uint8_t *nfc
         strcpy(req->filename, "(error)");
     }
 
-    xQueueSend(cloud_request_queue, &req, portMAX_DELAY);
+    cloud_queue_add(req);
 
     return req;
 }
@@ -631,9 +1684,56 @@ cloud_content_state_t cloud_content_get_state(cloud_content_req_t *req)
     return req->state;
 }
 
+/* wait until the download makes progress or changes its state. only one task may wait for a request */
+cloud_content_state_t cloud_content_wait(cloud_content_req_t *req, TickType_t timeout)
+{
+    if (req->state < CC_STATE_FINISHED)
+    {
+        xSemaphoreTake(req->update_sem, timeout);
+    }
+    return req->state;
+}
+
+/* uid of the content being downloaded right now, 0 if none */
+uint64_t cloud_get_active_uid()
+{
+    xSemaphoreTake(cloud_sched_mutex, portMAX_DELAY);
+    uint64_t nfc_uid = cloud_active ? cloud_active->nfc_uid : 0;
+    xSemaphoreGive(cloud_sched_mutex);
+
+    return nfc_uid;
+}
+
+/* stop the download without waiting for it, the final state follows once the sockets are closed */
+void cloud_content_cancel(cloud_content_req_t *req)
+{
+    bool removed;
+
+    xSemaphoreTake(cloud_sched_mutex, portMAX_DELAY);
+    req->abort = true;
+    removed = cloud_queue_remove(req);
+    if (!removed)
+    {
+        cloud_cancel_locked(&req->cancel);
+    }
+    xSemaphoreGive(cloud_sched_mutex);
+
+    cloud_stats.cancelled++;
+
+    /* never seen by the cloud task, so nobody else will finish it */
+    if (removed)
+    {
+        req->state = CC_STATE_ERROR;
+        xSemaphoreGive(req->update_sem);
+    }
+}
+
 void cloud_content_cleanup(cloud_content_req_t *req)
 {
     vSemaphoreDelete(req->update_sem);
+    vSemaphoreDelete(req->file_sem);
+    free(req->location);
+    free(req->auth);
     free(req->filename);
     free(req);
 }
@@ -673,7 +1773,6 @@ esp_err_t cloud_load_cert(const char *path, uint8_t **ptr, size_t *length)
 
 static void cloud_task(void *ctx)
 {
-    bool cloud_available = false;
     while (true)
     {
         if (!wifi_is_connected())
@@ -682,10 +1781,9 @@ static void cloud_task(void *ctx)
             continue;
         }
 
-        vTaskDelay(100 / portTICK_PERIOD_MS);
-
         if (!cloud_available)
         {
+            vTaskDelay(100 / portTICK_PERIOD_MS);
             ESP_LOGI(TAG, "Try to get time");
             if (cloud_set_time() == ESP_OK)
             {
@@ -698,12 +1796,20 @@ static void cloud_task(void *ctx)
         }
         else
         {
-            cloud_content_req_t *req;
+            cloud_content_req_t *req = cloud_queue_next();
 
-            if (xQueueReceive(cloud_request_queue, &req, 0) == pdTRUE)
+            if (req)
             {
                 cloud_process_request(req);
+                cloud_queue_done();
+                continue;
             }
+
+            /* background work only when nothing is queued */
+            freshness_poll();
+            rtnl_poll();
+            cloud_conn_expire(&cloud_conns[0]);
+            ulTaskNotifyTake(pdTRUE, CLOUD_IDLE_POLL_MS / portTICK_PERIOD_MS);
         }
     }
     vTaskDelete(NULL);
@@ -715,12 +1821,20 @@ void cloud_init(void)
 
     esp_ota_get_partition_description(esp_ota_get_running_partition(), &running_app_info);
 
-    cloud_request_queue = xQueueCreate(4, sizeof(cloud_content_req_t *));
+    cloud_sched_mutex = xSemaphoreCreateMutex();
+    dlcache_init();
+    dlseg_init();
+    freshness_init();
+    cloud_session_mutex = xSemaphoreCreateMutex();
 
     ESP_LOGI(TAG, "Loading certificates");
     cloud_load_cert("/spiflash/cert/ca.der", &ca_der, &ca_der_len);
     cloud_load_cert("/spiflash/cert/client.der", &client_der, &client_der_len);
     cloud_load_cert("/spiflash/cert/private.der", &private_der, &private_der_len);
 
-    xTaskCreate(&cloud_task, "[TB] cloud", 5000, NULL, 5, NULL);
+    xTaskCreate(&cloud_task, "[TB] cloud", 5000, NULL, 5, &cloud_task_handle);
+    for (uint32_t conn = 1; conn < CLOUD_DL_CONNECTIONS; conn++)
+    {
+        xTaskCreate(&cloud_helper_task, "[TB] cloud seg", 5000, (void *)conn, CLOUD_DL_HELPER_PRIO, NULL);
+    }
 }
@@ -1,23 +1,85 @@
 #pragma once
 
+#include "sdkconfig.h"
+
 #define MAX_HTTP_HEADER_SIZE 1024
 #define HTTP_RECEIVE_SIZE 1600
+/* an idle connection is not reused after this time, servers tend to close them anyway */
+#define CLOUD_KEEPALIVE_MS 20000
+/* connections used for a content download, more than one splits it into ranges, see dlseg.h */
+#ifdef CONFIG_TB_CLOUD_SPLIT_DOWNLOAD
+#define CLOUD_DL_CONNECTIONS 2
+#else
+#define CLOUD_DL_CONNECTIONS 1
+#endif
+#define CLOUD_DL_HELPER_PRIO 5
+/* requests waiting per priority, a full queue fails the request right away */
+#define CLOUD_QUEUE_SIZE 4
+/* when idle, the cloud task still wakes up this often for background work */
+#define CLOUD_IDLE_POLL_MS 1000
 
 
+typedef enum
+{
+    HTTP_STATE_STATUS = 0,
+    HTTP_STATE_HEADER_NAME,
+    HTTP_STATE_HEADER_VALUE,
+    HTTP_STATE_BODY,
+    HTTP_STATE_CHUNK_SIZE,
+    HTTP_STATE_CHUNK_EXT,
+    HTTP_STATE_CHUNK_DATA,
+    HTTP_STATE_CHUNK_END,
+    HTTP_STATE_TRAILER,
+    HTTP_STATE_DONE
+} http_parser_state_t;
+
+typedef enum
+{
+    HTTP_HEADER_OTHER = 0,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_RANGE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_CONNECTION
+} http_header_t;
+
+/* zero-initialize together with the callbacks, that is the start state */
 typedef struct
 {
     esp_err_t (*http_status_cbr)(void *ctx, int status_code);
     esp_err_t (*http_data_cbr)(void *ctx, uint8_t *data, size_t length);
     esp_err_t (*http_end_cbr)(void *ctx);
-    esp_err_t (*content_length_cbr)(void *ctx, size_t content_range, size_t content_length);
+    esp_err_t (*content_length_cbr)(void *ctx, size_t content_range, size_t content_length, size_t total_length);
     void *ctx;
     size_t content_length;
     size_t received_data_length;
-    uint8_t *header_buffer;
-    size_t header_size;
-    int header_parsed;
+
+    /* parser state */
+    http_parser_state_t state;
+    /* digits of the protocol version, 11 for HTTP/1.1 */
+    uint8_t version;
+    uint32_t status_code;
+    uint8_t status_field;
+    size_t header_bytes;
+    http_header_t header;
+    char name[24];
+    uint8_t name_len;
+    char value[48];
+    uint8_t value_len;
+    bool has_length;
+    bool chunked;
+    bool keep_alive;
+    size_t range_start;
+    size_t range_total;
+    size_t chunk_remaining;
 } http_parser_t;
 
+/* lets another task stop a request, its sockets get shut down right away */
+typedef struct
+{
+    bool cancelled;
+    int sockfd[CLOUD_DL_CONNECTIONS];
+} cloud_cancel_t;
+
 typedef struct
 {
     const char *host;
@@ -25,6 +87,15 @@ typedef struct
     const char *path;
     const char *auth;
     uint32_t range_start;
+    /* end of the range, excluding. 0 requests everything from range_start on */
+    uint32_t range_end;
+    /* kept connection to use, one per requesting task */
+    uint8_t conn;
+    /* sent with POST if set, else it is a GET request */
+    const uint8_t *body;
+    size_t body_length;
+    /* optional, see cloud_cancel_t */
+    cloud_cancel_t *cancel;
     esp_err_t (*data_received_cbr)(void *ctx, uint8_t *data, size_t length);
     void *data_received_ctx;
     esp_err_t (*connection_closed_cbr)(void *ctx);
@@ -42,16 +113,33 @@ typedef enum
     CC_STATE_ERROR
 } cloud_content_state_t;
 
+/* order in which queued requests are served, lower values first */
 typedef enum
 {
-    CBR_CLOSE_OK = 0x1000
+    /* a tag was placed and waits for its content */
+    CLOUD_PRIO_INTERACTIVE = 0,
+    /* content fetched in the background */
+    CLOUD_PRIO_PREFETCH,
+    /* reports, only sent when nothing else is to be done */
+    CLOUD_PRIO_TELEMETRY,
+    CLOUD_PRIO_COUNT
+} cloud_prio_t;
+
+typedef enum
+{
+    /* response complete, the connection may be used again */
+    CBR_CLOSE_OK = 0x1000,
+    /* response complete, but the server closes the connection */
+    CBR_CLOSE_CONN
 } cloud_cbr_err_t;
 
 typedef struct
 {
     /* input fields filled by requester */
     uint64_t nfc_uid;
+    cloud_prio_t prio;
     bool abort;
+    cloud_cancel_t cancel;
 
     /* working variables for the download handler */
     char *location;
@@ -62,13 +150,41 @@ typedef struct
     cloud_content_state_t state;
     uint32_t status_code;
     uint32_t content_length;
+    /* size of the whole file, content_length only covers the requested range */
+    uint32_t total_length;
     uint32_t received;
     SemaphoreHandle_t file_sem;
     FILE *handle;
+    /* SHA-1 over the received data, see tafverify.h */
+    struct tafverify_state_s *verify;
 } cloud_content_req_t;
 
+typedef struct
+{
+    uint32_t requests;
+    uint32_t reused;
+    uint32_t handshakes;
+    uint32_t resumptions;
+    uint32_t handshake_ms_last;
+    uint64_t handshake_ms_total;
+    uint32_t ttfb_ms_last;
+    uint32_t ttfb_ms_max;
+    /* requests failed because their queue was full */
+    uint32_t rejected;
+    uint32_t cancelled;
+    /* background downloads stopped for an interactive one */
+    uint32_t preempted;
+} cloud_stats_t;
+
 void cloud_init(void);
+void cloud_get_stats(cloud_stats_t *stats);
+bool cloud_is_available(void);
+esp_err_t cloud_post(const char *path, const uint8_t *body, size_t length, uint8_t *response, size_t *response_length);
 esp_err_t cloud_set_time(void);
-cloud_content_req_t *cloud_content_download(uint64_t nfc_uid, const uint8_t *nfc_token);
+cloud_content_req_t *cloud_content_download(uint64_t nfc_uid, const uint8_t *nfc_token, cloud_prio_t prio);
+cloud_content_req_t *cloud_content_download_file(uint64_t nfc_uid, const uint8_t *nfc_token, cloud_prio_t prio, const char *filename);
 cloud_content_state_t cloud_content_get_state(cloud_content_req_t *req);
+cloud_content_state_t cloud_content_wait(cloud_content_req_t *req, TickType_t timeout);
+void cloud_content_cancel(cloud_content_req_t *req);
+uint64_t cloud_get_active_uid(void);
 void cloud_content_cleanup(cloud_content_req_t *req);
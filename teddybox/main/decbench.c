@@ -0,0 +1,281 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "audio_element.h"
+#include "ringbuf.h"
+#include "opus_decoder.h"
+
+#include "decbench.h"
+#include "playback.h"
+#include "pcmgain.h"
+
+typedef struct
+{
+    pb_toniefile_t file;
+    /* between the decoder and the sink, sized like the playback's */
+    ringbuf_handle_t out_rb;
+    /* given by the sink once the ring was drained */
+    SemaphoreHandle_t sink_done;
+    int16_t sink_buffer[PCMGAIN_BUFFER_LEN / sizeof(int16_t)];
+    decbench_result_t *result;
+    uint32_t buckets[DECBENCH_BUCKETS];
+    uint32_t heap_free;
+    uint32_t heap_min;
+    /* end of the last write, the decoder worked from there on unless it waited for input */
+    int64_t last_write;
+    int64_t read_us;
+    int64_t decode_us;
+    int64_t gain_us;
+    pcmgain_state_t gain;
+} decbench_t;
+
+static const char *TAG = "[DB]";
+
+static int decbench_read(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    decbench_t *bench = (decbench_t *)context;
+    int64_t start = esp_timer_get_time();
+    int bytes = pb_toniefile_cbr(self, buffer, len, ticks_to_wait, &bench->file);
+
+    bench->read_us += esp_timer_get_time() - start;
+    if (bytes > 0)
+    {
+        bench->result->read_bytes += bytes;
+        if (bytes > bench->result->read_max)
+        {
+            bench->result->read_max = bytes;
+        }
+    }
+
+    return bytes;
+}
+
+/* only the decoder's own work is timed, not the reads before nor waiting for room in the ring */
+static int decbench_write(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
+{
+    decbench_t *bench = (decbench_t *)context;
+    int64_t now = esp_timer_get_time();
+    int64_t used = now - bench->last_write - bench->read_us;
+    decbench_result_t *result = bench->result;
+
+    if (bench->last_write && used >= 0)
+    {
+        uint32_t bucket = used / DECBENCH_BUCKET_US;
+        if (bucket >= DECBENCH_BUCKETS)
+        {
+            bucket = DECBENCH_BUCKETS - 1;
+        }
+        bench->buckets[bucket]++;
+        bench->decode_us += used;
+        if (used > (int64_t)result->max_us)
+        {
+            result->max_us = used;
+        }
+        result->frames++;
+    }
+    if (len > result->write_max)
+    {
+        result->write_max = len;
+    }
+
+    uint32_t heap_free = esp_get_free_heap_size();
+    if (heap_free < bench->heap_min)
+    {
+        bench->heap_min = heap_free;
+    }
+
+    int written = rb_write(bench->out_rb, buffer, len, ticks_to_wait);
+
+    bench->read_us = 0;
+    bench->last_write = esp_timer_get_time();
+
+    return written;
+}
+
+/* takes the place of the gain stage and I²S. the audio is dropped after the gain, so the decoder runs as fast as it can */
+static void decbench_sink(void *arg)
+{
+    decbench_t *bench = (decbench_t *)arg;
+
+    while (true)
+    {
+        int len = rb_read(bench->out_rb, (char *)bench->sink_buffer, sizeof(bench->sink_buffer), portMAX_DELAY);
+        if (len <= 0)
+        {
+            break;
+        }
+
+        int64_t start = esp_timer_get_time();
+        pcmgain_process(&bench->gain, bench->sink_buffer, len / sizeof(int16_t));
+        bench->gain_us += esp_timer_get_time() - start;
+        bench->result->pcm_bytes += len;
+    }
+
+    xSemaphoreGive(bench->sink_done);
+    vTaskDelete(NULL);
+}
+
+static uint32_t decbench_percentile(decbench_t *bench, uint32_t percent)
+{
+    uint32_t target = (bench->result->frames * percent + 99) / 100;
+    uint32_t count = 0;
+
+    for (int bucket = 0; bucket < DECBENCH_BUCKETS; bucket++)
+    {
+        count += bench->buckets[bucket];
+        if (count >= target)
+        {
+            return (bucket + 1) * DECBENCH_BUCKET_US;
+        }
+    }
+
+    return DECBENCH_BUCKETS * DECBENCH_BUCKET_US;
+}
+
+/* decode a stored content from start to end with the playback's decoder settings, without any output */
+esp_err_t decbench_run(uint64_t nfc_uid, decbench_result_t *result)
+{
+    if (pb_is_playing())
+    {
+        ESP_LOGW(TAG, "Not while playing");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memset(result, 0x00, sizeof(decbench_result_t));
+
+    decbench_t *bench = calloc(1, sizeof(decbench_t));
+    char *filename = pb_build_filename(nfc_uid);
+    if (!bench || !filename)
+    {
+        ESP_LOGE(TAG, "Out of memory");
+        free(filename);
+        free(bench);
+        return ESP_ERR_NO_MEM;
+    }
+    bench->result = result;
+
+    /* read the same way playback does, through the header cache and the prefetcher */
+    esp_err_t ret = pb_toniefile_open(&bench->file, filename);
+    free(filename);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%016llX cannot be read", nfc_uid);
+        free(bench);
+        return ESP_FAIL;
+    }
+
+    pcmgain_state_init(&bench->gain, PCMGAIN_UNITY / 2, 48000, 2);
+    bench->heap_free = esp_get_free_heap_size();
+    bench->heap_min = bench->heap_free;
+
+    opus_decoder_cfg_t opus_dec_cfg = DEFAULT_OPUS_DECODER_CONFIG();
+    opus_dec_cfg.stack_in_ext = false;
+    opus_dec_cfg.task_prio = PB_DEC_TASK_PRIO;
+    opus_dec_cfg.out_rb_size = PB_DEC_OUT_RB_SIZE;
+    audio_element_handle_t decoder = decoder_opus_init(&opus_dec_cfg);
+    bench->out_rb = rb_create(PB_DEC_OUT_RB_SIZE, 1);
+    bench->sink_done = xSemaphoreCreateBinary();
+
+    if (!decoder || !bench->out_rb || !bench->sink_done ||
+        xTaskCreatePinnedToCore(decbench_sink, "[TB] Bench sink", DECBENCH_SINK_STACK, bench, DECBENCH_SINK_PRIO, NULL, tskNO_AFFINITY) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create decoder");
+        if (decoder)
+        {
+            audio_element_deinit(decoder);
+        }
+        if (bench->out_rb)
+        {
+            rb_destroy(bench->out_rb);
+        }
+        if (bench->sink_done)
+        {
+            vSemaphoreDelete(bench->sink_done);
+        }
+        pb_toniefile_close(&bench->file);
+        free(bench);
+        return ESP_ERR_NO_MEM;
+    }
+    audio_element_set_read_cb(decoder, &decbench_read, bench);
+    audio_element_set_write_cb(decoder, &decbench_write, bench);
+
+    int64_t start = esp_timer_get_time();
+    audio_element_run(decoder);
+    audio_element_resume(decoder, 0, 0);
+
+    while (true)
+    {
+        audio_element_state_t state = audio_element_get_state(decoder);
+
+        if (state == AEL_STATE_FINISHED)
+        {
+            break;
+        }
+        if (state == AEL_STATE_ERROR || esp_timer_get_time() - start > DECBENCH_TIMEOUT_MS * 1000LL)
+        {
+            ESP_LOGE(TAG, "%016llX failed to decode", nfc_uid);
+            ret = ESP_FAIL;
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    result->wall_ms = (esp_timer_get_time() - start) / 1000;
+
+    audio_element_info_t music_info = {0};
+    audio_element_getinfo(decoder, &music_info);
+
+    audio_element_stop(decoder);
+    audio_element_wait_for_stop(decoder);
+    audio_element_terminate(decoder);
+    audio_element_deinit(decoder);
+    /* the reader closes the file at its end, but not when decoding failed */
+    pb_toniefile_close(&bench->file);
+
+    rb_done_write(bench->out_rb);
+    xSemaphoreTake(bench->sink_done, portMAX_DELAY);
+    vSemaphoreDelete(bench->sink_done);
+    rb_destroy(bench->out_rb);
+
+    result->sample_rate = music_info.sample_rates;
+    result->channels = music_info.channels;
+    uint32_t bytes_per_second = music_info.sample_rates * music_info.channels * (music_info.bits / 8);
+    if (bytes_per_second)
+    {
+        result->audio_ms = result->pcm_bytes * 1000 / bytes_per_second;
+    }
+    result->decode_ms = bench->decode_us / 1000;
+    result->gain_us = bench->gain_us;
+    if (bench->decode_us)
+    {
+        result->rtf_x100 = (uint64_t)result->audio_ms * 100000 / bench->decode_us;
+    }
+    result->p50_us = decbench_percentile(bench, 50);
+    result->p90_us = decbench_percentile(bench, 90);
+    result->p99_us = decbench_percentile(bench, 99);
+    result->heap_peak = bench->heap_free - bench->heap_min;
+    free(bench);
+
+    return ret;
+}
+
+void decbench_log(uint64_t nfc_uid, const decbench_result_t *result)
+{
+    ESP_LOGI(TAG, "%016llX: %u Hz, %u ch, %u ms audio in %u ms decode / %u ms wall, RTF %u.%02u",
+             nfc_uid, result->sample_rate, result->channels, result->audio_ms, result->decode_ms, result->wall_ms,
+             result->rtf_x100 / 100, result->rtf_x100 % 100);
+    ESP_LOGI(TAG, "  %u frames, p50 %u us, p90 %u us, p99 %u us, max %u us",
+             result->frames, result->p50_us, result->p90_us, result->p99_us, result->max_us);
+    ESP_LOGI(TAG, "  heap peak %u, reads up to %u bytes, writes up to %u bytes",
+             result->heap_peak, result->read_max, result->write_max);
+    if (result->audio_ms)
+    {
+        ESP_LOGI(TAG, "  gain stage %u us, %llu us per second of audio", result->gain_us, result->gain_us * 1000ULL / result->audio_ms);
+    }
+}
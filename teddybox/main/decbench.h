@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "pcmgain.h"
+
+/* per frame decode times are counted in buckets of this width, the last one takes everything above */
+#define DECBENCH_BUCKET_US 100
+#define DECBENCH_BUCKETS 100
+#define DECBENCH_TIMEOUT_MS 600000
+/* the decoded audio goes through a ring of PB_DEC_OUT_RB_SIZE into a task in place of the gain stage */
+#define DECBENCH_SINK_PRIO PCMGAIN_TASK_PRIO
+#define DECBENCH_SINK_STACK 2048
+
+typedef struct
+{
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t frames;
+    uint64_t pcm_bytes;
+    uint32_t audio_ms;
+    /* wall time of the whole run and the decoder's share, without waiting for input */
+    uint32_t wall_ms;
+    uint32_t decode_ms;
+    /* audio time decoded per decode time, in 1/100 */
+    uint32_t rtf_x100;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+    /* heap used beyond what was in use before the run */
+    uint32_t heap_peak;
+    /* read through the playback's reader and prefetcher, see pb_toniefile_cbr() */
+    uint32_t read_bytes;
+    uint32_t read_max;
+    uint32_t write_max;
+    /* the gain stage run over the decoded audio at half gain, see pcmgain.h */
+    uint32_t gain_us;
+} decbench_result_t;
+
+esp_err_t decbench_run(uint64_t nfc_uid, decbench_result_t *result);
+void decbench_log(uint64_t nfc_uid, const decbench_result_t *result);
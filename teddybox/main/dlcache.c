@@ -0,0 +1,412 @@
+
+#include <string.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "dlcache.h"
+#include "dljournal.h"
+#include "playback.h"
+
+/* queued to the writer to flush everything written so far */
+#define DLCACHE_SYNC_REQUEST -1
+/* queued by a reader which needs blocks that already left the RAM ring */
+#define DLCACHE_READER_SYNC -2
+
+typedef enum
+{
+    DLCACHE_FREE,
+    /* being filled by the downloader */
+    DLCACHE_FILLING,
+    /* complete, waiting for the writer. must not be refilled until written */
+    DLCACHE_PENDING,
+    /* on the card, but kept for readers until the slot is needed again */
+    DLCACHE_WRITTEN
+} dlcache_slot_state_t;
+
+typedef struct
+{
+    dlcache_slot_state_t state;
+    int32_t block;
+    size_t length;
+    /* points into dlcache_data, so neighbouring slots can be written with one call */
+    uint8_t *data;
+} dlcache_slot_t;
+
+static const char *TAG = "[DC]";
+
+static dlcache_slot_t dlcache_slots[DLCACHE_BLOCKS];
+static uint8_t dlcache_data[DLCACHE_BLOCKS][TONIEFILE_FRAME_SIZE];
+static cloud_content_req_t *dlcache_req = NULL;
+
+/* protects the slot headers and everything below */
+static SemaphoreHandle_t dlcache_mutex;
+/* given by the writer whenever a slot became writable again */
+static SemaphoreHandle_t dlcache_space_sem;
+/* given by the writer when a sync request was handled */
+static SemaphoreHandle_t dlcache_synced_sem;
+static QueueHandle_t dlcache_write_queue;
+
+/* bytes of the file on the card which a newly opened handle is able to read */
+static uint32_t dlcache_synced = 0;
+static uint32_t dlcache_written = 0;
+/* a reader sync is queued and not handled yet */
+static bool dlcache_sync_queued = false;
+/* first block not handed to the card yet, only used by the writer */
+static int32_t dlcache_next_write = 0;
+static int64_t dlcache_start_time = 0;
+static bool dlcache_failed = false;
+static dlcache_stats_t dlcache_stats;
+
+static void dlcache_sync(cloud_content_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+
+    fflush(req->handle);
+    fsync(fileno(req->handle));
+
+    xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+    dlcache_synced = dlcache_written;
+    dlcache_sync_queued = false;
+    dlcache_stats.syncs++;
+    dlcache_stats.write_us += esp_timer_get_time() - start;
+    xSemaphoreGive(dlcache_mutex);
+}
+
+/* write the pending blocks from dlcache_next_write on in one go. unless flushing, only a complete aligned group
+   gets written, which is a multiple of the card's sector size and never wraps around in dlcache_data */
+static bool dlcache_write_group(cloud_content_req_t *req, bool flush)
+{
+    xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+    int32_t first = dlcache_next_write;
+    int32_t count = 0;
+    size_t length = 0;
+
+    while (count < DLCACHE_WRITE_BLOCKS - first % DLCACHE_WRITE_BLOCKS)
+    {
+        dlcache_slot_t *slot = &dlcache_slots[(first + count) % DLCACHE_BLOCKS];
+        if (slot->state != DLCACHE_PENDING || slot->block != first + count)
+        {
+            break;
+        }
+        length = count * TONIEFILE_FRAME_SIZE + slot->length;
+        count++;
+
+        /* only the last block of a download is a short one */
+        if (slot->length < TONIEFILE_FRAME_SIZE)
+        {
+            break;
+        }
+    }
+    xSemaphoreGive(dlcache_mutex);
+
+    if (!count || (!flush && (first + count) % DLCACHE_WRITE_BLOCKS))
+    {
+        return false;
+    }
+
+    /* nobody touches a pending slot, so it can be written without holding the state lock */
+    int64_t start = esp_timer_get_time();
+    fseek(req->handle, first * TONIEFILE_FRAME_SIZE, SEEK_SET);
+    bool failed = (fwrite(dlcache_slots[first % DLCACHE_BLOCKS].data, length, 1, req->handle) != 1);
+    int64_t duration = esp_timer_get_time() - start;
+
+    xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+    for (int32_t block = first; block < first + count; block++)
+    {
+        dlcache_slots[block % DLCACHE_BLOCKS].state = DLCACHE_WRITTEN;
+    }
+    dlcache_next_write = first + count;
+    /* only what made it to the card counts as synced later on */
+    if (!failed)
+    {
+        dlcache_written = first * TONIEFILE_FRAME_SIZE + length;
+    }
+    dlcache_stats.blocks_written += count;
+    dlcache_stats.writes++;
+    dlcache_stats.bytes_written += length;
+    dlcache_stats.write_us += duration;
+    if (failed)
+    {
+        dlcache_failed = true;
+    }
+    /* the journal can only advance to synced data, so sync whenever a checkpoint was passed */
+    const uint32_t interval = DLJOURNAL_BLOCKS * TONIEFILE_FRAME_SIZE;
+    bool sync = (dlcache_written / interval > dlcache_synced / interval);
+    xSemaphoreGive(dlcache_mutex);
+
+    if (failed)
+    {
+        ESP_LOGE(TAG, "Write of blocks %d-%d failed", first, first + count - 1);
+    }
+    if (sync)
+    {
+        dlcache_sync(req);
+    }
+    xSemaphoreGive(dlcache_space_sem);
+
+    return !failed;
+}
+
+static void dlcache_task(void *arg)
+{
+    while (true)
+    {
+        int32_t block;
+
+        if (xQueueReceive(dlcache_write_queue, &block, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+
+        cloud_content_req_t *req = dlcache_req;
+        bool flush = (block == DLCACHE_SYNC_REQUEST);
+
+        if (block == DLCACHE_READER_SYNC)
+        {
+            xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+            bool sync = (dlcache_synced < dlcache_written);
+            dlcache_sync_queued = false;
+            xSemaphoreGive(dlcache_mutex);
+            if (!sync)
+            {
+                continue;
+            }
+        }
+
+        /* the header is read through the same handle when playback starts, so keep the lock for that */
+        while (!xSemaphoreTake(req->file_sem, 1000 / portTICK_PERIOD_MS))
+        {
+            ESP_LOGE(TAG, "Timed out waiting for file lock...");
+        }
+
+        while (block != DLCACHE_READER_SYNC && dlcache_write_group(req, flush))
+        {
+        }
+
+        if (block == DLCACHE_READER_SYNC)
+        {
+            dlcache_sync(req);
+        }
+        else if (flush)
+        {
+            dlcache_sync(req);
+            xSemaphoreGive(req->file_sem);
+            xSemaphoreGive(dlcache_synced_sem);
+            continue;
+        }
+        xSemaphoreGive(req->file_sem);
+    }
+}
+
+/* called when the download starts writing at req->received. a block which is partially on the card already
+   gets completed in RAM, so blocks are always written as a whole */
+esp_err_t dlcache_start(cloud_content_req_t *req)
+{
+    xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+    for (int pos = 0; pos < DLCACHE_BLOCKS; pos++)
+    {
+        dlcache_slots[pos].state = DLCACHE_FREE;
+    }
+    /* a split download starts here once per range, keep counting for the whole download */
+    if (dlcache_req != req)
+    {
+        memset(&dlcache_stats, 0x00, sizeof(dlcache_stats));
+        dlcache_start_time = esp_timer_get_time();
+    }
+    dlcache_req = req;
+    dlcache_synced = req->received;
+    dlcache_written = req->received;
+    dlcache_sync_queued = false;
+    dlcache_failed = false;
+
+    int32_t block = req->received / TONIEFILE_FRAME_SIZE;
+    dlcache_next_write = block;
+    size_t offset = req->received % TONIEFILE_FRAME_SIZE;
+    dlcache_slot_t *slot = &dlcache_slots[block % DLCACHE_BLOCKS];
+
+    if (offset)
+    {
+        fseek(req->handle, block * TONIEFILE_FRAME_SIZE, SEEK_SET);
+        if (fread(slot->data, offset, 1, req->handle) != 1)
+        {
+            xSemaphoreGive(dlcache_mutex);
+            ESP_LOGE(TAG, "Failed to read partial block %d", block);
+            return ESP_FAIL;
+        }
+        slot->state = DLCACHE_FILLING;
+        slot->block = block;
+        slot->length = offset;
+    }
+    xSemaphoreGive(dlcache_mutex);
+
+    return ESP_OK;
+}
+
+/* take data received at req->received. completed blocks are handed to the writer */
+esp_err_t dlcache_put(cloud_content_req_t *req, const uint8_t *data, size_t length)
+{
+    uint32_t pos = req->received;
+
+    while (length > 0)
+    {
+        int32_t block = pos / TONIEFILE_FRAME_SIZE;
+        size_t offset = pos % TONIEFILE_FRAME_SIZE;
+        dlcache_slot_t *slot = &dlcache_slots[block % DLCACHE_BLOCKS];
+
+        xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+        if (slot->state != DLCACHE_FILLING || slot->block != block)
+        {
+            /* the card is slower than the network right now, wait for the writer */
+            while (slot->state == DLCACHE_PENDING && !dlcache_failed)
+            {
+                dlcache_stats.write_waits++;
+                xSemaphoreGive(dlcache_mutex);
+                xSemaphoreTake(dlcache_space_sem, 100 / portTICK_PERIOD_MS);
+                xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+            }
+            slot->state = DLCACHE_FILLING;
+            slot->block = block;
+            slot->length = offset;
+        }
+
+        if (dlcache_failed)
+        {
+            xSemaphoreGive(dlcache_mutex);
+            return ESP_FAIL;
+        }
+
+        size_t chunk = TONIEFILE_FRAME_SIZE - offset;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        memcpy(&slot->data[offset], data, chunk);
+        slot->length = offset + chunk;
+
+        if (slot->length == TONIEFILE_FRAME_SIZE)
+        {
+            slot->state = DLCACHE_PENDING;
+            xQueueSend(dlcache_write_queue, &block, portMAX_DELAY);
+        }
+        xSemaphoreGive(dlcache_mutex);
+
+        data += chunk;
+        length -= chunk;
+        pos += chunk;
+        dlcache_stats.bytes_received += chunk;
+    }
+
+    return ESP_OK;
+}
+
+/* write out the last, incomplete block and wait until everything is on the card */
+esp_err_t dlcache_finish(cloud_content_req_t *req)
+{
+    /* the download might have failed before anything was written */
+    if (dlcache_req != req || !req->handle)
+    {
+        return ESP_FAIL;
+    }
+
+    xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+    for (int pos = 0; pos < DLCACHE_BLOCKS; pos++)
+    {
+        dlcache_slot_t *slot = &dlcache_slots[pos];
+        if (slot->state == DLCACHE_FILLING && slot->length > 0)
+        {
+            slot->state = DLCACHE_PENDING;
+            xQueueSend(dlcache_write_queue, &slot->block, portMAX_DELAY);
+        }
+    }
+    xSemaphoreGive(dlcache_mutex);
+
+    int32_t sync = DLCACHE_SYNC_REQUEST;
+    xSemaphoreTake(dlcache_synced_sem, 0);
+    xQueueSend(dlcache_write_queue, &sync, portMAX_DELAY);
+    xSemaphoreTake(dlcache_synced_sem, portMAX_DELAY);
+
+    dlcache_stats_t stats;
+    dlcache_get_stats(&stats);
+    ESP_LOGI(TAG, "%d blocks written in %d writes, %d syncs, %d blocks played from RAM, waited %d times for the card",
+             stats.blocks_written, stats.writes, stats.syncs, stats.ram_hits, stats.write_waits);
+    ESP_LOGI(TAG, "Network %d KiB/s, card %d KiB/s", stats.net_rate / 1024, stats.card_rate / 1024);
+
+    return dlcache_failed ? ESP_FAIL : ESP_OK;
+}
+
+/* copy a completely received block from RAM. returns its length or DLCACHE_NOT_CACHED */
+int32_t dlcache_read(int32_t block, uint8_t *buffer)
+{
+    int32_t avail = DLCACHE_NOT_CACHED;
+    dlcache_slot_t *slot = &dlcache_slots[block % DLCACHE_BLOCKS];
+
+    xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+    if (slot->block == block && (slot->state == DLCACHE_PENDING || slot->state == DLCACHE_WRITTEN))
+    {
+        memcpy(buffer, slot->data, slot->length);
+        avail = slot->length;
+        dlcache_stats.ram_hits++;
+    }
+    xSemaphoreGive(dlcache_mutex);
+
+    return avail;
+}
+
+uint32_t dlcache_get_synced()
+{
+    return dlcache_synced;
+}
+
+/* a reader needs the file on the card up to end. only worth a sync when the writer got that far already,
+   otherwise the blocks are still on their way through RAM */
+void dlcache_request_sync(uint32_t end)
+{
+    int32_t sync = DLCACHE_READER_SYNC;
+
+    xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+    if (dlcache_sync_queued || end <= dlcache_synced || end > dlcache_written)
+    {
+        xSemaphoreGive(dlcache_mutex);
+        return;
+    }
+    dlcache_sync_queued = (xQueueSend(dlcache_write_queue, &sync, 0) == pdTRUE);
+    xSemaphoreGive(dlcache_mutex);
+}
+
+void dlcache_get_stats(dlcache_stats_t *stats)
+{
+    xSemaphoreTake(dlcache_mutex, portMAX_DELAY);
+    memcpy(stats, &dlcache_stats, sizeof(dlcache_stats_t));
+    if (dlcache_req)
+    {
+        stats->receive_us = esp_timer_get_time() - dlcache_start_time;
+    }
+    xSemaphoreGive(dlcache_mutex);
+
+    stats->net_rate = stats->receive_us ? stats->bytes_received * 1000000ULL / stats->receive_us : 0;
+    stats->card_rate = stats->write_us ? stats->bytes_written * 1000000ULL / stats->write_us : 0;
+}
+
+void dlcache_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    for (int pos = 0; pos < DLCACHE_BLOCKS; pos++)
+    {
+        dlcache_slots[pos].data = dlcache_data[pos];
+    }
+
+    dlcache_mutex = xSemaphoreCreateMutex();
+    dlcache_space_sem = xSemaphoreCreateBinary();
+    dlcache_synced_sem = xSemaphoreCreateBinary();
+    /* one entry per slot plus the sync requests of the downloader and a reader */
+    dlcache_write_queue = xQueueCreate(DLCACHE_BLOCKS + 2, sizeof(int32_t));
+
+    xTaskCreatePinnedToCore(dlcache_task, "[TB] DL writer", DLCACHE_TASK_STACK, NULL, DLCACHE_TASK_PRIO, NULL, tskNO_AFFINITY);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "cloud.h"
+
+#define DLCACHE_TASK_PRIO 6
+#define DLCACHE_TASK_STACK 3072
+
+/* number of downloaded TAF blocks kept in RAM, each TONIEFILE_FRAME_SIZE in size */
+#define DLCACHE_BLOCKS 8
+/* blocks are written to the card in aligned groups of this many, DLCACHE_BLOCKS has to be a multiple of it */
+#define DLCACHE_WRITE_BLOCKS 4
+/* written blocks are only synced at journal checkpoints, when a reader asks for them or when finished */
+
+#define DLCACHE_NOT_CACHED -1
+
+typedef struct
+{
+    uint32_t blocks_written;
+    uint32_t writes;
+    uint32_t syncs;
+    uint32_t ram_hits;
+    uint32_t write_waits;
+    uint64_t bytes_received;
+    uint64_t bytes_written;
+    /* time spent writing and syncing, and since the download started */
+    uint64_t write_us;
+    uint64_t receive_us;
+    /* in bytes per second, filled in by dlcache_get_stats() */
+    uint32_t net_rate;
+    uint32_t card_rate;
+} dlcache_stats_t;
+
+void dlcache_init(void);
+esp_err_t dlcache_start(cloud_content_req_t *req);
+esp_err_t dlcache_put(cloud_content_req_t *req, const uint8_t *data, size_t length);
+esp_err_t dlcache_finish(cloud_content_req_t *req);
+int32_t dlcache_read(int32_t block, uint8_t *buffer);
+uint32_t dlcache_get_synced(void);
+void dlcache_request_sync(uint32_t end);
+void dlcache_get_stats(dlcache_stats_t *stats);
@@ -0,0 +1,135 @@
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+
+#include "dljournal.h"
+
+static const char *TAG = "[DJ]";
+static dljournal_stats_t dljournal_stats;
+
+static char *dljournal_filename(const char *filename)
+{
+    char *journal_filename = malloc(strlen(filename) + sizeof(DLJOURNAL_EXTENSION));
+
+    strcpy(journal_filename, filename);
+    strcat(journal_filename, DLJOURNAL_EXTENSION);
+
+    return journal_filename;
+}
+
+static uint32_t dljournal_crc(const dljournal_entry_t *entry)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)entry, offsetof(dljournal_entry_t, crc));
+}
+
+/* the newest intact entry, a torn write only damages the slot being written */
+esp_err_t dljournal_load(const char *filename, dljournal_entry_t *entry)
+{
+    char *journal_filename = dljournal_filename(filename);
+    FILE *fd = fopen(journal_filename, "rb");
+    free(journal_filename);
+
+    if (!fd)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    for (int slot = 0; slot < DLJOURNAL_SLOTS; slot++)
+    {
+        dljournal_entry_t slot_entry;
+
+        if (fread(&slot_entry, sizeof(slot_entry), 1, fd) != 1)
+        {
+            break;
+        }
+        /* a journal of another firmware cannot be continued, and its slots are not where this one expects them */
+        if (slot_entry.magic == DLJOURNAL_MAGIC && (slot_entry.version != DLJOURNAL_VERSION || slot_entry.size != sizeof(slot_entry)))
+        {
+            ESP_LOGW(TAG, "'%s' has a journal of version %d with %d byte entries, discarding it", filename, slot_entry.version, slot_entry.size);
+            ret = ESP_ERR_INVALID_VERSION;
+            break;
+        }
+        if (slot_entry.magic != DLJOURNAL_MAGIC || slot_entry.crc != dljournal_crc(&slot_entry))
+        {
+            ESP_LOGW(TAG, "'%s' slot %d is damaged", filename, slot);
+            continue;
+        }
+        if (ret != ESP_OK || (int32_t)(slot_entry.sequence - entry->sequence) > 0)
+        {
+            memcpy(entry, &slot_entry, sizeof(slot_entry));
+            ret = ESP_OK;
+        }
+    }
+    fclose(fd);
+
+    if (ret == ESP_ERR_INVALID_VERSION)
+    {
+        dljournal_remove(filename);
+    }
+
+    return ret;
+}
+
+/* write the entry with the next sequence number into the older slot and wait until it is on the card */
+esp_err_t dljournal_commit(const char *filename, dljournal_entry_t *entry)
+{
+    int64_t start = esp_timer_get_time();
+    char *journal_filename = dljournal_filename(filename);
+    FILE *fd = fopen(journal_filename, "rb+");
+
+    if (!fd)
+    {
+        fd = fopen(journal_filename, "wb+");
+    }
+    free(journal_filename);
+
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to open journal of '%s'", filename);
+        dljournal_stats.failed++;
+        return ESP_FAIL;
+    }
+
+    entry->magic = DLJOURNAL_MAGIC;
+    entry->version = DLJOURNAL_VERSION;
+    entry->size = sizeof(dljournal_entry_t);
+    entry->sequence++;
+    entry->crc = dljournal_crc(entry);
+
+    fseek(fd, (entry->sequence % DLJOURNAL_SLOTS) * sizeof(dljournal_entry_t), SEEK_SET);
+    bool failed = (fwrite(entry, sizeof(dljournal_entry_t), 1, fd) != 1);
+    fflush(fd);
+    fsync(fileno(fd));
+    fclose(fd);
+
+    if (failed)
+    {
+        ESP_LOGE(TAG, "Failed to write journal of '%s'", filename);
+        dljournal_stats.failed++;
+        return ESP_FAIL;
+    }
+    dljournal_stats.commits++;
+    dljournal_stats.commit_us += esp_timer_get_time() - start;
+
+    return ESP_OK;
+}
+
+void dljournal_remove(const char *filename)
+{
+    char *journal_filename = dljournal_filename(filename);
+
+    unlink(journal_filename);
+    free(journal_filename);
+}
+
+void dljournal_get_stats(dljournal_stats_t *stats)
+{
+    memcpy(stats, &dljournal_stats, sizeof(dljournal_stats_t));
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "mbedtls/sha1.h"
+
+#define DLJOURNAL_MAGIC 0x4E524A54 /* "TJRN" */
+/* the hash state is stored as mbedtls keeps it, so count up whenever the entry or mbedtls changes */
+#define DLJOURNAL_VERSION 1
+#define DLJOURNAL_EXTENSION ".JRN"
+/* entries are written alternately, so a power cut while writing one leaves the other intact */
+#define DLJOURNAL_SLOTS 2
+/* a checkpoint is taken every this many blocks and committed once the card has them */
+#define DLJOURNAL_BLOCKS 32
+
+/* the state of a download the next attempt can trust */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    /* sizeof(dljournal_entry_t), catches a different mbedtls configuration the version was not bumped for */
+    uint16_t size;
+    uint32_t sequence;
+    /* everything before this file position is on the card and part of the hash state */
+    uint32_t pos;
+    mbedtls_sha1_context ctx;
+    uint32_t crc;
+} dljournal_entry_t;
+
+typedef struct
+{
+    uint32_t commits;
+    uint32_t failed;
+    uint64_t commit_us;
+} dljournal_stats_t;
+
+esp_err_t dljournal_load(const char *filename, dljournal_entry_t *entry);
+esp_err_t dljournal_commit(const char *filename, dljournal_entry_t *entry);
+void dljournal_remove(const char *filename);
+void dljournal_get_stats(dljournal_stats_t *stats);
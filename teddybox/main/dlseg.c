@@ -0,0 +1,541 @@
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+
+#include "dlseg.h"
+#include "playback.h"
+
+#define DLSEG_BLOCK(pos) ((pos) / TONIEFILE_FRAME_SIZE)
+#define DLSEG_BLOCKS(length) (((length) + TONIEFILE_FRAME_SIZE - 1) / TONIEFILE_FRAME_SIZE)
+#define DLSEG_BITMAP_SIZE(blocks) (((blocks) + 7) / 8)
+
+static const char *TAG = "[DS]";
+
+/* the main download fetches [primary_start, primary_end) and always continues where the file is complete up to.
+   helpers take the segments behind that, so the part being played next arrives first */
+static struct
+{
+    cloud_content_req_t *req;
+    char *filename;
+    uint32_t blocks;
+    uint8_t *done;
+    uint8_t *claimed;
+    uint32_t primary_start;
+    uint32_t primary_end;
+    uint32_t active;
+    /* blocks written by helpers since the last sync */
+    uint32_t unsynced;
+    bool stopping;
+    /* a helper got nothing at all, e.g. the server does not support ranges. leave the rest to the main download */
+    bool failed;
+    bool saved;
+} dlseg;
+
+/* protects the state above */
+static SemaphoreHandle_t dlseg_mutex;
+/* counts helpers to wake up for a new download */
+static SemaphoreHandle_t dlseg_job_sem;
+/* given whenever a helper finished a segment */
+static SemaphoreHandle_t dlseg_done_sem;
+static dlseg_stats_t dlseg_stats;
+
+static bool dlseg_test(const uint8_t *bitmap, uint32_t block)
+{
+    return bitmap[block / 8] & (1 << (block % 8));
+}
+
+static void dlseg_set(uint8_t *bitmap, uint32_t block, bool value)
+{
+    if (value)
+    {
+        bitmap[block / 8] |= (1 << (block % 8));
+    }
+    else
+    {
+        bitmap[block / 8] &= ~(1 << (block % 8));
+    }
+}
+
+static char *dlseg_filename(const char *filename)
+{
+    char *seg_filename = malloc(strlen(filename) + sizeof(DLSEG_EXTENSION));
+
+    strcpy(seg_filename, filename);
+    strcat(seg_filename, DLSEG_EXTENSION);
+
+    return seg_filename;
+}
+
+/* write the sidecar, to be called with the state locked */
+static void dlseg_save()
+{
+    char *seg_filename = dlseg_filename(dlseg.filename);
+    FILE *fd = fopen(seg_filename, "wb");
+
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to create '%s'", seg_filename);
+        free(seg_filename);
+        return;
+    }
+
+    dlseg_header_t header = {
+        .magic = DLSEG_MAGIC,
+        .total_length = dlseg.req->total_length,
+        .blocks = dlseg.blocks};
+
+    fwrite(&header, sizeof(header), 1, fd);
+    fwrite(dlseg.done, DLSEG_BITMAP_SIZE(dlseg.blocks), 1, fd);
+    fclose(fd);
+    free(seg_filename);
+
+    dlseg.saved = true;
+}
+
+/* make what the helpers wrote so far visible to readers on the card */
+static void dlseg_sync(cloud_content_req_t *req)
+{
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+    uint32_t blocks = dlseg.unsynced;
+    xSemaphoreGive(dlseg_mutex);
+
+    if (!blocks)
+    {
+        return;
+    }
+
+    xSemaphoreTake(req->file_sem, portMAX_DELAY);
+    fflush(req->handle);
+    fsync(fileno(req->handle));
+    xSemaphoreGive(req->file_sem);
+
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+    dlseg.unsynced -= blocks;
+    dlseg_stats.syncs++;
+    xSemaphoreGive(dlseg_mutex);
+}
+
+static void dlseg_remove(const char *filename)
+{
+    char *seg_filename = dlseg_filename(filename);
+
+    unlink(seg_filename);
+    free(seg_filename);
+}
+
+/* read the sidecar of the given file. returns the bitmap, which the caller has to free */
+static uint8_t *dlseg_load(const char *filename, dlseg_header_t *header)
+{
+    char *seg_filename = dlseg_filename(filename);
+    FILE *fd = fopen(seg_filename, "rb");
+    free(seg_filename);
+
+    if (!fd)
+    {
+        return NULL;
+    }
+
+    uint8_t *bitmap = NULL;
+    if (fread(header, sizeof(dlseg_header_t), 1, fd) == 1 && header->magic == DLSEG_MAGIC &&
+        header->blocks == DLSEG_BLOCKS(header->total_length))
+    {
+        bitmap = malloc(DLSEG_BITMAP_SIZE(header->blocks));
+        if (bitmap && fread(bitmap, DLSEG_BITMAP_SIZE(header->blocks), 1, fd) != 1)
+        {
+            free(bitmap);
+            bitmap = NULL;
+        }
+    }
+    fclose(fd);
+
+    return bitmap;
+}
+
+/* a file with a sidecar has holes, so only the part in front of the first missing block can be used */
+uint32_t dlseg_resume_pos(const char *filename, uint32_t received)
+{
+    dlseg_header_t header;
+    uint8_t *bitmap = dlseg_load(filename, &header);
+
+    if (!bitmap)
+    {
+        return received;
+    }
+
+    uint32_t block = 0;
+    while (block < header.blocks && dlseg_test(bitmap, block))
+    {
+        block++;
+    }
+    free(bitmap);
+
+    uint32_t pos = block * TONIEFILE_FRAME_SIZE;
+    if (pos > header.total_length)
+    {
+        pos = header.total_length;
+    }
+    ESP_LOGI(TAG, "'%s' has segments, continue at %d", filename, pos);
+
+    return pos;
+}
+
+bool dlseg_pending(const char *filename)
+{
+    char *seg_filename = dlseg_filename(filename);
+    struct stat st;
+    bool exists = (stat(seg_filename, &st) == 0);
+
+    free(seg_filename);
+
+    return exists;
+}
+
+/* end of the first request, before the total size is known */
+uint32_t dlseg_first(cloud_content_req_t *req)
+{
+#if CLOUD_DL_CONNECTIONS > 1
+    return (DLSEG_BLOCK(req->received) + DLSEG_SEGMENT_BLOCKS) * TONIEFILE_FRAME_SIZE;
+#else
+    return 0;
+#endif
+}
+
+/* called when the total size is known, splits the rest of the download if it is large enough */
+void dlseg_begin(cloud_content_req_t *req)
+{
+    uint32_t blocks = DLSEG_BLOCKS(req->total_length);
+    uint32_t first = DLSEG_BLOCK(req->received);
+
+    if (CLOUD_DL_CONNECTIONS < 2 || blocks < first + DLSEG_MIN_BLOCKS)
+    {
+        return;
+    }
+
+    uint8_t *done = calloc(1, DLSEG_BITMAP_SIZE(blocks));
+    uint8_t *claimed = calloc(1, DLSEG_BITMAP_SIZE(blocks));
+    if (!done || !claimed)
+    {
+        ESP_LOGW(TAG, "Not enough memory for %d blocks, downloading in one piece", blocks);
+        free(done);
+        free(claimed);
+        return;
+    }
+
+    /* continue a download which was split before */
+    dlseg_header_t header;
+    uint8_t *bitmap = dlseg_load(req->filename, &header);
+    if (bitmap && header.total_length == req->total_length)
+    {
+        memcpy(done, bitmap, DLSEG_BITMAP_SIZE(blocks));
+    }
+    free(bitmap);
+
+    for (uint32_t block = 0; block < first; block++)
+    {
+        dlseg_set(done, block, true);
+    }
+
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+    dlseg.req = req;
+    dlseg.filename = strdup(req->filename);
+    dlseg.blocks = blocks;
+    dlseg.done = done;
+    dlseg.claimed = claimed;
+    dlseg.primary_start = first;
+    dlseg.primary_end = DLSEG_BLOCK(dlseg_first(req));
+    dlseg.active = 0;
+    dlseg.unsynced = 0;
+    dlseg.stopping = false;
+    dlseg.failed = false;
+    dlseg.saved = false;
+    memset(&dlseg_stats, 0x00, sizeof(dlseg_stats));
+    dlseg_stats.segments++;
+    xSemaphoreGive(dlseg_mutex);
+
+    ESP_LOGI(TAG, "Download of %d blocks with %d connections", blocks, CLOUD_DL_CONNECTIONS);
+
+    for (int helper = 1; helper < CLOUD_DL_CONNECTIONS; helper++)
+    {
+        xSemaphoreGive(dlseg_job_sem);
+    }
+}
+
+/* mark what the main download received and pick its next range. returns the end of it or 0 if there is nothing left */
+uint32_t dlseg_next(cloud_content_req_t *req)
+{
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+
+    if (dlseg.req != req)
+    {
+        xSemaphoreGive(dlseg_mutex);
+        return (req->received < req->total_length) ? req->total_length : 0;
+    }
+
+    uint32_t received_block = DLSEG_BLOCK(req->received);
+    for (uint32_t block = dlseg.primary_start; block < received_block; block++)
+    {
+        dlseg_set(dlseg.done, block, true);
+    }
+    if (req->received >= req->total_length)
+    {
+        dlseg_set(dlseg.done, dlseg.blocks - 1, true);
+    }
+
+    while (true)
+    {
+        /* readers must be able to see the blocks before the main download skips them */
+        if (dlseg.unsynced && DLSEG_BLOCK(req->received) < dlseg.blocks && dlseg_test(dlseg.done, DLSEG_BLOCK(req->received)))
+        {
+            xSemaphoreGive(dlseg_mutex);
+            dlseg_sync(req);
+            xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+            continue;
+        }
+
+        /* skip what the helpers fetched already, it is on the card */
+        uint32_t block = DLSEG_BLOCK(req->received);
+        while (block < dlseg.blocks && dlseg_test(dlseg.done, block))
+        {
+            block++;
+            req->received = block * TONIEFILE_FRAME_SIZE;
+        }
+        if (req->received >= req->total_length)
+        {
+            req->received = req->total_length;
+            dlseg.primary_start = dlseg.blocks;
+            dlseg.primary_end = dlseg.blocks;
+            xSemaphoreGive(dlseg_mutex);
+            return 0;
+        }
+
+        /* a helper is still busy with the blocks needed next */
+        if (dlseg_test(dlseg.claimed, block))
+        {
+            dlseg_stats.waits++;
+            xSemaphoreGive(dlseg_mutex);
+            xSemaphoreTake(dlseg_done_sem, 100 / portTICK_PERIOD_MS);
+            if (req->abort)
+            {
+                return 0;
+            }
+            xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+            continue;
+        }
+
+        uint32_t end = block + 1;
+        while (end < dlseg.blocks && end - block < DLSEG_SEGMENT_BLOCKS && !dlseg_test(dlseg.done, end) && !dlseg_test(dlseg.claimed, end))
+        {
+            end++;
+        }
+        dlseg.primary_start = block;
+        dlseg.primary_end = end;
+        dlseg_stats.segments++;
+        xSemaphoreGive(dlseg_mutex);
+
+        uint32_t end_pos = end * TONIEFILE_FRAME_SIZE;
+        return (end_pos > req->total_length) ? req->total_length : end_pos;
+    }
+}
+
+/* wait for the helpers to leave the download and keep the sidecar if the file has holes */
+void dlseg_stop(cloud_content_req_t *req)
+{
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+    if (dlseg.req != req)
+    {
+        xSemaphoreGive(dlseg_mutex);
+        if (req->total_length && req->received >= req->total_length)
+        {
+            dlseg_remove(req->filename);
+        }
+        return;
+    }
+
+    dlseg.stopping = true;
+    while (dlseg.active)
+    {
+        xSemaphoreGive(dlseg_mutex);
+        xSemaphoreTake(dlseg_done_sem, 100 / portTICK_PERIOD_MS);
+        xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+    }
+
+    /* the sidecar must not mark blocks which a power loss could still take away */
+    xSemaphoreGive(dlseg_mutex);
+    dlseg_sync(req);
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+
+    /* whatever the main download received in its last range counts as well */
+    uint32_t received_block = DLSEG_BLOCK(req->received);
+    for (uint32_t block = dlseg.primary_start; block < received_block && block < dlseg.blocks; block++)
+    {
+        dlseg_set(dlseg.done, block, true);
+    }
+
+    bool holes = false;
+    for (uint32_t block = received_block; block < dlseg.blocks; block++)
+    {
+        if (dlseg_test(dlseg.done, block))
+        {
+            holes = true;
+            break;
+        }
+    }
+
+    if (req->received >= req->total_length || !holes)
+    {
+        dlseg_remove(dlseg.filename);
+    }
+    else
+    {
+        dlseg_save();
+    }
+
+    ESP_LOGI(TAG, "%d segments, %d by helpers with %d blocks, %d failed, %d syncs, waited %d times for helpers",
+             dlseg_stats.segments, dlseg_stats.helper_segments, dlseg_stats.helper_blocks, dlseg_stats.helper_failed, dlseg_stats.syncs, dlseg_stats.waits);
+
+    free(dlseg.done);
+    free(dlseg.claimed);
+    free(dlseg.filename);
+    dlseg.done = NULL;
+    dlseg.claimed = NULL;
+    dlseg.filename = NULL;
+    dlseg.req = NULL;
+    dlseg.stopping = false;
+    xSemaphoreGive(dlseg_mutex);
+}
+
+/* wait for a download to help with and take the next range nobody works on, ESP_ERR_TIMEOUT if none came up */
+esp_err_t dlseg_claim(cloud_content_req_t **req, uint32_t *start, uint32_t *end, TickType_t timeout)
+{
+    while (true)
+    {
+        xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+        if (dlseg.req && !dlseg.stopping && !dlseg.failed && !dlseg.req->abort)
+        {
+            uint32_t block = dlseg.primary_end;
+            while (block < dlseg.blocks && (dlseg_test(dlseg.done, block) || dlseg_test(dlseg.claimed, block)))
+            {
+                block++;
+            }
+
+            if (block < dlseg.blocks)
+            {
+                uint32_t last = block;
+                while (last < dlseg.blocks && last - block < DLSEG_SEGMENT_BLOCKS && !dlseg_test(dlseg.done, last) && !dlseg_test(dlseg.claimed, last))
+                {
+                    dlseg_set(dlseg.claimed, last, true);
+                    last++;
+                }
+                dlseg.active++;
+
+                /* before the first block behind the end gets written, a power loss must not leave a file that looks complete */
+                if (!dlseg.saved)
+                {
+                    dlseg_save();
+                }
+
+                *req = dlseg.req;
+                *start = block;
+                *end = last;
+                xSemaphoreGive(dlseg_mutex);
+
+                return ESP_OK;
+            }
+        }
+        xSemaphoreGive(dlseg_mutex);
+
+        if (xSemaphoreTake(dlseg_job_sem, timeout) != pdTRUE)
+        {
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+}
+
+/* write a whole block received by a helper, the main download might write through the same handle */
+esp_err_t dlseg_write(cloud_content_req_t *req, uint32_t block, const uint8_t *data, size_t length)
+{
+    while (!xSemaphoreTake(req->file_sem, 1000 / portTICK_PERIOD_MS))
+    {
+        ESP_LOGE(TAG, "Timed out waiting for file lock...");
+    }
+
+    fseek(req->handle, block * TONIEFILE_FRAME_SIZE, SEEK_SET);
+    bool failed = (fwrite(data, length, 1, req->handle) != 1);
+
+    xSemaphoreGive(req->file_sem);
+
+    if (failed)
+    {
+        ESP_LOGE(TAG, "Write of block %d failed", block);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* a helper is done with [start, end), of which [start, done_end) was received. the rest goes back to the pool */
+void dlseg_complete(cloud_content_req_t *req, uint32_t start, uint32_t end, uint32_t done_end)
+{
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+    dlseg.unsynced += done_end - start;
+    bool sync = (dlseg.unsynced >= DLSEG_SYNC_BLOCKS && !dlseg.stopping);
+    xSemaphoreGive(dlseg_mutex);
+
+    /* the sidecar is only updated along with a sync, dlseg_next and dlseg_stop take care of the rest */
+    if (sync)
+    {
+        dlseg_sync(req);
+    }
+
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+    for (uint32_t block = start; block < end; block++)
+    {
+        dlseg_set(dlseg.done, block, block < done_end);
+        dlseg_set(dlseg.claimed, block, false);
+    }
+    dlseg_stats.helper_segments++;
+    dlseg_stats.helper_blocks += done_end - start;
+    if (done_end < end)
+    {
+        dlseg_stats.helper_failed++;
+    }
+    if (done_end == start && !dlseg.stopping)
+    {
+        ESP_LOGW(TAG, "Helper failed, continuing with one connection");
+        dlseg.failed = true;
+    }
+    if (sync && !dlseg.stopping)
+    {
+        dlseg_save();
+    }
+    dlseg.active--;
+    xSemaphoreGive(dlseg_mutex);
+
+    xSemaphoreGive(dlseg_done_sem);
+}
+
+bool dlseg_cancelled(cloud_content_req_t *req)
+{
+    return req->abort || dlseg.stopping;
+}
+
+void dlseg_get_stats(dlseg_stats_t *stats)
+{
+    xSemaphoreTake(dlseg_mutex, portMAX_DELAY);
+    memcpy(stats, &dlseg_stats, sizeof(dlseg_stats_t));
+    xSemaphoreGive(dlseg_mutex);
+}
+
+void dlseg_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    dlseg_mutex = xSemaphoreCreateMutex();
+    dlseg_job_sem = xSemaphoreCreateCounting(CLOUD_DL_CONNECTIONS, 0);
+    dlseg_done_sem = xSemaphoreCreateBinary();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "cloud.h"
+
+/* a download is fetched in segments of this many TAF blocks, each TONIEFILE_FRAME_SIZE in size */
+#define DLSEG_SEGMENT_BLOCKS 64
+/* only split downloads with at least this many blocks left, else the extra connection is not worth it */
+#define DLSEG_MIN_BLOCKS (2 * DLSEG_SEGMENT_BLOCKS)
+/* blocks written by helpers are synced in batches of this many, or when the main download is about to skip them */
+#define DLSEG_SYNC_BLOCKS (4 * DLSEG_SEGMENT_BLOCKS)
+
+/* sidecar file next to a download with blocks beyond the contiguous part, so it can be continued */
+#define DLSEG_MAGIC 0x47455354 /* "TSEG" */
+#define DLSEG_EXTENSION ".SEG"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t total_length;
+    /* number of blocks, followed by a bitmap with one bit per received block */
+    uint32_t blocks;
+} dlseg_header_t;
+
+typedef struct
+{
+    uint32_t segments;
+    uint32_t helper_segments;
+    uint32_t helper_blocks;
+    uint32_t helper_failed;
+    uint32_t syncs;
+    uint32_t waits;
+} dlseg_stats_t;
+
+void dlseg_init(void);
+uint32_t dlseg_resume_pos(const char *filename, uint32_t received);
+bool dlseg_pending(const char *filename);
+
+/* used by the main download, which always continues at req->received */
+uint32_t dlseg_first(cloud_content_req_t *req);
+void dlseg_begin(cloud_content_req_t *req);
+uint32_t dlseg_next(cloud_content_req_t *req);
+void dlseg_stop(cloud_content_req_t *req);
+
+/* used by the helper connections */
+esp_err_t dlseg_claim(cloud_content_req_t **req, uint32_t *start, uint32_t *end, TickType_t timeout);
+esp_err_t dlseg_write(cloud_content_req_t *req, uint32_t block, const uint8_t *data, size_t length);
+void dlseg_complete(cloud_content_req_t *req, uint32_t start, uint32_t end, uint32_t done_end);
+bool dlseg_cancelled(cloud_content_req_t *req);
+
+void dlseg_get_stats(dlseg_stats_t *stats);
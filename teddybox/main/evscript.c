@@ -0,0 +1,378 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "evscript.h"
+#include "playback.h"
+#include "decbench.h"
+#include "cachemgr.h"
+#include "pbstat.h"
+
+#ifdef CONFIG_TB_EVENT_SCRIPT
+
+typedef struct
+{
+    TaskHandle_t handle;
+    uint32_t runtime;
+} evscript_task_t;
+
+static const char *TAG = "[ES]";
+
+static volatile int64_t evscript_ear_big_until = 0;
+static volatile int64_t evscript_ear_small_until = 0;
+static volatile int64_t evscript_tilt_until = 0;
+static volatile float evscript_roll = 0;
+static volatile float evscript_pitch = 0;
+
+static evscript_stats_t evscript_stats;
+static evscript_task_t evscript_tasks[EVSCRIPT_TASKS];
+static uint32_t evscript_runtime = 0;
+static uint32_t evscript_audio_ms = 0;
+static uint32_t evscript_last_play_time = 0;
+
+bool evscript_ear_big(void)
+{
+    return esp_timer_get_time() < evscript_ear_big_until;
+}
+
+bool evscript_ear_small(void)
+{
+    return esp_timer_get_time() < evscript_ear_small_until;
+}
+
+bool evscript_get_angle(float *roll, float *pitch)
+{
+    if (esp_timer_get_time() >= evscript_tilt_until)
+    {
+        return false;
+    }
+    *roll = evscript_roll;
+    *pitch = evscript_pitch;
+
+    return true;
+}
+
+void evscript_get_stats(evscript_stats_t *stats)
+{
+    memcpy(stats, &evscript_stats, sizeof(evscript_stats_t));
+}
+
+/* sleep, counting how much audio got played meanwhile */
+static void evscript_sleep(uint32_t ms)
+{
+    int64_t end = esp_timer_get_time() + (int64_t)ms * 1000;
+
+    do
+    {
+        uint32_t play_time = pb_get_play_time();
+        if (play_time > evscript_last_play_time && play_time - evscript_last_play_time < 1000)
+        {
+            evscript_audio_ms += play_time - evscript_last_play_time;
+        }
+        evscript_last_play_time = play_time;
+
+        vTaskDelay(pdMS_TO_TICKS(10));
+    } while (esp_timer_get_time() < end);
+}
+
+static void evscript_wait_play(uint64_t nfc_uid)
+{
+    int64_t start = esp_timer_get_time();
+
+    /* playback holds the previous content until the request got handled */
+    while (!pb_is_playing() || pb_get_current_uid() != nfc_uid)
+    {
+        if (esp_timer_get_time() - start > EVSCRIPT_PLAY_TIMEOUT_MS * 1000LL)
+        {
+            ESP_LOGW(TAG, "%016llX did not start playing", nfc_uid);
+            evscript_stats.timeouts++;
+            return;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    evscript_last_play_time = pb_get_play_time();
+
+    uint32_t latency = (esp_timer_get_time() - start) / 1000;
+    if (!evscript_stats.tags || latency < evscript_stats.latency_min_ms)
+    {
+        evscript_stats.latency_min_ms = latency;
+    }
+    if (latency > evscript_stats.latency_max_ms)
+    {
+        evscript_stats.latency_max_ms = latency;
+    }
+    evscript_stats.latency_sum_ms += latency;
+    evscript_stats.tags++;
+
+    ESP_LOGI(TAG, "%016llX playing after %d ms", nfc_uid, latency);
+}
+
+static evscript_task_t *evscript_find_task(TaskHandle_t handle)
+{
+    evscript_task_t *free_task = NULL;
+
+    for (int pos = 0; pos < EVSCRIPT_TASKS; pos++)
+    {
+        if (evscript_tasks[pos].handle == handle)
+        {
+            return &evscript_tasks[pos];
+        }
+        if (!free_task && !evscript_tasks[pos].handle)
+        {
+            free_task = &evscript_tasks[pos];
+        }
+    }
+    if (free_task)
+    {
+        free_task->handle = handle;
+        free_task->runtime = 0;
+    }
+
+    return free_task;
+}
+
+/* CPU time of every task since the last report and how much of it was spent per second of audio */
+static void evscript_report(void)
+{
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    TaskStatus_t *status = malloc(count * sizeof(TaskStatus_t));
+    uint32_t runtime = 0;
+
+    if (!status)
+    {
+        return;
+    }
+    count = uxTaskGetSystemState(status, count, &runtime);
+
+    uint32_t elapsed = runtime - evscript_runtime;
+    uint32_t busy = 0;
+
+    evscript_runtime = runtime;
+
+    for (int pos = 0; pos < count; pos++)
+    {
+        evscript_task_t *task = evscript_find_task(status[pos].xHandle);
+        if (!task)
+        {
+            continue;
+        }
+        uint32_t used = status[pos].ulRunTimeCounter - task->runtime;
+        task->runtime = status[pos].ulRunTimeCounter;
+
+        if (!strncmp(status[pos].pcTaskName, "IDLE", 4))
+        {
+            continue;
+        }
+        busy += used;
+        if (elapsed && used)
+        {
+            ESP_LOGI(TAG, "  %5d.%d%% %s", (int)(used * 100ULL / elapsed), (int)(used * 1000ULL / elapsed % 10), status[pos].pcTaskName);
+        }
+    }
+    free(status);
+
+    /* both cores count, busy is relative to one */
+    ESP_LOGI(TAG, "CPU %llu ms busy in %u ms, %u ms audio", busy / 1000ULL, elapsed / 1000, evscript_audio_ms);
+    if (evscript_audio_ms)
+    {
+        ESP_LOGI(TAG, "CPU %llu ms per second of audio", busy / 1000ULL * 1000 / evscript_audio_ms);
+    }
+    if (evscript_stats.tags)
+    {
+        ESP_LOGI(TAG, "Latency %u..%u ms, avg %llu ms, %u tags, %u timeouts", evscript_stats.latency_min_ms, evscript_stats.latency_max_ms,
+                 evscript_stats.latency_sum_ms / evscript_stats.tags, evscript_stats.tags, evscript_stats.timeouts);
+    }
+    ESP_LOGI(TAG, "Heap %u free, %u minimum, %u largest block", heap_caps_get_free_size(MALLOC_CAP_8BIT),
+             heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT), heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    pbstat_log();
+
+    evscript_audio_ms = 0;
+}
+
+static void evscript_bench(uint64_t nfc_uid)
+{
+    decbench_result_t result;
+
+    if (decbench_run(nfc_uid, &result) == ESP_OK)
+    {
+        decbench_log(nfc_uid, &result);
+    }
+}
+
+static void evscript_bench_all(void)
+{
+    cachemgr_entry_t *entries = malloc(CACHEMGR_ENTRIES * sizeof(cachemgr_entry_t));
+
+    if (!entries)
+    {
+        return;
+    }
+    size_t count = cachemgr_list(entries, CACHEMGR_ENTRIES);
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        if (entries[pos].state == CACHEMGR_COMPLETE)
+        {
+            evscript_bench(entries[pos].nfc_uid);
+        }
+    }
+    free(entries);
+}
+
+static esp_err_t evscript_parse_token(const char *hex, uint8_t *token)
+{
+    if (strlen(hex) != 64)
+    {
+        return ESP_FAIL;
+    }
+    for (int pos = 0; pos < 32; pos++)
+    {
+        unsigned int value;
+        if (sscanf(&hex[pos * 2], "%2x", &value) != 1)
+        {
+            return ESP_FAIL;
+        }
+        token[pos] = value;
+    }
+
+    return ESP_OK;
+}
+
+static void evscript_execute(int line_num, char *line)
+{
+    char cmd[16] = {0};
+    char arg[72] = {0};
+    uint64_t nfc_uid = 0;
+    uint32_t ms = 0;
+    float roll = 0;
+    float pitch = 0;
+
+    if (sscanf(line, "%15s", cmd) != 1 || cmd[0] == '#')
+    {
+        return;
+    }
+
+    if (!strcmp(cmd, "tag") && sscanf(line, "%*s %llx", &nfc_uid) == 1)
+    {
+        pb_play_content(nfc_uid);
+        evscript_wait_play(nfc_uid);
+    }
+    else if (!strcmp(cmd, "token") && sscanf(line, "%*s %llx %71s", &nfc_uid, arg) == 2)
+    {
+        uint8_t token[32];
+        if (evscript_parse_token(arg, token) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "line %d: invalid token", line_num);
+            return;
+        }
+        pb_play_content_token(nfc_uid, token);
+        evscript_wait_play(nfc_uid);
+    }
+    else if (!strcmp(cmd, "remove"))
+    {
+        pb_stop();
+    }
+    else if (!strcmp(cmd, "ear") && sscanf(line, "%*s %15s", arg) == 1)
+    {
+        if (sscanf(line, "%*s %*s %u", &ms) != 1)
+        {
+            ms = EVSCRIPT_EAR_MS;
+        }
+        if (!strcmp(arg, "big"))
+        {
+            evscript_ear_big_until = esp_timer_get_time() + ms * 1000LL;
+        }
+        else
+        {
+            evscript_ear_small_until = esp_timer_get_time() + ms * 1000LL;
+        }
+        evscript_sleep(ms);
+    }
+    else if (!strcmp(cmd, "tilt") && sscanf(line, "%*s %f %f %u", &roll, &pitch, &ms) == 3)
+    {
+        evscript_roll = roll;
+        evscript_pitch = pitch;
+        evscript_tilt_until = esp_timer_get_time() + ms * 1000LL;
+        evscript_sleep(ms);
+    }
+    else if (!strcmp(cmd, "wait") && sscanf(line, "%*s %u", &ms) == 1)
+    {
+        evscript_sleep(ms);
+    }
+    else if (!strcmp(cmd, "report"))
+    {
+        evscript_report();
+    }
+    else if (!strcmp(cmd, "bench"))
+    {
+        if (sscanf(line, "%*s %llx", &nfc_uid) == 1)
+        {
+            evscript_bench(nfc_uid);
+        }
+        else
+        {
+            evscript_bench_all();
+        }
+    }
+    else
+    {
+        ESP_LOGE(TAG, "line %d: cannot parse '%s'", line_num, line);
+    }
+}
+
+static void evscript_task(void *arg)
+{
+    FILE *fd = (FILE *)arg;
+    char line[EVSCRIPT_LINE_LEN];
+    int line_num = 0;
+    uint32_t round = 1;
+
+    /* start the CPU accounting from here */
+    evscript_report();
+
+    while (fgets(line, sizeof(line), fd))
+    {
+        uint32_t count = 0;
+
+        line_num++;
+        line[strcspn(line, "\r\n")] = 0;
+
+        if (sscanf(line, "repeat %u", &count) == 1)
+        {
+            if (round++ < count)
+            {
+                ESP_LOGI(TAG, "Round %u of %u", round, count);
+                fseek(fd, 0, SEEK_SET);
+                line_num = 0;
+            }
+            continue;
+        }
+        evscript_execute(line_num, line);
+    }
+    fclose(fd);
+
+    ESP_LOGI(TAG, "Script done");
+    evscript_report();
+    vTaskDelete(NULL);
+}
+
+void evscript_init(void)
+{
+    FILE *fd = fopen(EVSCRIPT_FILE, "r");
+
+    if (!fd)
+    {
+        return;
+    }
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+    ESP_LOGI(TAG, "Replaying '%s'", EVSCRIPT_FILE);
+
+    xTaskCreatePinnedToCore(evscript_task, "[TB] Script", EVSCRIPT_TASK_STACK, fd, EVSCRIPT_TASK_PRIO, NULL, tskNO_AFFINITY);
+}
+
+#endif
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+#define EVSCRIPT_TASK_PRIO 2
+#define EVSCRIPT_TASK_STACK 4096
+
+/* replayed once after startup if present, one command per line:
+     tag <uid>            place a tag, wait for playback to start
+     token <uid> <token>  place a tag with its 32 byte token in hex
+     remove               remove the tag
+     ear big|small [ms]   press an ear
+     tilt <roll> <pitch> <ms>  hold the box at an angle instead of the sensor's
+     wait <ms>
+     report               log latency, CPU, heap and pipeline counters
+     bench [uid]          decode a content, or all complete ones, as fast as possible, see decbench.h
+     repeat <count>       start over, count times in total */
+#define EVSCRIPT_FILE "/sdcard/SCRIPT.TXT"
+#define EVSCRIPT_LINE_LEN 128
+/* the ear press when no duration is given */
+#define EVSCRIPT_EAR_MS 200
+/* playback must have started within this time after placing a tag */
+#define EVSCRIPT_PLAY_TIMEOUT_MS 10000
+#define EVSCRIPT_TASKS 24
+
+typedef struct
+{
+    uint32_t tags;
+    uint32_t timeouts;
+    uint32_t latency_min_ms;
+    uint32_t latency_max_ms;
+    uint64_t latency_sum_ms;
+} evscript_stats_t;
+
+#ifdef CONFIG_TB_EVENT_SCRIPT
+void evscript_init(void);
+bool evscript_ear_big(void);
+bool evscript_ear_small(void);
+bool evscript_get_angle(float *roll, float *pitch);
+void evscript_get_stats(evscript_stats_t *stats);
+#else
+/* test builds only, a box in use must not act on a file on the card */
+static inline void evscript_init(void) {}
+static inline bool evscript_ear_big(void) { return false; }
+static inline bool evscript_ear_small(void) { return false; }
+static inline bool evscript_get_angle(float *roll, float *pitch) { return false; }
+static inline void evscript_get_stats(evscript_stats_t *stats) {}
+#endif
@@ -0,0 +1,496 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+
+#include "freshness.h"
+#include "cloud.h"
+#include "playback.h"
+#include "tafcache.h"
+#include "tafindex.h"
+#include "tafverify.h"
+#include "dlseg.h"
+#include "dljournal.h"
+#include "cachemgr.h"
+#include "toniebox.pb.freshness-check.fc-request.pb-c.h"
+#include "toniebox.pb.freshness-check.fc-response.pb-c.h"
+
+static const char *TAG = "[FC]";
+
+typedef struct
+{
+    bool valid;
+    uint64_t nfc_uid;
+    uint8_t token[32];
+} freshness_token_t;
+
+static freshness_token_t freshness_tokens[FRESHNESS_TOKENS];
+static uint32_t freshness_token_next = 0;
+/* content downloaded in the background, only one at a time */
+static cloud_content_req_t *freshness_dl = NULL;
+/* protects the two above */
+static SemaphoreHandle_t freshness_mutex;
+
+static int64_t freshness_next_check = 0;
+static freshness_settings_t freshness_settings;
+static freshness_stats_t freshness_stats;
+
+/********************************************************/
+/* settings, persisted in NVS                           */
+/********************************************************/
+
+static void freshness_load_settings()
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open("TB_FRESH", NVS_READONLY, &nvs_handle) != ESP_OK)
+    {
+        return;
+    }
+
+    size_t len = sizeof(freshness_settings);
+    if (nvs_get_blob(nvs_handle, "SETTINGS", &freshness_settings, &len) != ESP_OK || len != sizeof(freshness_settings))
+    {
+        memset(&freshness_settings, 0x00, sizeof(freshness_settings));
+    }
+    nvs_close(nvs_handle);
+}
+
+static void freshness_save_settings()
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("TB_FRESH", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error (%s) opening NVS handle", esp_err_to_name(err));
+        return;
+    }
+
+    err = nvs_set_blob(nvs_handle, "SETTINGS", &freshness_settings, sizeof(freshness_settings));
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to write settings (%s)", esp_err_to_name(err));
+    }
+    nvs_commit(nvs_handle);
+    nvs_close(nvs_handle);
+}
+
+void freshness_get_settings(freshness_settings_t *settings)
+{
+    memcpy(settings, &freshness_settings, sizeof(freshness_settings_t));
+}
+
+/********************************************************/
+/* outdated content markers                             */
+/********************************************************/
+
+/* files next to the content that only describe it, the new content brings its own */
+static const char *freshness_sidecars[] = {TAFINDEX_EXTENSION, TAFINDEX_TEMP_EXTENSION, DLSEG_EXTENSION, TAFVERIFY_EXTENSION, DLJOURNAL_EXTENSION};
+
+static char *freshness_filename(const char *filename, const char *extension)
+{
+    char *marker_filename = malloc(strlen(filename) + strlen(extension) + 1);
+
+    strcpy(marker_filename, filename);
+    strcat(marker_filename, extension);
+
+    return marker_filename;
+}
+
+static void freshness_remove_sidecars(const char *filename)
+{
+    for (int pos = 0; pos < sizeof(freshness_sidecars) / sizeof(freshness_sidecars[0]); pos++)
+    {
+        char *sidecar = freshness_filename(filename, freshness_sidecars[pos]);
+        unlink(sidecar);
+        free(sidecar);
+    }
+}
+
+bool freshness_outdated(const char *filename)
+{
+    char *marker_filename = freshness_filename(filename, FRESHNESS_EXTENSION);
+    struct stat st;
+    bool exists = (stat(marker_filename, &st) == 0);
+
+    free(marker_filename);
+
+    return exists;
+}
+
+static void freshness_mark(const char *filename)
+{
+    char *marker_filename = freshness_filename(filename, FRESHNESS_EXTENSION);
+    FILE *fd = fopen(marker_filename, "wb");
+
+    if (fd)
+    {
+        fclose(fd);
+    }
+    free(marker_filename);
+}
+
+/* the content gets downloaded in place, so a refresh that did not finish yet is of no use anymore */
+void freshness_clear(const char *filename)
+{
+    char *marker_filename = freshness_filename(filename, FRESHNESS_EXTENSION);
+    char *temp_filename = freshness_filename(filename, FRESHNESS_TEMP_EXTENSION);
+
+    unlink(marker_filename);
+    unlink(temp_filename);
+    freshness_remove_sidecars(temp_filename);
+    tafcache_invalidate(temp_filename);
+    free(temp_filename);
+    free(marker_filename);
+}
+
+/* put the new content in place once it is complete and matches its hash, until then the old one stays playable.
+   returns ESP_ERR_NOT_FINISHED while the verifier still has to check it */
+static esp_err_t freshness_commit(const char *filename)
+{
+    char *temp_filename = freshness_filename(filename, FRESHNESS_TEMP_EXTENSION);
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+
+    if (pb_check_file(temp_filename) == PB_ERR_GOOD_FILE)
+    {
+        struct stat st;
+        stat(temp_filename, &st);
+        ret = (tafverify_check(temp_filename, st.st_size) == ESP_OK) ? ESP_OK : ESP_ERR_NOT_FINISHED;
+    }
+
+    if (ret == ESP_OK)
+    {
+        char *verify_filename = freshness_filename(filename, TAFVERIFY_EXTENSION);
+        char *temp_verify_filename = freshness_filename(temp_filename, TAFVERIFY_EXTENSION);
+
+        ESP_LOGI(TAG, "Replace '%s' with the new content", filename);
+        freshness_remove_sidecars(filename);
+        unlink(filename);
+        if (rename(temp_filename, filename) != 0)
+        {
+            ESP_LOGE(TAG, "Failed to rename '%s'", temp_filename);
+            ret = ESP_FAIL;
+        }
+        else
+        {
+            /* the hash result is valid for the same data under its new name */
+            rename(temp_verify_filename, verify_filename);
+            freshness_remove_sidecars(temp_filename);
+            freshness_clear(filename);
+        }
+        tafcache_invalidate(temp_filename);
+        tafcache_invalidate(filename);
+        cachemgr_refresh_file(filename);
+        if (ret == ESP_OK)
+        {
+            tafindex_request(filename);
+        }
+        free(temp_verify_filename);
+        free(verify_filename);
+    }
+    free(temp_filename);
+
+    return ret;
+}
+
+/********************************************************/
+/* freshness check                                      */
+/********************************************************/
+
+/* all tags there is content for, as known by the cache index */
+static size_t freshness_collect(TonieFCInfo *infos, TonieFCInfo **info_ptrs, size_t max)
+{
+    cachemgr_entry_t *entries = malloc(max * sizeof(cachemgr_entry_t));
+    if (!entries)
+    {
+        return 0;
+    }
+
+    size_t found = cachemgr_list(entries, max);
+    size_t count = 0;
+    for (size_t pos = 0; pos < found; pos++)
+    {
+        /* without a header there is nothing to compare */
+        if (!entries[pos].audio_id)
+        {
+            continue;
+        }
+        tonie_fcinfo__init(&infos[count]);
+        infos[count].uid = entries[pos].nfc_uid;
+        infos[count].audio_id = entries[pos].audio_id;
+        info_ptrs[count] = &infos[count];
+        count++;
+    }
+    free(entries);
+
+    return count;
+}
+
+static void freshness_handle_response(TonieFreshnessCheckResponse *response)
+{
+    freshness_settings_t settings = {
+        .valid = true,
+        .max_vol_spk = response->max_vol_spk,
+        .max_vol_hdp = response->max_vol_hdp,
+        .slap_en = response->slap_en,
+        .slap_dir = response->slap_dir,
+        .led = response->led};
+
+    if (memcmp(&settings, &freshness_settings, sizeof(settings)))
+    {
+        ESP_LOGI(TAG, "Settings changed: max vol %d/%d, slap %d/%d, led %d", settings.max_vol_spk, settings.max_vol_hdp, settings.slap_en, settings.slap_dir, settings.led);
+        memcpy(&freshness_settings, &settings, sizeof(settings));
+        freshness_save_settings();
+    }
+
+    for (size_t pos = 0; pos < response->n_tonie_marked; pos++)
+    {
+        char *filename = pb_build_filename(response->tonie_marked[pos]);
+        struct stat st;
+
+        if (stat(filename, &st) == 0 && !freshness_outdated(filename))
+        {
+            ESP_LOGI(TAG, "'%s' has new content", filename);
+            freshness_mark(filename);
+            tafcache_invalidate(filename);
+            cachemgr_update(response->tonie_marked[pos], PB_ERR_OUTDATED_FILE);
+            freshness_stats.marked++;
+        }
+        free(filename);
+    }
+}
+
+/* tell the cloud which content is here in one request, it answers with the tags that have newer content */
+static esp_err_t freshness_check()
+{
+    esp_err_t ret = ESP_FAIL;
+    TonieFCInfo *infos = calloc(FRESHNESS_MAX_TONIES, sizeof(TonieFCInfo));
+    TonieFCInfo **info_ptrs = calloc(FRESHNESS_MAX_TONIES, sizeof(TonieFCInfo *));
+    uint8_t *response_data = malloc(FRESHNESS_RESPONSE_SIZE);
+    uint8_t *request_data = NULL;
+
+    if (!infos || !info_ptrs || !response_data)
+    {
+        ESP_LOGE(TAG, "Allocation failed...");
+        goto out;
+    }
+
+    TonieFreshnessCheckRequest request = TONIE_FRESHNESS_CHECK_REQUEST__INIT;
+    request.n_tonie_infos = freshness_collect(infos, info_ptrs, FRESHNESS_MAX_TONIES);
+    request.tonie_infos = info_ptrs;
+
+    size_t request_length = tonie_freshness_check_request__get_packed_size(&request);
+    request_data = malloc(request_length + 1);
+    if (!request_data)
+    {
+        goto out;
+    }
+    tonie_freshness_check_request__pack(&request, request_data);
+
+    ESP_LOGI(TAG, "Check %d tonies", request.n_tonie_infos);
+    freshness_stats.tonies = request.n_tonie_infos;
+
+    /* the list is not needed anymore, leave the memory to the TLS connection */
+    free(infos);
+    free(info_ptrs);
+    infos = NULL;
+    info_ptrs = NULL;
+
+    size_t response_length = FRESHNESS_RESPONSE_SIZE;
+    if (cloud_post(FRESHNESS_PATH, request_data, request_length, response_data, &response_length) != ESP_OK)
+    {
+        goto out;
+    }
+
+    TonieFreshnessCheckResponse *response = tonie_freshness_check_response__unpack(NULL, response_length, response_data);
+    if (!response)
+    {
+        ESP_LOGE(TAG, "Failed to parse response");
+        goto out;
+    }
+    freshness_handle_response(response);
+    tonie_freshness_check_response__free_unpacked(response, NULL);
+    ret = ESP_OK;
+
+out:
+    free(infos);
+    free(info_ptrs);
+    free(request_data);
+    free(response_data);
+
+    return ret;
+}
+
+/********************************************************/
+/* background downloads                                 */
+/********************************************************/
+
+void freshness_note_token(uint64_t nfc_uid, const uint8_t *token)
+{
+    xSemaphoreTake(freshness_mutex, portMAX_DELAY);
+    freshness_token_t *entry = NULL;
+    for (int pos = 0; pos < FRESHNESS_TOKENS; pos++)
+    {
+        if (freshness_tokens[pos].valid && freshness_tokens[pos].nfc_uid == nfc_uid)
+        {
+            entry = &freshness_tokens[pos];
+            break;
+        }
+    }
+    if (!entry)
+    {
+        entry = &freshness_tokens[freshness_token_next];
+        freshness_token_next = (freshness_token_next + 1) % FRESHNESS_TOKENS;
+    }
+    entry->valid = true;
+    entry->nfc_uid = nfc_uid;
+    memcpy(entry->token, token, sizeof(entry->token));
+    xSemaphoreGive(freshness_mutex);
+}
+
+static void freshness_cleanup(cloud_content_req_t *req)
+{
+    if (req->handle)
+    {
+        fclose(req->handle);
+        req->handle = NULL;
+    }
+    /* a cancelled download stays next to the old content and gets continued later */
+    if (req->state == CC_STATE_FINISHED)
+    {
+        char *filename = pb_build_filename(req->nfc_uid);
+        freshness_commit(filename);
+        free(filename);
+    }
+    cloud_content_cleanup(req);
+}
+
+/* the box is being used, stop the background download and wait until the card and link are free again */
+void freshness_yield()
+{
+    xSemaphoreTake(freshness_mutex, portMAX_DELAY);
+    cloud_content_req_t *req = freshness_dl;
+    freshness_dl = NULL;
+    xSemaphoreGive(freshness_mutex);
+
+    if (!req)
+    {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Stop background download of '%s'", req->filename);
+    cloud_content_cancel(req);
+    while (cloud_content_wait(req, portMAX_DELAY) < CC_STATE_FINISHED)
+    {
+    }
+    freshness_cleanup(req);
+    freshness_stats.yielded++;
+}
+
+/* fetch new content for a tag that was placed recently, so the next time it plays right away */
+static void freshness_download()
+{
+    for (int pos = 0; pos < FRESHNESS_TOKENS; pos++)
+    {
+        freshness_token_t token;
+
+        xSemaphoreTake(freshness_mutex, portMAX_DELAY);
+        memcpy(&token, &freshness_tokens[pos], sizeof(token));
+        xSemaphoreGive(freshness_mutex);
+
+        if (!token.valid)
+        {
+            continue;
+        }
+
+        char *filename = pb_build_filename(token.nfc_uid);
+        bool outdated = freshness_outdated(filename);
+        esp_err_t ret = outdated ? freshness_commit(filename) : ESP_OK;
+        char *temp_filename = freshness_filename(filename, FRESHNESS_TEMP_EXTENSION);
+        free(filename);
+
+        /* only download when there is no complete new content yet, otherwise it waits for the verifier */
+        if (ret == ESP_ERR_NOT_FOUND)
+        {
+            ESP_LOGI(TAG, "Download new content for %016llX", token.nfc_uid);
+            cloud_content_req_t *req = cloud_content_download_file(token.nfc_uid, token.token, CLOUD_PRIO_PREFETCH, temp_filename);
+            free(temp_filename);
+
+            xSemaphoreTake(freshness_mutex, portMAX_DELAY);
+            freshness_dl = req;
+            xSemaphoreGive(freshness_mutex);
+            freshness_stats.downloads++;
+            return;
+        }
+        free(temp_filename);
+    }
+}
+
+/* called by the cloud task whenever it has nothing else to do */
+void freshness_poll()
+{
+    int64_t now = esp_timer_get_time();
+
+    /* a background download is processed by the cloud task, so when it gets here, it is done */
+    xSemaphoreTake(freshness_mutex, portMAX_DELAY);
+    cloud_content_req_t *req = freshness_dl;
+    if (req && req->state >= CC_STATE_FINISHED)
+    {
+        freshness_dl = NULL;
+    }
+    else
+    {
+        req = NULL;
+    }
+    bool busy = (freshness_dl != NULL);
+    xSemaphoreGive(freshness_mutex);
+
+    if (req)
+    {
+        freshness_cleanup(req);
+    }
+
+    /* leave the card and the link to the playback */
+    if (busy || pb_is_playing())
+    {
+        return;
+    }
+
+    if (now >= freshness_next_check)
+    {
+        freshness_stats.checks++;
+        if (freshness_check() == ESP_OK)
+        {
+            freshness_next_check = now + FRESHNESS_INTERVAL_MS * 1000LL;
+        }
+        else
+        {
+            freshness_stats.failed++;
+            freshness_next_check = now + FRESHNESS_RETRY_MS * 1000LL;
+        }
+        return;
+    }
+
+    freshness_download();
+}
+
+void freshness_get_stats(freshness_stats_t *stats)
+{
+    memcpy(stats, &freshness_stats, sizeof(freshness_stats_t));
+}
+
+void freshness_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    freshness_mutex = xSemaphoreCreateMutex();
+    freshness_next_check = esp_timer_get_time() + FRESHNESS_START_DELAY_MS * 1000LL;
+    freshness_load_settings();
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define FRESHNESS_PATH "/v1/freshness-check"
+/* check again after this time, or a bit earlier when the last check failed */
+#define FRESHNESS_INTERVAL_MS (6 * 60 * 60 * 1000)
+#define FRESHNESS_RETRY_MS (10 * 60 * 1000)
+/* give the playback the card for the first minute after boot */
+#define FRESHNESS_START_DELAY_MS 60000
+#define FRESHNESS_MAX_TONIES 256
+#define FRESHNESS_RESPONSE_SIZE 2048
+/* tokens of recently placed tags, needed to download their content without the tag */
+#define FRESHNESS_TOKENS 8
+
+/* marker next to content the cloud has a newer version of */
+#define FRESHNESS_EXTENSION ".OLD"
+/* the new content is downloaded next to the old one and replaces it once it is complete and verified */
+#define FRESHNESS_TEMP_EXTENSION ".NEW"
+
+/* box settings sent along with the check, persisted in NVS */
+typedef struct
+{
+    bool valid;
+    int32_t max_vol_spk;
+    int32_t max_vol_hdp;
+    int32_t slap_en;
+    int32_t slap_dir;
+    int32_t led;
+} freshness_settings_t;
+
+typedef struct
+{
+    uint32_t checks;
+    uint32_t failed;
+    uint32_t tonies;
+    uint32_t marked;
+    uint32_t downloads;
+    uint32_t yielded;
+} freshness_stats_t;
+
+void freshness_init(void);
+void freshness_poll(void);
+void freshness_note_token(uint64_t nfc_uid, const uint8_t *token);
+void freshness_yield(void);
+bool freshness_outdated(const char *filename);
+void freshness_clear(const char *filename);
+void freshness_get_settings(freshness_settings_t *settings);
+void freshness_get_stats(freshness_stats_t *stats);
@@ -36,6 +36,9 @@
 #include "nfc.h"
 #include "cloud.h"
 #include "ledman.h"
+#include "rtnl.h"
+#include "evscript.h"
+#include "pcmgain.h"
 
 #include "config.h"
 
@@ -50,6 +53,7 @@ typedef struct
     uint32_t volume;
     uint64_t nfc_uid;
     uint32_t play_position;
+    uint32_t play_time;
     uint32_t rtc_check;
 } rtc_mem_t;
 
@@ -172,6 +176,9 @@ void app_main(void)
 
     ESP_LOGI(TAG, "Start handlers");
 
+    /* the playback posts its events there right from the start */
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    rtnl_init();
     pb_init(set);
 
     // xTaskCreate(print_all_tasks, "print_all_tasks", 4096, NULL, 5, NULL);
@@ -183,16 +190,19 @@ void app_main(void)
         rtc_storage.rtc_magic = 0xDEADC0DE;
         rtc_storage.volume = 50;
         rtc_storage.play_position = 0;
+        rtc_storage.play_time = 0;
         rtc_checksum_update();
     }
     else if (rtc_storage.nfc_uid)
     {
-        ESP_LOGI(TAG, "Inform playback handler UID %16llX / %d", rtc_storage.nfc_uid, rtc_storage.play_position);
-        pb_set_last(rtc_storage.nfc_uid, rtc_storage.play_position);
+        ESP_LOGI(TAG, "Inform playback handler UID %16llX / %d / %d ms", rtc_storage.nfc_uid, rtc_storage.play_position, rtc_storage.play_time);
+        pb_set_last(rtc_storage.nfc_uid, rtc_storage.play_position, rtc_storage.play_time);
     }
 
     audio_hal_set_volume(audio_board_get_hal(), rtc_storage.volume);
 
+    pcmgain_set_volume(rtc_storage.volume);
+
     dac3100_set_mute(true);
 
     pb_play_default(CONTENT_DEFAULT_STARTUP);
@@ -207,6 +217,7 @@ void app_main(void)
     /* already too much memory consumption, do not enable by default */
     // www_init();
     ota_init();
+    evscript_init();
 
     int64_t last_activity_time = esp_timer_get_time();
     int64_t remute_time = 0;
@@ -216,8 +227,8 @@ void app_main(void)
         vTaskDelay(100 / portTICK_PERIOD_MS);
         int64_t cur_time = esp_timer_get_time();
 
-        bool ear_big = audio_board_ear_big();
-        bool ear_small = audio_board_ear_small();
+        bool ear_big = audio_board_ear_big() || evscript_ear_big();
+        bool ear_small = audio_board_ear_small() || evscript_ear_small();
 
         if (ear_big && !ear_big_prev)
         {
@@ -227,6 +238,7 @@ void app_main(void)
                 ESP_LOGI(TAG, "Volume up");
                 rtc_storage.volume += 10;
                 audio_hal_set_volume(audio_board_get_hal(), rtc_storage.volume);
+                pcmgain_set_volume(rtc_storage.volume);
                 dac3100_beep(0, 0x140);
             }
             else
@@ -245,6 +257,7 @@ void app_main(void)
                 ESP_LOGI(TAG, "Volume down");
                 rtc_storage.volume -= 10;
                 audio_hal_set_volume(audio_board_get_hal(), rtc_storage.volume);
+                pcmgain_set_volume(rtc_storage.volume);
                 dac3100_beep(2, 0x140);
             }
             else
@@ -270,6 +283,7 @@ void app_main(void)
         {
             rtc_storage.nfc_uid = pb_get_current_uid();
             rtc_storage.play_position = pb_get_play_position();
+            rtc_storage.play_time = pb_get_play_time();
         }
 
         if ((cur_time - last_activity_time) > POWEROFF_TIMEOUT)
@@ -0,0 +1,192 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "pbstat.h"
+#include "playback.h"
+#include "prefetch.h"
+
+static const char *TAG = "[PS]";
+
+static pbstat_snapshot_t pbstat;
+static ringbuf_handle_t pbstat_ring = NULL;
+static audio_element_handle_t pbstat_i2s = NULL;
+
+/* the ring starts empty, so its low mark only counts once it was filled */
+static bool pbstat_primed = false;
+static int64_t pbstat_last_read = 0;
+static int64_t pbstat_rate_start = 0;
+static uint64_t pbstat_rate_reader = 0;
+static int64_t pbstat_rate_i2s = -1;
+
+static void pbstat_account(pbstat_stage_t *stage, uint32_t us, int bytes)
+{
+    uint32_t bucket = 0;
+
+    if (us >= PBSTAT_HIST_BASE_US)
+    {
+        bucket = 32 - __builtin_clz(us / PBSTAT_HIST_BASE_US);
+        if (bucket >= PBSTAT_HIST_BUCKETS)
+        {
+            bucket = PBSTAT_HIST_BUCKETS - 1;
+        }
+    }
+    stage->hist[bucket]++;
+    stage->calls++;
+    if (bytes > 0)
+    {
+        stage->bytes += bytes;
+    }
+    if (us > stage->max_us)
+    {
+        stage->max_us = us;
+    }
+}
+
+static void pbstat_ring_sample(void)
+{
+    if (!pbstat_ring)
+    {
+        return;
+    }
+    uint32_t filled = rb_bytes_filled(pbstat_ring);
+
+    if (filled > pbstat.ring_high)
+    {
+        pbstat.ring_high = filled;
+    }
+    if (!pbstat_primed)
+    {
+        pbstat_primed = (filled >= pbstat.ring_size / 2);
+        return;
+    }
+    if (filled < pbstat.ring_low)
+    {
+        pbstat.ring_low = filled;
+    }
+    if (!filled)
+    {
+        /* counted once per time the ring ran dry */
+        pbstat.ring_empty++;
+        pbstat_primed = false;
+    }
+}
+
+/* the I²S writer keeps its byte position itself, just sample it along with the reads */
+static void pbstat_rate_sample(int64_t now)
+{
+    if (now - pbstat_rate_start < PBSTAT_RATE_MS * 1000LL)
+    {
+        return;
+    }
+    uint32_t elapsed_ms = (now - pbstat_rate_start) / 1000;
+
+    pbstat.reader_bps = (pbstat.reader.bytes - pbstat_rate_reader) * 1000 / elapsed_ms;
+    pbstat_rate_reader = pbstat.reader.bytes;
+
+    audio_element_info_t info = {0};
+    if (pbstat_i2s && audio_element_getinfo(pbstat_i2s, &info) == ESP_OK)
+    {
+        /* the position starts over whenever the pipeline got reset */
+        if (pbstat_rate_i2s >= 0 && info.byte_pos >= pbstat_rate_i2s)
+        {
+            pbstat.i2s_bytes += info.byte_pos - pbstat_rate_i2s;
+            pbstat.i2s_bps = (info.byte_pos - pbstat_rate_i2s) * 1000 / elapsed_ms;
+        }
+        pbstat_rate_i2s = info.byte_pos;
+    }
+    pbstat_rate_start = now;
+}
+
+int64_t pbstat_read_begin(void)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (pbstat_last_read)
+    {
+        pbstat_account(&pbstat.decoder, now - pbstat_last_read, 0);
+    }
+    pbstat_ring_sample();
+
+    return now;
+}
+
+/* called by the decoder's read callback with what it got, so only counters here */
+void pbstat_read_end(int64_t start, int bytes)
+{
+    int64_t now = esp_timer_get_time();
+
+    pbstat_account(&pbstat.reader, now - start, bytes);
+    if (bytes == PREFETCH_NOT_READY)
+    {
+        pbstat.reader_not_ready++;
+    }
+    pbstat_rate_sample(now);
+    pbstat_last_read = now;
+}
+
+/* a new content starts, the decoder's time until its first read is no work */
+void pbstat_start(void)
+{
+    pbstat_primed = false;
+    pbstat_last_read = 0;
+    pbstat_rate_i2s = -1;
+}
+
+void pbstat_snapshot(pbstat_snapshot_t *snapshot, bool reset_marks)
+{
+    pb_underrun_stats_t underrun_stats;
+
+    pb_get_underrun_stats(&underrun_stats);
+    pbstat.underruns = underrun_stats.underruns;
+    pbstat.uptime_ms = esp_timer_get_time() / 1000;
+    memcpy(snapshot, &pbstat, sizeof(pbstat_snapshot_t));
+
+    if (reset_marks)
+    {
+        pbstat.ring_high = 0;
+        pbstat.ring_low = pbstat.ring_size;
+        pbstat.reader.max_us = 0;
+        pbstat.decoder.max_us = 0;
+    }
+}
+
+static void pbstat_log_stage(const char *name, const pbstat_stage_t *stage)
+{
+    ESP_LOGI(TAG, "%s: %u calls, %llu bytes, max %u us, <%d/%d/%d/%d/%d/%d/%d/>= us: %u/%u/%u/%u/%u/%u/%u/%u",
+             name, stage->calls, stage->bytes, stage->max_us,
+             PBSTAT_HIST_BASE_US, PBSTAT_HIST_BASE_US << 1, PBSTAT_HIST_BASE_US << 2, PBSTAT_HIST_BASE_US << 3,
+             PBSTAT_HIST_BASE_US << 4, PBSTAT_HIST_BASE_US << 5, PBSTAT_HIST_BASE_US << 6,
+             stage->hist[0], stage->hist[1], stage->hist[2], stage->hist[3],
+             stage->hist[4], stage->hist[5], stage->hist[6], stage->hist[7]);
+}
+
+void pbstat_log(void)
+{
+    pbstat_snapshot_t snapshot;
+
+    pbstat_snapshot(&snapshot, false);
+    pbstat_log_stage("Reader", &snapshot.reader);
+    pbstat_log_stage("Decoder", &snapshot.decoder);
+    ESP_LOGI(TAG, "Reader %u B/s, %u not ready", snapshot.reader_bps, snapshot.reader_not_ready);
+    ESP_LOGI(TAG, "Ring %u..%u of %u, ran dry %u times", snapshot.ring_low, snapshot.ring_high, snapshot.ring_size, snapshot.ring_empty);
+    ESP_LOGI(TAG, "I2S %llu bytes, %u B/s, %u download underruns", snapshot.i2s_bytes, snapshot.i2s_bps, snapshot.underruns);
+}
+
+void pbstat_init(audio_element_handle_t i2s)
+{
+    memset(&pbstat, 0x00, sizeof(pbstat));
+    pbstat.version = PBSTAT_VERSION;
+    pbstat.size = sizeof(pbstat_snapshot_t);
+
+    /* whatever element comes before the writer, this is the ring it plays from */
+    pbstat_ring = audio_element_get_input_ringbuf(i2s);
+    pbstat_i2s = i2s;
+    if (pbstat_ring)
+    {
+        pbstat.ring_size = rb_get_size(pbstat_ring);
+    }
+    pbstat.ring_low = pbstat.ring_size;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "audio_element.h"
+#include "ringbuf.h"
+
+#define PBSTAT_VERSION 1
+/* durations are counted in buckets doubling from this width, the last one takes everything above */
+#define PBSTAT_HIST_BASE_US 64
+#define PBSTAT_HIST_BUCKETS 8
+/* window for the byte rates */
+#define PBSTAT_RATE_MS 1000
+
+typedef struct __attribute__((packed))
+{
+    uint32_t calls;
+    uint64_t bytes;
+    uint32_t max_us;
+    uint32_t hist[PBSTAT_HIST_BUCKETS];
+} pbstat_stage_t;
+
+/* the snapshot as handed out, fixed layout so it can be sent as it is */
+typedef struct __attribute__((packed))
+{
+    uint16_t version;
+    uint16_t size;
+    uint32_t uptime_ms;
+    /* decoder reading from the TAF, and the decoder's work in between reads including its output */
+    pbstat_stage_t reader;
+    pbstat_stage_t decoder;
+    uint32_t reader_not_ready;
+    uint32_t reader_bps;
+    /* the I²S writer's input ring, fed by the gain stage or, without it, by the decoder */
+    uint32_t ring_size;
+    uint32_t ring_high;
+    uint32_t ring_low;
+    uint32_t ring_empty;
+    uint64_t i2s_bytes;
+    uint32_t i2s_bps;
+    /* pauses because the download fell behind, see pb_underrun_stats_t */
+    uint32_t underruns;
+} pbstat_snapshot_t;
+
+void pbstat_init(audio_element_handle_t i2s);
+void pbstat_start(void);
+int64_t pbstat_read_begin(void);
+void pbstat_read_end(int64_t start, int bytes);
+void pbstat_snapshot(pbstat_snapshot_t *snapshot, bool reset_marks);
+void pbstat_log(void);
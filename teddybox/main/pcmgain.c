@@ -0,0 +1,215 @@
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+
+#include "pcmgain.h"
+#include "freshness.h"
+
+#define COUNT(x) (sizeof(x) / sizeof(x[0]))
+
+static const char *TAG = "[PG]";
+
+static pcmgain_state_t pcmgain_state;
+static pcmgain_stats_t pcmgain_stats;
+
+/* set by the control side, picked up by the element before the next block */
+static volatile int32_t pcmgain_target = PCMGAIN_UNITY;
+static volatile uint32_t pcmgain_sample_rate = 48000;
+static volatile uint32_t pcmgain_channels = 2;
+static volatile bool pcmgain_bypass = false;
+
+static int pcmgain_volume = 50;
+static bool pcmgain_headphones = false;
+
+/* esp-dsp is in dependencies.lock and dsps_mulc_s16() does the same Q15 multiply. nothing in the firmware links it,
+   and while ramping this runs on blocks of only PCMGAIN_BLOCK samples, so the portable loop is kept.
+   plain loops without branches, so the compiler is free to unroll and vectorize them */
+static void pcmgain_scale(int16_t *samples, size_t count, int32_t gain)
+{
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        samples[pos] = (int16_t)((samples[pos] * gain) >> 15);
+    }
+}
+
+void pcmgain_state_init(pcmgain_state_t *state, int32_t gain, uint32_t sample_rate, uint32_t channels)
+{
+    memset(state, 0x00, sizeof(pcmgain_state_t));
+    state->gain = gain;
+    state->target = gain;
+    state->sample_rate = sample_rate;
+    state->channels = channels ? channels : 1;
+}
+
+/* move to the new gain within PCMGAIN_RAMP_MS, one step per block */
+void pcmgain_state_target(pcmgain_state_t *state, int32_t target)
+{
+    int32_t blocks = state->sample_rate * PCMGAIN_RAMP_MS / 1000 / PCMGAIN_BLOCK;
+
+    if (blocks < 1)
+    {
+        blocks = 1;
+    }
+    state->target = target;
+    state->step = (target - state->gain) / blocks;
+    if (!state->step)
+    {
+        state->step = (target > state->gain) ? 1 : -1;
+    }
+    state->stats.ramps++;
+}
+
+/* interleaved 16 bit samples, processed in place */
+void pcmgain_process(pcmgain_state_t *state, int16_t *samples, size_t count)
+{
+    size_t pos = 0;
+
+    while (pos < count)
+    {
+        size_t len = count - pos;
+
+        if (state->gain != state->target)
+        {
+            int32_t gain = state->gain + state->step;
+
+            if ((state->step > 0 && gain > state->target) || (state->step < 0 && gain < state->target))
+            {
+                gain = state->target;
+            }
+            state->gain = gain;
+            if (len > PCMGAIN_BLOCK * state->channels)
+            {
+                len = PCMGAIN_BLOCK * state->channels;
+            }
+        }
+
+        if (state->gain != PCMGAIN_UNITY)
+        {
+            pcmgain_scale(&samples[pos], len, state->gain);
+            state->stats.scaled += len;
+        }
+        pos += len;
+    }
+    state->stats.samples += count;
+}
+
+/* the limit is given in the DAC's volume steps, so attenuate by how far the volume exceeds it */
+static void pcmgain_update(void)
+{
+    static const int limits[] = PCMGAIN_LIMIT_PERCENT;
+    freshness_settings_t settings;
+    int32_t target = PCMGAIN_UNITY;
+
+    freshness_get_settings(&settings);
+    if (settings.valid)
+    {
+        int32_t level = pcmgain_headphones ? settings.max_vol_hdp : settings.max_vol_spk;
+
+        if (level >= 0 && level < COUNT(limits) && pcmgain_volume > limits[level])
+        {
+            float db = (pcmgain_volume - limits[level]) * PCMGAIN_DAC_RANGE_DB / 100;
+            target = PCMGAIN_UNITY * powf(10, -db / 20);
+        }
+    }
+    if (target != pcmgain_target)
+    {
+        ESP_LOGI(TAG, "Gain %d/%d for volume %d on %s", target, PCMGAIN_UNITY, pcmgain_volume, pcmgain_headphones ? "headphones" : "speaker");
+        pcmgain_target = target;
+    }
+}
+
+void pcmgain_start(void)
+{
+    pcmgain_update();
+}
+
+void pcmgain_set_info(uint32_t sample_rate, uint32_t channels, uint32_t bits)
+{
+    pcmgain_sample_rate = sample_rate;
+    pcmgain_channels = channels;
+    pcmgain_bypass = (bits != 16);
+    if (pcmgain_bypass)
+    {
+        ESP_LOGW(TAG, "%d bits per sample not supported, passing through", bits);
+    }
+}
+
+void pcmgain_set_volume(int volume)
+{
+    pcmgain_volume = volume;
+    pcmgain_update();
+}
+
+void pcmgain_set_headphones(bool headphones)
+{
+    pcmgain_headphones = headphones;
+    pcmgain_update();
+}
+
+void pcmgain_get_stats(pcmgain_stats_t *stats)
+{
+    memcpy(stats, &pcmgain_stats, sizeof(pcmgain_stats_t));
+}
+
+/* every content fades in from silence, so starting mid-stream does not click */
+static esp_err_t pcmgain_open(audio_element_handle_t self)
+{
+    pcmgain_state_init(&pcmgain_state, 0, pcmgain_sample_rate, pcmgain_channels);
+    pcmgain_state_target(&pcmgain_state, pcmgain_target);
+
+    return ESP_OK;
+}
+
+static esp_err_t pcmgain_close(audio_element_handle_t self)
+{
+    pcmgain_stats.samples += pcmgain_state.stats.samples;
+    pcmgain_stats.scaled += pcmgain_state.stats.scaled;
+    pcmgain_stats.ramps += pcmgain_state.stats.ramps;
+    memset(&pcmgain_state.stats, 0x00, sizeof(pcmgain_state.stats));
+
+    return ESP_OK;
+}
+
+static int pcmgain_element_process(audio_element_handle_t self, char *buffer, int len)
+{
+    int bytes = audio_element_input(self, buffer, len);
+
+    if (bytes <= 0)
+    {
+        return bytes;
+    }
+    if (!pcmgain_bypass)
+    {
+        if (pcmgain_state.channels != pcmgain_channels || pcmgain_state.sample_rate != pcmgain_sample_rate)
+        {
+            pcmgain_state.channels = pcmgain_channels ? pcmgain_channels : 1;
+            pcmgain_state.sample_rate = pcmgain_sample_rate;
+        }
+        if (pcmgain_state.target != pcmgain_target)
+        {
+            pcmgain_state_target(&pcmgain_state, pcmgain_target);
+        }
+        pcmgain_process(&pcmgain_state, (int16_t *)buffer, bytes / sizeof(int16_t));
+    }
+
+    return audio_element_output(self, buffer, bytes);
+}
+
+audio_element_handle_t pcmgain_init(void)
+{
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+
+    cfg.open = pcmgain_open;
+    cfg.close = pcmgain_close;
+    cfg.process = pcmgain_element_process;
+    cfg.buffer_len = PCMGAIN_BUFFER_LEN;
+    cfg.task_stack = PCMGAIN_TASK_STACK;
+    cfg.task_prio = PCMGAIN_TASK_PRIO;
+    cfg.out_rb_size = PCMGAIN_OUT_RB_SIZE;
+    cfg.stack_in_ext = false;
+    cfg.tag = "gain";
+
+    return audio_element_init(&cfg);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "audio_element.h"
+
+#define PCMGAIN_TASK_PRIO 23
+#define PCMGAIN_TASK_STACK 3072
+#define PCMGAIN_BUFFER_LEN 2048
+#define PCMGAIN_OUT_RB_SIZE 4096
+
+/* gains are Q15, unity is the largest one so a scaled sample always fits and never needs clipping */
+#define PCMGAIN_UNITY 32768
+/* while ramping the gain is constant for this many samples, so the inner loop stays a plain multiply */
+#define PCMGAIN_BLOCK 16
+#define PCMGAIN_RAMP_MS 20
+
+/* volume limit levels of the cloud settings in volume percent, the last one is the full range */
+#define PCMGAIN_LIMIT_PERCENT {25, 50, 75, 100}
+/* the DAC's volume range, see dac3100_set_volume() */
+#define PCMGAIN_DAC_RANGE_DB 63.5f
+
+typedef struct
+{
+    uint64_t samples;
+    uint64_t scaled;
+    uint32_t ramps;
+} pcmgain_stats_t;
+
+/* what a block of samples gets processed with, the pipeline element keeps one of its own */
+typedef struct
+{
+    int32_t gain;
+    int32_t target;
+    int32_t step;
+    uint32_t sample_rate;
+    uint32_t channels;
+    pcmgain_stats_t stats;
+} pcmgain_state_t;
+
+audio_element_handle_t pcmgain_init(void);
+void pcmgain_start(void);
+void pcmgain_set_info(uint32_t sample_rate, uint32_t channels, uint32_t bits);
+void pcmgain_set_volume(int volume);
+void pcmgain_set_headphones(bool headphones);
+void pcmgain_state_init(pcmgain_state_t *state, int32_t gain, uint32_t sample_rate, uint32_t channels);
+void pcmgain_state_target(pcmgain_state_t *state, int32_t target);
+void pcmgain_process(pcmgain_state_t *state, int16_t *samples, size_t count);
+void pcmgain_get_stats(pcmgain_stats_t *stats);
@@ -7,6 +7,8 @@
 #include "freertos/queue.h"
 
 #include "esp_log.h"
+#include "esp_event.h"
+#include "esp_timer.h"
 
 #include "sdkconfig.h"
 #include "audio_element.h"
@@ -23,12 +25,36 @@
 #include "math.h"
 #include "ledman.h"
 #include "cloud.h"
+#include "prefetch.h"
+#include "tafindex.h"
+#include "tafcache.h"
+#include "dlseg.h"
+#include "tafverify.h"
+#include "dlcache.h"
+#include "prebuffer.h"
+#include "freshness.h"
+#include "rtnl.h"
+#include "cachemgr.h"
+#include "pbstat.h"
+#include "pcmgain.h"
 
 audio_pipeline_handle_t pipeline;
 audio_element_handle_t i2s_stream_writer, music_decoder;
-audio_event_iface_handle_t evt;
+#if PB_GAIN_STAGE
+static audio_element_handle_t pcm_gain;
+#endif
 
 static QueueHandle_t playback_queue;
+/* unused request slots, so requesting playback does not need the heap */
+static QueueHandle_t playback_free_queue;
+static pb_req_slot_t playback_req_pool[PB_QUEUE_SIZE];
+static pb_req_stats_t pb_req_stats;
+/* requests, headset interrupts and pipeline/peripheral events all wake up the main loop.
+   every item gets taken after selecting its queue, else the set lists items that are gone and can overflow */
+static QueueSetHandle_t pb_queue_set;
+/* status reports still queued from the last halt, they get dropped when it is their turn */
+static UBaseType_t pb_stale_dec_events = 0;
+static UBaseType_t pb_stale_i2s_events = 0;
 static bool pb_default_content = false;
 static bool pb_playing = false;
 static pb_toniefile_t pb_toniefile_info;
@@ -36,14 +62,31 @@ static cloud_content_req_t *current_dl_req = NULL;
 
 static uint64_t pb_last_nfc_uid = 0;
 static uint32_t pb_last_play_position = 0;
+static uint32_t pb_last_play_time = 0;
+
+/* download progress, to decide when playing a download can start or continue */
+static prebuffer_rate_t pb_dl_rate;
+static uint32_t pb_dl_content_rate = 0;
+/* given by the decoder when the download did not keep up, the main loop then pauses */
+static SemaphoreHandle_t pb_underrun_sem;
+static bool pb_underrun = false;
+static int64_t pb_underrun_start = 0;
+static pb_underrun_stats_t pb_underrun_stats;
+
+/* time from a play request until the I²S output runs again */
+static int64_t pb_restart_start = 0;
+static pb_restart_stats_t pb_restart_stats;
+static pb_clock_stats_t pb_clock_stats;
 
 static const char *TAG = "[PB]";
 
+ESP_EVENT_DEFINE_BASE(PB_EVENT);
+
 /* ********************************************************************************************************************* */
 /* ********************************************************************************************************************* */
 /* ********************************************************************************************************************* */
 
-TonieboxAudioFileHeader *pb_toniefile_get_header(FILE *fd)
+esp_err_t pb_toniefile_get_header(FILE *fd, pb_taf_header_t *header)
 {
     fseek(fd, 0, SEEK_SET);
 
@@ -51,20 +94,20 @@ TonieboxAudioFileHeader *pb_toniefile_get_header(FILE *fd)
     if (fread(proto_be, 4, 1, fd) != 1)
     {
         ESP_LOGE(TAG, "Failed to read header size");
-        return NULL;
+        return ESP_FAIL;
     }
     uint32_t proto_size = (proto_be[0] << 24) | (proto_be[1] << 16) | (proto_be[2] << 8) | proto_be[3];
     if (proto_size > TONIEFILE_FRAME_SIZE)
     {
         ESP_LOGE(TAG, "Invalid header size: 0x%04X", proto_size);
-        return NULL;
+        return ESP_FAIL;
     }
     uint8_t *buffer = malloc(proto_size);
     if (fread(buffer, proto_size, 1, fd) != 1)
     {
         free(buffer);
         ESP_LOGE(TAG, "Failed to read header");
-        return NULL;
+        return ESP_FAIL;
     }
 
     TonieboxAudioFileHeader *taf = toniebox_audio_file_header__unpack(NULL, proto_size, (const uint8_t *)buffer);
@@ -72,32 +115,50 @@ TonieboxAudioFileHeader *pb_toniefile_get_header(FILE *fd)
     if (!taf)
     {
         ESP_LOGE(TAG, "Failed to parse header");
-        return NULL;
+        return ESP_FAIL;
+    }
+
+    /* keep only what playback needs, so the protobuf allocations are gone right away */
+    if (taf->n_track_page_nums > TONIEFILE_MAX_CHAPTERS)
+    {
+        ESP_LOGW(TAG, "Too many chapters: %d, using the first %d", taf->n_track_page_nums, TONIEFILE_MAX_CHAPTERS);
+    }
+    memset(header, 0x00, sizeof(pb_taf_header_t));
+    header->audio_id = taf->audio_id;
+    header->num_bytes = taf->num_bytes;
+    if (taf->sha1_hash.len == sizeof(header->sha1_hash))
+    {
+        memcpy(header->sha1_hash, taf->sha1_hash.data, sizeof(header->sha1_hash));
     }
+    header->n_track_page_nums = (taf->n_track_page_nums > TONIEFILE_MAX_CHAPTERS) ? TONIEFILE_MAX_CHAPTERS : taf->n_track_page_nums;
+    memcpy(header->track_page_nums, taf->track_page_nums, header->n_track_page_nums * sizeof(uint32_t));
+    toniebox_audio_file_header__free_unpacked(taf, NULL);
 
-    return taf;
+    return ESP_OK;
 }
 
-esp_err_t pb_toniefile_open(pb_toniefile_t *info, const char *filepath)
+/* open the file and parse its header, which can be done while another file is still playing */
+static esp_err_t pb_toniefile_prepare(pb_toniefile_t *info, const char *filepath, cloud_content_req_t *dl)
 {
     memset(info, 0x00, sizeof(pb_toniefile_t));
 
     info->filename = strdup(filepath);
 
-    if (current_dl_req)
+    if (dl)
     {
         ESP_LOGI(TAG, "Download in progress, using already open file");
-        while (current_dl_req->state < CC_STATE_RECEIVING)
+        while (dl->state < CC_STATE_RECEIVING)
         {
-            vTaskDelay(100 / portTICK_PERIOD_MS);
+            cloud_content_wait(dl, portMAX_DELAY);
         }
-        while (!xSemaphoreTake(current_dl_req->file_sem, 1000 / portTICK_PERIOD_MS))
+        while (!xSemaphoreTake(dl->file_sem, 1000 / portTICK_PERIOD_MS))
         {
             ESP_LOGE(TAG, "Open: Timed out waiting for file lock...");
         }
-        info->taf = pb_toniefile_get_header(current_dl_req->handle);
-        xSemaphoreGive(current_dl_req->file_sem);
-        if (!info->taf)
+        /* the file is still growing, so there is nothing worth caching */
+        esp_err_t ret = pb_toniefile_get_header(dl->handle, &info->taf);
+        xSemaphoreGive(dl->file_sem);
+        if (ret != ESP_OK)
         {
             free(info->filename);
             return ESP_FAIL;
@@ -113,8 +174,9 @@ esp_err_t pb_toniefile_open(pb_toniefile_t *info, const char *filepath)
             free(info->filename);
             return ESP_FAIL;
         }
-        info->taf = pb_toniefile_get_header(info->fd);
-        if (!info->taf)
+        /* whole blocks are read straight into the prefetch buffers, stdio buffering would only add a copy */
+        setvbuf(info->fd, NULL, _IONBF, 0);
+        if (tafcache_get(info->filename, NULL, info->fd, &info->taf) != ESP_OK)
         {
             fclose(info->fd);
             free(info->filename);
@@ -122,26 +184,65 @@ esp_err_t pb_toniefile_open(pb_toniefile_t *info, const char *filepath)
         }
     }
 
-    ESP_LOGI(TAG, "  Audio ID: %08X", info->taf->audio_id);
-    ESP_LOGI(TAG, "  Size:     %08llX", info->taf->num_bytes);
-    ESP_LOGI(TAG, "  Chapters: %d", info->taf->n_track_page_nums);
-    for (int chap = 0; chap < info->taf->n_track_page_nums; chap++)
+    ESP_LOGI(TAG, "  Audio ID: %08X", info->taf.audio_id);
+    ESP_LOGI(TAG, "  Size:     %08llX", info->taf.num_bytes);
+    ESP_LOGI(TAG, "  Chapters: %d", info->taf.n_track_page_nums);
+    for (int chap = 0; chap < info->taf.n_track_page_nums; chap++)
     {
-        ESP_LOGI(TAG, "    %d: offset %08X", chap, info->taf->track_page_nums[chap]);
+        ESP_LOGI(TAG, "    %d: offset %08X", chap, info->taf.track_page_nums[chap]);
     }
 
     info->current_pos = TONIEFILE_FRAME_SIZE;
     info->current_block = 0;
-    info->current_chapter = 0;
+    /* none yet, so the first read posts the chapter the new content starts with */
+    info->current_chapter = -1;
+    info->chapter_start_block = 0;
+    info->chapter_end_block = -1;
     info->target_chapter = -1;
     info->target_pos = -1;
     info->seek_blocks = 0;
+    info->pre_skip = 0;
+    info->current_granule = TAFINDEX_GRANULE_INVALID;
+    info->target_granule = TAFINDEX_GRANULE_INVALID;
+    info->block_data = NULL;
+    info->block_data_block = -1;
     info->valid = true;
     info->initialized = false;
 
     return ESP_OK;
 }
 
+/* the decode benchmark reads through the same code, but must not touch the state of what is being played */
+static bool pb_toniefile_is_current(pb_toniefile_t *info)
+{
+    return info == &pb_toniefile_info;
+}
+
+static void pb_toniefile_start(pb_toniefile_t *info, cloud_content_req_t *dl)
+{
+    /* start reading ahead right away, the decoder will begin with the Ogg header in block 1 */
+    if (dl)
+    {
+        prefetch_start(NULL, dl, 1);
+    }
+    else
+    {
+        prefetch_start(info->fd, NULL, 1);
+    }
+}
+
+/* open a stored file to be read with pb_toniefile_cbr(), for others than the playback itself */
+esp_err_t pb_toniefile_open(pb_toniefile_t *info, const char *filepath)
+{
+    if (pb_toniefile_prepare(info, filepath, NULL) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    pb_toniefile_start(info, NULL);
+
+    return ESP_OK;
+}
+
 void pb_toniefile_close(pb_toniefile_t *info)
 {
     if (!info->valid)
@@ -149,24 +250,91 @@ void pb_toniefile_close(pb_toniefile_t *info)
         return;
     }
 
+    /* make sure the prefetcher is not accessing the file anymore */
+    prefetch_stats_t stats;
+    prefetch_get_stats(&stats);
+    ESP_LOGI(TAG, "Read %llu bytes in %d blocks, copied %llu bytes to decoder, %d late blocks",
+             stats.bytes_read, stats.blocks_read, stats.bytes_copied, stats.not_ready);
+    prefetch_stop();
+    info->block_data = NULL;
+    info->block_data_block = -1;
+
     FILE *fd = info->fd;
     info->valid = false;
     info->fd = NULL;
     /* ToDo: all of that remote/local playback thing has to be coordinated. for now just leave handles open */
-    if (!current_dl_req)
+    if (fd && (!pb_toniefile_is_current(info) || !current_dl_req))
     {
         fclose(fd);
     }
-    toniebox_audio_file_header__free_unpacked(info->taf, NULL);
-    info->taf = NULL;
     free(info->filename);
     info->filename = NULL;
 }
 
-static size_t pb_ensure_block(pb_toniefile_t *info, FILE *fd)
+static void pb_toniefile_release(pb_toniefile_t *info)
+{
+    if (info->block_data)
+    {
+        prefetch_release(info->block_data_block);
+        info->block_data = NULL;
+        info->block_data_block = -1;
+        info->block_data_avail = 0;
+    }
+}
+
+/* copy straight from the prefetch buffer of the given block into the decoder's input buffer */
+static int pb_toniefile_copy(pb_toniefile_t *info, int32_t block, int32_t offset, char *buffer, int len, TickType_t ticks_to_wait)
 {
-    bool read = false;
+    if (info->block_data_block != block)
+    {
+        pb_toniefile_release(info);
 
+        const uint8_t *data = NULL;
+        int32_t avail = prefetch_acquire(block, &data, ticks_to_wait);
+        if (avail <= 0)
+        {
+            return avail;
+        }
+        info->block_data = data;
+        info->block_data_block = block;
+        info->block_data_avail = avail;
+
+        /* the first audio block starts with the OpusHead, all others tell the position we are playing at */
+        if (block == 1)
+        {
+            tafindex_pre_skip(data, avail, &info->pre_skip);
+        }
+        else
+        {
+            uint64_t granule = tafindex_block_first_granule(data, avail);
+            if (granule != TAFINDEX_GRANULE_INVALID)
+            {
+                info->current_granule = granule;
+                if (pb_toniefile_is_current(info) && !pb_default_content)
+                {
+                    pb_last_play_time = tafindex_granule_to_ms(granule, info->pre_skip);
+                }
+            }
+        }
+    }
+
+    int32_t remain = info->block_data_avail - offset;
+    if (remain < 0)
+    {
+        remain = 0;
+    }
+    if (len > remain)
+    {
+        len = remain;
+    }
+    memcpy(buffer, &info->block_data[offset], len);
+    prefetch_account_copy(len);
+
+    return len;
+}
+
+static int pb_toniefile_read(pb_toniefile_t *info, char *buffer, int len, TickType_t ticks_to_wait)
+{
     /* when starting with no block preselected, we can safely start playing at the first block */
     if (info->current_block == 0)
     {
@@ -176,52 +344,111 @@ static size_t pb_ensure_block(pb_toniefile_t *info, FILE *fd)
     /* else, before we can play any position, read the initial ogg header block */
     if (!info->initialized)
     {
-        if (info->current_pos == TONIEFILE_FRAME_SIZE)
-        {
-            fseek(fd, TONIEFILE_FRAME_SIZE, SEEK_SET);
-            info->current_block_avail = fread(info->current_block_buffer, 1, 0x200, fd);
-        }
-
         /* before we continue, first consume the initial Ogg block */
-        size_t remain = info->current_block_avail - (info->current_pos % TONIEFILE_FRAME_SIZE);
-        if (remain)
+        int32_t offset = info->current_pos - TONIEFILE_FRAME_SIZE;
+        if (offset < TONIEFILE_OGG_HEADER_SIZE)
         {
-            return remain;
+            if (len > TONIEFILE_OGG_HEADER_SIZE - offset)
+            {
+                len = TONIEFILE_OGG_HEADER_SIZE - offset;
+            }
+            return pb_toniefile_copy(info, 1, offset, buffer, len, ticks_to_wait);
         }
 
         /* consumed the 0x200 bytes "first-block", proceed to normal operation */
         info->current_pos = info->current_block * TONIEFILE_FRAME_SIZE;
-        info->current_block = 0;
         info->initialized = true;
     }
 
-    if (info->current_pos >= (info->current_block + 1) * TONIEFILE_FRAME_SIZE)
+    /* after seeking to a time, skip the pages in front of the requested position */
+    if (info->target_granule != TAFINDEX_GRANULE_INVALID && (info->current_pos % TONIEFILE_FRAME_SIZE) == 0)
     {
-        read = true;
+        int ret = pb_toniefile_copy(info, info->current_pos / TONIEFILE_FRAME_SIZE, 0, buffer, 0, ticks_to_wait);
+        if (ret == PREFETCH_NOT_READY)
+        {
+            return ret;
+        }
+        if (info->block_data)
+        {
+            size_t offset = tafindex_page_offset(info->block_data, info->block_data_avail, info->target_granule);
+            ESP_LOGI(TAG, "Skip %zu bytes to reach granule %llu", offset, info->target_granule);
+            info->current_pos += offset;
+        }
+        info->target_granule = TAFINDEX_GRANULE_INVALID;
     }
-    if (info->current_pos < info->current_block * TONIEFILE_FRAME_SIZE)
+
+    info->current_block = info->current_pos / TONIEFILE_FRAME_SIZE;
+    if (pb_toniefile_is_current(info) && !pb_default_content)
     {
-        read = true;
+        pb_last_play_position = info->current_block;
     }
 
-    if (read)
+    return pb_toniefile_copy(info, info->current_block, info->current_pos % TONIEFILE_FRAME_SIZE, buffer, len, ticks_to_wait);
+}
+
+/* find the chapter which contains the given audio block */
+static int32_t pb_toniefile_find_chapter(pb_toniefile_t *info, int32_t block)
+{
+    int32_t low = 0;
+    int32_t high = info->taf.n_track_page_nums;
+
+    /* first chapter whose start is behind the block, the one before is the current */
+    while (low < high)
     {
-        info->current_block = info->current_pos / TONIEFILE_FRAME_SIZE;
-        fseek(fd, info->current_block * TONIEFILE_FRAME_SIZE, SEEK_SET);
-        info->current_block_avail = fread(info->current_block_buffer, 1, TONIEFILE_FRAME_SIZE, fd);
-        if (info->current_block_avail < 0)
+        int32_t mid = low + (high - low) / 2;
+        if (info->taf.track_page_nums[mid] <= block)
+        {
+            low = mid + 1;
+        }
+        else
         {
-            info->current_block_avail = 0;
+            high = mid;
         }
     }
-    if (!pb_default_content)
+
+    return low - 1;
+}
+
+/* called for every decoder read, so only do real work when a chapter boundary was crossed */
+static void pb_toniefile_update_chapter(pb_toniefile_t *info)
+{
+    int32_t block = (info->current_pos / TONIEFILE_FRAME_SIZE) - 1;
+    int32_t chapters = info->taf.n_track_page_nums;
+
+    if (!chapters || (block >= info->chapter_start_block && block < info->chapter_end_block))
     {
-        pb_last_play_position = info->current_block;
+        return;
+    }
+
+    int32_t chapter = info->current_chapter;
+
+    /* regular playback moves on to the next chapter, anything else was a seek */
+    if (block == info->chapter_end_block && chapter + 1 < chapters)
+    {
+        chapter++;
+    }
+    else
+    {
+        chapter = pb_toniefile_find_chapter(info, block);
     }
 
-    size_t remain = info->current_block_avail - (info->current_pos % TONIEFILE_FRAME_SIZE);
+    info->chapter_start_block = (chapter >= 0) ? info->taf.track_page_nums[chapter] : INT32_MIN;
+    info->chapter_end_block = (chapter + 1 < chapters) ? info->taf.track_page_nums[chapter + 1] : INT32_MAX;
 
-    return remain;
+    if (info->current_chapter != chapter)
+    {
+        info->current_chapter = chapter;
+        ESP_LOGI(TAG, "Current chapter: %d", info->current_chapter);
+
+        if (pb_toniefile_is_current(info))
+        {
+            pb_event_chapter_t event = {
+                .nfc_uid = pb_default_content ? 0 : pb_last_nfc_uid,
+                .chapter = chapter,
+                .chapters = chapters};
+            esp_event_post(PB_EVENT, PB_EVENT_CHAPTER_CHANGED, &event, sizeof(event), 0);
+        }
+    }
 }
 
 int pb_toniefile_cbr(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context)
@@ -238,9 +465,9 @@ int pb_toniefile_cbr(audio_element_handle_t self, char *buffer, int len, TickTyp
     if (info->target_chapter >= 0)
     {
         ESP_LOGI(TAG, "Set target chapter %d", info->target_chapter);
-        if (info->target_chapter < info->taf->n_track_page_nums)
+        if (info->target_chapter < info->taf.n_track_page_nums)
         {
-            uint32_t block = 1 + info->taf->track_page_nums[info->target_chapter];
+            uint32_t block = 1 + info->taf.track_page_nums[info->target_chapter];
             uint32_t offset = block * TONIEFILE_FRAME_SIZE;
 
             ESP_LOGI(TAG, " -> block %d, offset %d", block, offset);
@@ -294,48 +521,22 @@ int pb_toniefile_cbr(audio_element_handle_t self, char *buffer, int len, TickTyp
         }
     }
 
-    /* update chapter info */
-    {
-        int32_t current_block = (info->current_pos / TONIEFILE_FRAME_SIZE) - 1;
+    pb_toniefile_update_chapter(info);
 
-        for (int chap = 0; chap < info->taf->n_track_page_nums; chap++)
-        {
-            if (current_block < info->taf->track_page_nums[chap])
-            {
-                if (info->current_chapter != chap - 1)
-                {
-                    info->current_chapter = chap - 1;
-                    ESP_LOGI(TAG, "Current chapter: %d", info->current_chapter);
-                }
-                break;
-            }
-        }
-    }
+    int64_t read_start = pbstat_read_begin();
+    int bytes_read = pb_toniefile_read(info, buffer, len, ticks_to_wait);
+    pbstat_read_end(read_start, bytes_read);
 
-    int bytes_read = 0;
-    int avail = 0;
-    if (current_dl_req)
+    if (bytes_read == PREFETCH_NOT_READY)
     {
-        while (!xSemaphoreTake(current_dl_req->file_sem, 1000 / portTICK_PERIOD_MS))
+        /* let the main loop pause instead of running the output dry */
+        if (pb_toniefile_is_current(info) && current_dl_req && !pb_underrun)
         {
-            ESP_LOGE(TAG, "Playback: Timed out waiting for file lock...");
+            xSemaphoreGive(pb_underrun_sem);
         }
-        avail = pb_ensure_block(info, current_dl_req->handle);
-        xSemaphoreGive(current_dl_req->file_sem);
-    }
-    else
-    {
-        avail = pb_ensure_block(info, info->fd);
+        return AEL_IO_TIMEOUT;
     }
 
-    if (len > avail)
-    {
-        len = avail;
-    }
-    int offset = info->current_pos % TONIEFILE_FRAME_SIZE;
-    memcpy(buffer, &info->current_block_buffer[offset], len);
-    bytes_read = len;
-
     if (bytes_read > 0)
     {
         info->current_pos += bytes_read;
@@ -366,6 +567,31 @@ esp_err_t pb_seek(int32_t blocks)
     return ESP_OK;
 }
 
+/* find the block via the index and let the reader skip to the right page within that block */
+esp_err_t pb_seek_time(uint32_t time_ms)
+{
+    if (!pb_toniefile_info.valid)
+    {
+        return ESP_FAIL;
+    }
+
+    uint64_t granule = 0;
+    int32_t block = 0;
+    esp_err_t ret = tafindex_lookup(pb_toniefile_info.filename, pb_toniefile_info.taf.audio_id, time_ms, &block, &granule);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGW(TAG, "No index to seek to %d ms", time_ms);
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Seek to %d ms -> block %d", time_ms, block);
+    rtnl_log(RTNL_GROUP_PLAYBACK, RTNL_PB_SEEK, time_ms, NULL, 0);
+    pb_toniefile_info.target_granule = granule;
+    pb_toniefile_info.target_pos = block * TONIEFILE_FRAME_SIZE;
+
+    return ESP_OK;
+}
+
 esp_err_t pb_set_chapter(int32_t chapter)
 {
     if (!pb_toniefile_info.valid)
@@ -391,15 +617,21 @@ esp_err_t pb_seek_chapter(int32_t chapters)
     {
         return ESP_FAIL;
     }
-    int32_t target = pb_get_chapter() + chapters;
+    /* when there is a chapter change pending already, go on from there */
+    int32_t current = pb_toniefile_info.target_chapter;
+    if (current < 0)
+    {
+        current = pb_get_chapter();
+    }
+    int32_t target = current + chapters;
 
     if (target < 0)
     {
         target = 0;
     }
-    if (target >= pb_toniefile_info.taf->n_track_page_nums)
+    if (target >= pb_toniefile_info.taf.n_track_page_nums)
     {
-        target = pb_toniefile_info.taf->n_track_page_nums - 1;
+        target = pb_toniefile_info.taf.n_track_page_nums - 1;
     }
     return pb_set_chapter(target);
 }
@@ -429,15 +661,6 @@ char *pb_build_filename(uint64_t id)
     return filename;
 }
 
-esp_err_t pb_play(const char *uri)
-{
-    ESP_LOGI(TAG, "[ * ] Queue uri: '%s'", uri);
-    char *msg = strdup(uri);
-    xQueueSend(playback_queue, &msg, portMAX_DELAY);
-
-    return ESP_OK;
-}
-
 esp_err_t pb_check_file(const char *filename)
 {
     ESP_LOGI(TAG, "Check file '%s'", filename);
@@ -456,79 +679,147 @@ esp_err_t pb_check_file(const char *filename)
         return PB_ERR_EMPTY_FILE;
     }
 
-    /* read details */
-    FILE *fd = fopen(filename, "rb");
-    if (!fd)
+    /* read details, usually already known from the last time the tag was placed.
+       the header is too large for the stacks this gets called on */
+    pb_taf_header_t *taf = malloc(sizeof(pb_taf_header_t));
+    if (!taf)
+    {
+        ESP_LOGE(TAG, "Out of memory checking '%s'", filename);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = tafcache_get(filename, &st, NULL, taf);
+
+    if (ret == ESP_ERR_NOT_FOUND)
     {
         ESP_LOGE(TAG, "Failed to open file: '%s'", filename);
+        free(taf);
         return PB_ERR_NO_FILE;
     }
-
-    TonieboxAudioFileHeader *taf = pb_toniefile_get_header(fd);
-    fclose(fd);
-
-    if (!taf)
+    if (ret != ESP_OK)
     {
         ESP_LOGE(TAG, "Failed to read file: '%s'", filename);
+        free(taf);
         return PB_ERR_CORRUPTED_FILE;
     }
+    uint64_t num_bytes = taf->num_bytes;
+    free(taf);
+
+    /* a split download writes behind the end first, so the size alone does not tell it is complete */
+    if (dlseg_pending(filename))
+    {
+        ESP_LOGW(TAG, "  download has missing ranges -> partial");
+        return PB_ERR_PARTIAL_FILE;
+    }
 
-    esp_err_t ret = PB_ERR_GOOD_FILE;
+    if (st.st_size != num_bytes + TONIEFILE_FRAME_SIZE)
+    {
+        ESP_LOGW(TAG, "  TAF size: %llu, file size: %ld -> partial", num_bytes, st.st_size);
+        return PB_ERR_PARTIAL_FILE;
+    }
 
-    if (st.st_size != taf->num_bytes + TONIEFILE_FRAME_SIZE)
+    /* unverified files get played, the verifier checks them in the background */
+    if (tafverify_check(filename, st.st_size) == ESP_ERR_INVALID_CRC)
     {
-        ESP_LOGW(TAG, "  TAF size: %llu, file size: %ld -> partial", taf->num_bytes, st.st_size);
-        ret = PB_ERR_PARTIAL_FILE;
+        ESP_LOGE(TAG, "  content does not match its hash -> corrupted");
+        rtnl_log(RTNL_GROUP_ERROR, RTNL_ERR_FILE, PB_ERR_CORRUPTED_FILE, NULL, 0);
+        return PB_ERR_CORRUPTED_FILE;
     }
-    toniebox_audio_file_header__free_unpacked(taf, NULL);
 
-    return ret;
+    /* the freshness check found newer content in the cloud */
+    if (freshness_outdated(filename))
+    {
+        ESP_LOGI(TAG, "  newer content available -> outdated");
+        return PB_ERR_OUTDATED_FILE;
+    }
+
+    return PB_ERR_GOOD_FILE;
+}
+
+/* queue a request taken from the pool, noting when it was issued */
+static void pb_req_send(pb_req_t *req)
+{
+    req->queued = esp_timer_get_time();
+    xQueueSend(playback_queue, &req, portMAX_DELAY);
+}
+
+static pb_req_t *pb_req_alloc()
+{
+    pb_req_t *req = NULL;
+
+    xQueueReceive(playback_free_queue, &req, portMAX_DELAY);
+    return req;
+}
+
+static void pb_req_free(pb_req_t *req)
+{
+    xQueueSend(playback_free_queue, &req, portMAX_DELAY);
 }
 
 esp_err_t pb_play_default(uint32_t id)
 {
-    pb_req_default_t *req = malloc(sizeof(pb_req_default_t));
+    pb_req_default_t *req = (pb_req_default_t *)pb_req_alloc();
 
     req->hdr.type = PB_REQ_TYPE_DEFAULT;
     req->voiceline = id;
 
-    xQueueSend(playback_queue, &req, portMAX_DELAY);
+    pb_req_send(&req->hdr);
     return ESP_OK;
 }
 
 /* when being called with the token, it depends on the play state what to do */
 esp_err_t pb_play_content_token(uint64_t nfc_uid, const uint8_t *token)
 {
-    pb_req_play_token_t *req = malloc(sizeof(pb_req_play_token_t));
+    pb_req_play_token_t *req = (pb_req_play_token_t *)pb_req_alloc();
 
     req->hdr.type = PB_REQ_TYPE_PLAY_TOKEN;
     req->uid = nfc_uid;
     memcpy(req->token, token, 32);
-    xQueueSend(playback_queue, &req, portMAX_DELAY);
+    freshness_note_token(nfc_uid, token);
+    pb_req_send(&req->hdr);
     return ESP_OK;
 }
 
 esp_err_t pb_play_content(uint64_t nfc_uid)
 {
-    pb_req_play_t *req = malloc(sizeof(pb_req_play_t));
+    pb_req_play_t *req = (pb_req_play_t *)pb_req_alloc();
 
     req->hdr.type = PB_REQ_TYPE_PLAY;
     req->uid = nfc_uid;
 
-    xQueueSend(playback_queue, &req, portMAX_DELAY);
+    pb_req_send(&req->hdr);
     return ESP_OK;
 }
 
 esp_err_t pb_stop()
 {
-    pb_req_stop_t *req = malloc(sizeof(pb_req_stop_t));
+    pb_req_stop_t *req = (pb_req_stop_t *)pb_req_alloc();
 
     req->hdr.type = PB_REQ_TYPE_STOP;
 
-    xQueueSend(playback_queue, &req, portMAX_DELAY);
+    pb_req_send(&req->hdr);
     return ESP_OK;
 }
 
+void pb_get_req_stats(pb_req_stats_t *stats)
+{
+    memcpy(stats, &pb_req_stats, sizeof(pb_req_stats_t));
+}
+
+void pb_get_underrun_stats(pb_underrun_stats_t *stats)
+{
+    memcpy(stats, &pb_underrun_stats, sizeof(pb_underrun_stats_t));
+}
+
+void pb_get_restart_stats(pb_restart_stats_t *stats)
+{
+    memcpy(stats, &pb_restart_stats, sizeof(pb_restart_stats_t));
+}
+
+void pb_get_clock_stats(pb_clock_stats_t *stats)
+{
+    memcpy(stats, &pb_clock_stats, sizeof(pb_clock_stats_t));
+}
+
 bool pb_is_playing()
 {
     return pb_playing;
@@ -544,21 +835,132 @@ uint32_t pb_get_play_position()
     return pb_toniefile_info.current_block;
 }
 
+uint32_t pb_get_play_time()
+{
+    if (!pb_is_playing())
+    {
+        return 0;
+    }
+
+    return tafindex_granule_to_ms(pb_toniefile_info.current_granule, pb_toniefile_info.pre_skip);
+}
+
 uint64_t pb_get_current_uid()
 {
     return pb_last_nfc_uid;
 }
 
-void pb_set_last(uint64_t nfc_uid, uint32_t play_position)
+void pb_set_last(uint64_t nfc_uid, uint32_t play_position, uint32_t play_time)
 {
     pb_last_nfc_uid = nfc_uid;
     pb_last_play_position = play_position;
+    pb_last_play_time = play_time;
 }
 
 /********************************************************/
 /* helpers for main loop, only to be called from there  */
 /********************************************************/
 
+/* Opus rate of the content, from the position reached by the latest downloaded block */
+static uint32_t pb_dl_get_content_rate(cloud_content_req_t *dl)
+{
+    int32_t block = dl->received / TONIEFILE_FRAME_SIZE - 1;
+
+    if (pb_dl_content_rate || block < 2)
+    {
+        return pb_dl_content_rate;
+    }
+
+    uint8_t *buffer = malloc(TONIEFILE_FRAME_SIZE);
+    int32_t avail = dlcache_read(block, buffer);
+    if (avail > 0)
+    {
+        uint32_t ms = tafindex_granule_to_ms(tafindex_block_last_granule(buffer, avail), 0);
+        if (ms > 0)
+        {
+            pb_dl_content_rate = (uint64_t)block * TONIEFILE_FRAME_SIZE * 1000 / ms;
+            ESP_LOGI(TAG, "Content rate: %d bytes/s", pb_dl_content_rate);
+        }
+    }
+    free(buffer);
+
+    return pb_dl_content_rate;
+}
+
+/* whether enough of the download arrived to play from the given block without running dry */
+static bool pb_dl_prebuffered(cloud_content_req_t *dl, int32_t block)
+{
+    prebuffer_rate_update(&pb_dl_rate, dl->received, esp_timer_get_time());
+
+    prebuffer_state_t state = {
+        .received = dl->received,
+        .total = dl->total_length,
+        .start = block * TONIEFILE_FRAME_SIZE,
+        .download_rate = pb_dl_rate.rate,
+        .content_rate = pb_dl_get_content_rate(dl)};
+
+    return prebuffer_can_start(&state);
+}
+
+static void pb_underrun_pause()
+{
+    if (!current_dl_req || !pb_playing || pb_underrun)
+    {
+        return;
+    }
+    ESP_LOGW(TAG, "Download fell behind at block %d, pausing", pb_toniefile_info.current_block);
+    pb_underrun = true;
+    pb_underrun_start = esp_timer_get_time();
+    pb_underrun_stats.underruns++;
+    audio_pipeline_pause(pipeline);
+    rtnl_log(RTNL_GROUP_PLAYBACK, RTNL_PB_UNDERRUN, pb_toniefile_info.current_block, NULL, 0);
+}
+
+static void pb_underrun_check()
+{
+    if (!pb_underrun)
+    {
+        return;
+    }
+    /* a failed download will not catch up anymore, play what is there */
+    if (current_dl_req && pb_playing && current_dl_req->state == CC_STATE_RECEIVING &&
+        !pb_dl_prebuffered(current_dl_req, pb_toniefile_info.current_block))
+    {
+        return;
+    }
+
+    uint32_t paused_ms = (esp_timer_get_time() - pb_underrun_start) / 1000;
+    pb_underrun_stats.paused_ms += paused_ms;
+    pb_underrun = false;
+
+    if (pb_playing)
+    {
+        ESP_LOGI(TAG, "Download caught up after %d ms, continuing", paused_ms);
+        audio_pipeline_resume(pipeline);
+    }
+}
+
+static void pb_restart_account(int64_t duration_us)
+{
+    uint32_t duration_ms = duration_us / 1000;
+
+    pb_restart_stats.restarts++;
+    pb_restart_stats.last_ms = duration_ms;
+    if (duration_ms > pb_restart_stats.max_ms)
+    {
+        pb_restart_stats.max_ms = duration_ms;
+    }
+    if (duration_ms > PB_RESTART_BUDGET_MS)
+    {
+        pb_restart_stats.over_budget++;
+        ESP_LOGW(TAG, "Restart took %d ms, more than %d ms", duration_ms, PB_RESTART_BUDGET_MS);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Restart took %d ms", duration_ms);
+    }
+}
+
 static esp_err_t pb_int_abort_dl()
 {
     /* do a semi-atomic swap, so other threads do not interfere */
@@ -568,17 +970,19 @@ static esp_err_t pb_int_abort_dl()
     if (curr)
     {
         ESP_LOGI(TAG, "There is a download for '%s'", curr->filename);
-        curr->abort = true;
-        while (curr->state < CC_STATE_FINISHED)
+        cloud_content_cancel(curr);
+        while (cloud_content_wait(curr, portMAX_DELAY) < CC_STATE_FINISHED)
         {
-            ESP_LOGI(TAG, "wait for abort...");
-            vTaskDelay(100 / portTICK_PERIOD_MS);
         }
         if (curr->handle)
         {
             fclose(curr->handle);
             curr->handle = NULL;
         }
+        if (curr->state == CC_STATE_FINISHED)
+        {
+            tafindex_request(curr->filename);
+        }
         cloud_content_cleanup(curr);
     }
 
@@ -595,9 +999,11 @@ static void pb_int_stop()
     audio_pipeline_stop(pipeline);
     audio_pipeline_wait_for_stop(pipeline);
     audio_pipeline_terminate(pipeline);
+    rtnl_log(RTNL_GROUP_PLAYBACK, RTNL_PB_STOP, pb_toniefile_info.current_block, NULL, 0);
 
     pb_playing = false;
     pb_default_content = false;
+    pb_underrun = false;
 
     /* close local file handles and free stuff */
     pb_toniefile_close(&pb_toniefile_info);
@@ -605,19 +1011,104 @@ static void pb_int_stop()
     pb_int_abort_dl();
 }
 
-static esp_err_t pb_int_play_file(const char *file, uint64_t nfc_uid)
+/* resetting the queues would leave their entries in the set, so only count what is to be skipped */
+static void pb_discard_events()
+{
+    pb_stale_dec_events = uxQueueMessagesWaiting(audio_element_get_event_queue(music_decoder));
+    pb_stale_i2s_events = uxQueueMessagesWaiting(audio_element_get_event_queue(i2s_stream_writer));
+}
+
+static bool pb_event_stale(QueueSetMemberHandle_t member)
+{
+    UBaseType_t *stale = NULL;
+
+    if (member == audio_element_get_event_queue(music_decoder))
+    {
+        stale = &pb_stale_dec_events;
+    }
+    else if (member == audio_element_get_event_queue(i2s_stream_writer))
+    {
+        stale = &pb_stale_i2s_events;
+    }
+
+    if (!stale || !*stale)
+    {
+        return false;
+    }
+    (*stale)--;
+    return true;
+}
+
+/* stop the pipeline but keep the element tasks, so the next source can start right away */
+static void pb_int_halt()
+{
+    if (!pb_playing)
+    {
+        return;
+    }
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+
+    /* the status reports of this stop must not be taken as the end of the next source */
+    pb_discard_events();
+    audio_pipeline_reset_ringbuffer(pipeline);
+    audio_pipeline_reset_elements(pipeline);
+    audio_pipeline_change_state(pipeline, AEL_STATE_INIT);
+
+    pb_playing = false;
+    pb_default_content = false;
+    pb_underrun = false;
+
+    pb_toniefile_close(&pb_toniefile_info);
+    pb_int_abort_dl();
+}
+
+static esp_err_t pb_int_play_file(const char *file, uint64_t nfc_uid, bool default_content)
 {
     ESP_LOGI(TAG, "Play: '%s'", file);
 
-    if (pb_toniefile_open(&pb_toniefile_info, file) != ESP_OK)
+    int64_t start = esp_timer_get_time();
+    /* too large for the playback task's stack, only this task plays files */
+    static pb_toniefile_t next;
+    /* a running download might still belong to the source being replaced */
+    cloud_content_req_t *dl = (current_dl_req && !strcmp(current_dl_req->filename, file)) ? current_dl_req : NULL;
+
+    /* open the next source while the current one keeps playing, then switch over */
+    if (pb_toniefile_prepare(&next, file, dl) != ESP_OK)
     {
         ESP_LOGE(TAG, "Failed to play file: '%s'", file);
+        rtnl_log(RTNL_GROUP_ERROR, RTNL_ERR_FILE, 0, &nfc_uid, sizeof(nfc_uid));
+        pb_int_stop();
         return ESP_FAIL;
     }
+    /* the halt aborts the current download, keep it running when the next source plays from it */
+    if (dl)
+    {
+        current_dl_req = NULL;
+    }
+    pb_int_halt();
+    if (dl)
+    {
+        current_dl_req = dl;
+    }
+
+    memcpy(&pb_toniefile_info, &next, sizeof(pb_toniefile_t));
+    pb_toniefile_start(&pb_toniefile_info, dl);
+    pb_default_content = default_content;
 
     if (!pb_default_content)
     {
-        if (nfc_uid == pb_last_nfc_uid)
+        int32_t block = 0;
+        uint64_t granule = 0;
+
+        if (nfc_uid == pb_last_nfc_uid && pb_last_play_time &&
+            tafindex_lookup(file, pb_toniefile_info.taf.audio_id, pb_last_play_time, &block, &granule) == ESP_OK && block > 1)
+        {
+            ESP_LOGI(TAG, "UID %16llX match, set last play time to %d ms, block %d", nfc_uid, pb_last_play_time, block);
+            pb_toniefile_info.current_block = block;
+            pb_toniefile_info.target_granule = granule;
+        }
+        else if (nfc_uid == pb_last_nfc_uid)
         {
             ESP_LOGI(TAG, "UID %16llX match, set last play position to %d", nfc_uid, pb_last_play_position);
             pb_toniefile_info.current_block = pb_last_play_position + 1;
@@ -626,10 +1117,25 @@ static esp_err_t pb_int_play_file(const char *file, uint64_t nfc_uid)
         {
             ESP_LOGI(TAG, "UID %16llX is new, play from start", nfc_uid);
             pb_last_play_position = 0;
+            pb_last_play_time = 0;
             pb_last_nfc_uid = nfc_uid;
         }
+
+        /* complete files get indexed in the background, if not done yet */
+        if (!current_dl_req)
+        {
+            tafindex_request(file);
+        }
     }
 
+    rtnl_log(RTNL_GROUP_PLAYBACK, RTNL_PB_START, pb_toniefile_info.taf.audio_id, &nfc_uid, sizeof(nfc_uid));
+    pbstat_start();
+    pcmgain_start();
+    if (!pb_default_content)
+    {
+        cachemgr_played(nfc_uid);
+    }
+    pb_restart_start = start;
     audio_pipeline_run(pipeline);
     audio_pipeline_resume(pipeline);
 
@@ -643,16 +1149,14 @@ static esp_err_t pb_int_play_default(uint32_t lang, uint32_t id)
     sprintf(filename, "/sdcard/CONTENT/%08X/%08X", lang, id);
     if (pb_check_file(filename) == PB_ERR_GOOD_FILE)
     {
-        pb_default_content = true;
-        return pb_int_play_file(filename, 0);
+        return pb_int_play_file(filename, 0, true);
     }
     lang = 0;
 
     sprintf(filename, "/sdcard/CONTENT/%08X/%08X", lang, id);
     if (pb_check_file(filename) == PB_ERR_GOOD_FILE)
     {
-        pb_default_content = true;
-        return pb_int_play_file(filename, 0);
+        return pb_int_play_file(filename, 0, true);
     }
     ESP_LOGE(TAG, "requested ID does not exist: '%08X', neither in lang %d nor in default", id, lang);
     return ESP_ERR_NOT_FOUND;
@@ -664,20 +1168,39 @@ static esp_err_t pb_int_play_default(uint32_t lang, uint32_t id)
 
 static esp_err_t pb_req_handle_play(pb_req_play_t *req)
 {
-    pb_int_stop();
-
     char *filename = pb_build_filename(req->uid);
-    esp_err_t file_state = pb_check_file(filename);
+    /* complete content is known from the index, no need to look at the card */
+    bool indexed = cachemgr_playable(req->uid);
+    esp_err_t file_state = PB_ERR_GOOD_FILE;
+
+    if (!indexed)
+    {
+        file_state = pb_check_file(filename);
+        cachemgr_update(req->uid, file_state);
+    }
+
+    /* better the old content than none at all */
+    if (file_state == PB_ERR_OUTDATED_FILE && !cloud_is_available())
+    {
+        file_state = PB_ERR_GOOD_FILE;
+    }
 
     /* right now we cannot play this file, wait for token to download it */
     if (file_state != PB_ERR_GOOD_FILE)
     {
+        pb_int_stop();
         free(filename);
         ledman_change("checking");
         return ESP_FAIL;
     }
 
-    pb_int_play_file(filename, req->uid);
+    /* the card belongs to the playback now */
+    freshness_yield();
+    if (pb_int_play_file(filename, req->uid, false) != ESP_OK && indexed)
+    {
+        /* the index was wrong, e.g. the card was changed elsewhere */
+        cachemgr_refresh_file(filename);
+    }
     free(filename);
 
     return ESP_OK;
@@ -693,11 +1216,12 @@ static esp_err_t pb_req_handle_play_token(pb_req_play_token_t *req)
 
     char *filename = pb_build_filename(req->uid);
     esp_err_t file_state = pb_check_file(filename);
+    cachemgr_update(req->uid, file_state);
 
     /* quite unexpected. should not happen, but play anyway */
     if (file_state == PB_ERR_GOOD_FILE)
     {
-        pb_int_play_file(filename, req->uid);
+        pb_int_play_file(filename, req->uid, false);
         free(filename);
         return ESP_OK;
     }
@@ -705,24 +1229,28 @@ static esp_err_t pb_req_handle_play_token(pb_req_play_token_t *req)
     ESP_LOGI(TAG, "requested file shall be downloaded first: '%s'", filename);
 
     /* if there is already a download running, cancel it first */
+    freshness_yield();
     pb_int_abort_dl();
 
     ESP_LOGI(TAG, "initiate download");
-    current_dl_req = cloud_content_download(req->uid, req->token);
+    current_dl_req = cloud_content_download(req->uid, req->token, CLOUD_PRIO_INTERACTIVE);
+    prebuffer_rate_reset(&pb_dl_rate);
+    pb_dl_content_rate = 0;
 
     if (!pb_default_content && pb_last_nfc_uid != req->uid)
     {
         pb_last_play_position = 0;
+        pb_last_play_time = 0;
     }
 
     bool proceed = false;
     bool waiting = true;
-    uint32_t start_pos = (pb_default_content ? 0 : pb_last_play_position) + PB_MIN_DL_BLOCKS;
+    uint32_t start_pos = (pb_default_content ? 0 : pb_last_play_position) + 1;
 
     while (waiting)
     {
-        vTaskDelay(100 / portTICK_PERIOD_MS);
-        switch (cloud_content_get_state(current_dl_req))
+        /* woken up with every received chunk, the timeout only keeps the log going */
+        switch (cloud_content_wait(current_dl_req, 1000 / portTICK_PERIOD_MS))
         {
         case CC_STATE_INIT:
         case CC_STATE_CONNECTING:
@@ -737,20 +1265,20 @@ static esp_err_t pb_req_handle_play_token(pb_req_play_token_t *req)
             ESP_LOGE(TAG, "Download failed");
             waiting = false;
             proceed = false;
-            current_dl_req = NULL;
+            pb_int_abort_dl();
             break;
 
         case CC_STATE_FINISHED:
             ESP_LOGI(TAG, "Download finished");
             waiting = false;
             proceed = true;
-            current_dl_req = NULL;
+            pb_int_abort_dl();
             break;
 
         case CC_STATE_RECEIVING:
-            if (current_dl_req->received / 4096 > start_pos)
+            if (pb_dl_prebuffered(current_dl_req, start_pos))
             {
-                ESP_LOGI(TAG, "Download in progress, enough blocks received");
+                ESP_LOGI(TAG, "Download in progress, %d blocks received at %d bytes/s", current_dl_req->received / TONIEFILE_FRAME_SIZE, pb_dl_rate.rate);
                 waiting = false;
                 proceed = true;
             }
@@ -766,7 +1294,7 @@ static esp_err_t pb_req_handle_play_token(pb_req_play_token_t *req)
         return ESP_ERR_NOT_FOUND;
     }
 
-    return pb_int_play_file(filename, req->uid);
+    return pb_int_play_file(filename, req->uid, false);
 }
 
 static esp_err_t pb_req_handle_stop(pb_req_stop_t *req)
@@ -777,173 +1305,329 @@ static esp_err_t pb_req_handle_stop(pb_req_stop_t *req)
 
 static esp_err_t pb_req_handle_default(pb_req_default_t *req)
 {
-    pb_int_stop();
-    return pb_int_play_default(0, req->voiceline);
+    /* switches over without tearing down the pipeline, if the voiceline exists */
+    esp_err_t ret = pb_int_play_default(0, req->voiceline);
+    if (ret != ESP_OK)
+    {
+        pb_int_stop();
+    }
+    return ret;
+}
+
+/* drop requests that a later one makes pointless, e.g. when a tag is flickering.
+   of each type only the latest request is kept and a stop cancels the plays queued before it,
+   the rest keeps its order. returns the number of requests left in the array */
+static int pb_req_coalesce(pb_req_t **reqs, int count)
+{
+    int last_stop = -1;
+
+    for (int pos = 0; pos < count; pos++)
+    {
+        if (reqs[pos]->type == PB_REQ_TYPE_STOP)
+        {
+            last_stop = pos;
+        }
+    }
+
+    int kept = 0;
+    for (int pos = 0; pos < count; pos++)
+    {
+        bool superseded = false;
+        for (int later = pos + 1; later < count; later++)
+        {
+            if (reqs[later]->type == reqs[pos]->type)
+            {
+                superseded = true;
+                break;
+            }
+        }
+        bool play = (reqs[pos]->type == PB_REQ_TYPE_PLAY || reqs[pos]->type == PB_REQ_TYPE_PLAY_TOKEN);
+        if (play && pos < last_stop)
+        {
+            superseded = true;
+        }
+
+        if (superseded)
+        {
+            pb_req_free(reqs[pos]);
+        }
+        else
+        {
+            reqs[kept++] = reqs[pos];
+        }
+    }
+
+    if (kept != count)
+    {
+        pb_req_stats.coalesced += count - kept;
+        ESP_LOGI(TAG, "Coalesced %d requests into %d (%d total)", count, kept, pb_req_stats.coalesced);
+    }
+
+    return kept;
+}
+
+static void pb_req_account(int64_t queued, int64_t start)
+{
+    uint32_t wait_us = start - queued;
+    uint32_t handle_us = esp_timer_get_time() - start;
+
+    pb_req_stats.handled++;
+    pb_req_stats.wait_us_total += wait_us;
+    pb_req_stats.handle_us_total += handle_us;
+    if (wait_us > pb_req_stats.wait_us_max)
+    {
+        pb_req_stats.wait_us_max = wait_us;
+    }
+    if (handle_us > pb_req_stats.handle_us_max)
+    {
+        pb_req_stats.handle_us_max = handle_us;
+    }
+    ESP_LOGD(TAG, "Request waited %d us, handled in %d us", wait_us, handle_us);
+}
+
+static void pb_req_handle(pb_req_t *req)
+{
+    int64_t queued = req->queued;
+    int64_t start = esp_timer_get_time();
+
+    switch (req->type)
+    {
+    case PB_REQ_TYPE_PLAY:
+        pb_req_handle_play((pb_req_play_t *)req);
+        break;
+    case PB_REQ_TYPE_PLAY_TOKEN:
+        pb_req_handle_play_token((pb_req_play_token_t *)req);
+        break;
+    case PB_REQ_TYPE_STOP:
+        pb_req_handle_stop((pb_req_stop_t *)req);
+        break;
+    case PB_REQ_TYPE_DEFAULT:
+        pb_req_handle_default((pb_req_default_t *)req);
+        break;
+    default:
+        break;
+    }
+    pb_req_free(req);
+    pb_req_account(queued, start);
 }
 
 /********************************************************/
 /* main loop, calls functions above                     */
 /********************************************************/
 
-void pb_mainthread(void *arg)
+/* most contents share one format, so restarting the I²S clock and reprogramming the DAC is usually not needed */
+static void pb_set_clock(audio_element_info_t *music_info)
 {
-    pb_playing = false;
-    ESP_LOGI(TAG, "Listen for all pipeline events");
+    static audio_element_info_t clock_info = {0};
 
-    while (1)
+    if (music_info->sample_rates == clock_info.sample_rates && music_info->bits == clock_info.bits && music_info->channels == clock_info.channels)
     {
-        vTaskDelay(50 / portTICK_PERIOD_MS);
+        pb_clock_stats.skipped++;
+        return;
+    }
+    if (i2s_stream_set_clk(i2s_stream_writer, music_info->sample_rates, music_info->bits, music_info->channels) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set I²S rate");
+        memset(&clock_info, 0x00, sizeof(clock_info));
+        return;
+    }
+    dac3100_set_sample_rate(music_info->sample_rates);
+    memcpy(&clock_info, music_info, sizeof(clock_info));
+    pb_clock_stats.changes++;
+}
 
-        if (board_headset_irq())
+static void pb_handle_event(audio_event_iface_msg_t *msg)
+{
+    switch (msg->source_type)
+    {
+    default:
+        ESP_LOGI(TAG, "[ * ] Receive info from %d", msg->source_type);
+        break;
+    case PERIPH_ID_SDCARD:
+    {
+        switch (msg->cmd)
         {
-            uint8_t type = dac3100_headset_detected();
-            ESP_LOGI(TAG, "Headset detected: %s", type ? "YES" : "NO");
-            dac3100_set_mute(!pb_is_playing() || type);
+        case SDCARD_STATUS_UNKNOWN:
+            ESP_LOGI(TAG, "SDCARD_STATUS_UNKNOWN");
+            break;
+        case SDCARD_STATUS_CARD_DETECT_CHANGE:
+            ESP_LOGI(TAG, "SDCARD_STATUS_CARD_DETECT_CHANGE");
+            break;
+        case SDCARD_STATUS_MOUNTED:
+            ESP_LOGI(TAG, "SDCARD_STATUS_MOUNTED");
+            break;
+        case SDCARD_STATUS_UNMOUNTED:
+            ESP_LOGI(TAG, "SDCARD_STATUS_UNMOUNTED");
+            break;
+        case SDCARD_STATUS_MOUNT_ERROR:
+            ESP_LOGI(TAG, "SDCARD_STATUS_MOUNT_ERROR");
+            break;
+        case SDCARD_STATUS_UNMOUNT_ERROR:
+            ESP_LOGI(TAG, "SDCARD_STATUS_UNMOUNT_ERROR");
+            break;
         }
-
-        pb_req_t *req = NULL;
-        if (xQueueReceive(playback_queue, &req, 0) == pdTRUE)
+        break;
+    }
+    case AUDIO_ELEMENT_TYPE_ELEMENT:
+    {
+        if (msg->cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO)
         {
-            switch (req->type)
+            // msg->source == (void *)music_decoder &&
+            audio_element_info_t music_info = {0};
+            if (audio_element_getinfo(music_decoder, &music_info) == ESP_OK)
             {
-            case PB_REQ_TYPE_PLAY:
-                pb_req_handle_play((pb_req_play_t *)req);
-                break;
-            case PB_REQ_TYPE_PLAY_TOKEN:
-                pb_req_handle_play_token((pb_req_play_token_t *)req);
-                break;
-            case PB_REQ_TYPE_STOP:
-                pb_req_handle_stop((pb_req_stop_t *)req);
-                break;
-            case PB_REQ_TYPE_DEFAULT:
-                pb_req_handle_default((pb_req_default_t *)req);
-                break;
-            default:
-                break;
+                ESP_LOGI(TAG, "[ * ] Receive music info from decoder, sample_rates=%d, bits=%d, ch=%d",
+                         music_info.sample_rates, music_info.bits, music_info.channels);
+                audio_element_setinfo(i2s_stream_writer, &music_info);
+#if PB_GAIN_STAGE
+                audio_element_setinfo(pcm_gain, &music_info);
+                pcmgain_set_info(music_info.sample_rates, music_info.channels, music_info.bits);
+#endif
+                pb_set_clock(&music_info);
             }
-            free(req);
         }
-
-        audio_event_iface_msg_t msg;
-        if (audio_event_iface_listen(evt, &msg, 0) == ESP_OK)
+        else if (msg->cmd == AEL_MSG_CMD_REPORT_STATUS)
         {
-            switch (msg.source_type)
+            const char *source = "???";
+            if (msg->source == (void *)i2s_stream_writer)
             {
-            default:
-                ESP_LOGI(TAG, "[ * ] Receive info from %d", msg.source_type);
-                break;
-            case PERIPH_ID_SDCARD:
+                source = "I²S";
+            }
+            if (msg->source == (void *)music_decoder)
             {
-                switch (msg.cmd)
+                source = "OPUS";
+            }
+
+            switch ((int)msg->data)
+            {
+            case AEL_STATUS_STATE_PAUSED:
+                ESP_LOGW(TAG, "[Event] [%s] Pause", source);
+                pb_playing = true;
+                dac3100_set_mute(true);
+                if (!pb_default_content)
                 {
-                case SDCARD_STATUS_UNKNOWN:
-                    ESP_LOGI(TAG, "SDCARD_STATUS_UNKNOWN");
-                    break;
-                case SDCARD_STATUS_CARD_DETECT_CHANGE:
-                    ESP_LOGI(TAG, "SDCARD_STATUS_CARD_DETECT_CHANGE");
-                    break;
-                case SDCARD_STATUS_MOUNTED:
-                    ESP_LOGI(TAG, "SDCARD_STATUS_MOUNTED");
-                    break;
-                case SDCARD_STATUS_UNMOUNTED:
-                    ESP_LOGI(TAG, "SDCARD_STATUS_UNMOUNTED");
-                    break;
-                case SDCARD_STATUS_MOUNT_ERROR:
-                    ESP_LOGI(TAG, "SDCARD_STATUS_MOUNT_ERROR");
-                    break;
-                case SDCARD_STATUS_UNMOUNT_ERROR:
-                    ESP_LOGI(TAG, "SDCARD_STATUS_UNMOUNT_ERROR");
-                    break;
+                    ledman_change("idle");
                 }
                 break;
-            }
-            case AUDIO_ELEMENT_TYPE_ELEMENT:
-            {
-                if (msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO)
+            case AEL_STATUS_STATE_RUNNING:
+                ESP_LOGW(TAG, "[Event] [%s] Run", source);
+                if (msg->source == (void *)i2s_stream_writer && pb_restart_start)
                 {
-                    // msg.source == (void *)music_decoder &&
-                    audio_element_info_t music_info = {0};
-                    if (audio_element_getinfo(music_decoder, &music_info) == ESP_OK)
-                    {
-                        ESP_LOGI(TAG, "[ * ] Receive music info from decoder, sample_rates=%d, bits=%d, ch=%d",
-                                 music_info.sample_rates, music_info.bits, music_info.channels);
-                        audio_element_setinfo(i2s_stream_writer, &music_info);
-                        if (i2s_stream_set_clk(i2s_stream_writer, music_info.sample_rates, music_info.bits, music_info.channels) != ESP_OK)
-                        {
-                            ESP_LOGE(TAG, "Failed to set I²S rate");
-                        }
-                    }
+                    pb_restart_account(esp_timer_get_time() - pb_restart_start);
+                    pb_restart_start = 0;
                 }
-                else if (msg.cmd == AEL_MSG_CMD_REPORT_STATUS)
+                pb_playing = true;
+                dac3100_set_mute(dac3100_headset_detected());
+                if (!pb_default_content)
                 {
-                    const char *source = "???";
-                    if (msg.source == (void *)i2s_stream_writer)
+                    if (current_dl_req)
                     {
-                        source = "I²S";
+                        ledman_change("playing download");
                     }
-                    if (msg.source == (void *)music_decoder)
+                    else
                     {
-                        source = "OPUS";
+                        ledman_change("playing");
                     }
-
-                    switch ((int)msg.data)
+                }
+                break;
+            case AEL_STATUS_STATE_STOPPED:
+            case AEL_STATUS_STATE_FINISHED:
+                ESP_LOGW(TAG, "[Event] [%s] Stop", source);
+                if (msg->source == (void *)i2s_stream_writer)
+                {
+                    dac3100_set_mute(true);
+                    if (!pb_default_content)
                     {
-                    case AEL_STATUS_STATE_PAUSED:
-                        ESP_LOGW(TAG, "[Event] [%s] Pause", source);
-                        pb_playing = true;
-                        dac3100_set_mute(true);
-                        if (!pb_default_content)
-                        {
-                            ledman_change("idle");
-                        }
-                        break;
-                    case AEL_STATUS_STATE_RUNNING:
-                        ESP_LOGW(TAG, "[Event] [%s] Run", source);
-                        pb_playing = true;
-                        dac3100_set_mute(dac3100_headset_detected());
-                        if (!pb_default_content)
-                        {
-                            if (current_dl_req)
-                            {
-                                ledman_change("playing download");
-                            }
-                            else
-                            {
-                                ledman_change("playing");
-                            }
-                        }
-                        break;
-                    case AEL_STATUS_STATE_STOPPED:
-                    case AEL_STATUS_STATE_FINISHED:
-                        ESP_LOGW(TAG, "[Event] [%s] Stop", source);
-                        if (msg.source == (void *)i2s_stream_writer)
-                        {
-                            dac3100_set_mute(true);
-                            if (!pb_default_content)
-                            {
-                                ledman_change("idle");
-                            }
-                            pb_default_content = false;
-                            pb_playing = false;
-                            audio_pipeline_reset_ringbuffer(pipeline);
-                            audio_pipeline_reset_elements(pipeline);
-                            audio_pipeline_change_state(pipeline, AEL_STATE_INIT);
-
-                            /* close handle and free stuff, if not done before */
-                            pb_toniefile_close(&pb_toniefile_info);
-                            /* stop any pending download and close file handles */
-                            pb_int_abort_dl();
-                        }
-                        break;
-                    default:
-                        ESP_LOGW(TAG, "[Event] [%s] %d", source, (int)msg.data);
-                        break;
+                        ledman_change("idle");
                     }
+                    pb_default_content = false;
+                    pb_playing = false;
+                    audio_pipeline_reset_ringbuffer(pipeline);
+                    audio_pipeline_reset_elements(pipeline);
+                    audio_pipeline_change_state(pipeline, AEL_STATE_INIT);
+
+                    /* close handle and free stuff, if not done before */
+                    pb_toniefile_close(&pb_toniefile_info);
+                    /* stop any pending download and close file handles */
+                    pb_int_abort_dl();
                 }
                 break;
+            default:
+                ESP_LOGW(TAG, "[Event] [%s] %d", source, (int)msg->data);
+                break;
+            }
+        }
+        break;
+    }
+    }
+}
+
+
+void pb_mainthread(void *arg)
+{
+    pb_playing = false;
+    ESP_LOGI(TAG, "Listen for all pipeline events");
+
+    while (1)
+    {
+        /* sleep until any of the sources has something for us */
+        TickType_t wait = pb_underrun ? (PB_UNDERRUN_CHECK_MS / portTICK_PERIOD_MS) : portMAX_DELAY;
+        QueueSetMemberHandle_t member = xQueueSelectFromSet(pb_queue_set, wait);
+
+        if (member == playback_queue)
+        {
+            /* more requests might have piled up while handling the last one, take those next in the set at once.
+               the select that ends this already picked the next source, which is handled below */
+            pb_req_t *reqs[PB_QUEUE_SIZE];
+            int count = 0;
+            while (member == playback_queue && xQueueReceive(playback_queue, &reqs[count], 0) == pdTRUE)
+            {
+                count++;
+                member = (count < PB_QUEUE_SIZE) ? xQueueSelectFromSet(pb_queue_set, 0) : NULL;
+            }
+            count = pb_req_coalesce(reqs, count);
+
+            for (int pos = 0; pos < count; pos++)
+            {
+                pb_req_handle(reqs[pos]);
             }
+        }
+
+        if (member == pb_underrun_sem)
+        {
+            if (xSemaphoreTake(pb_underrun_sem, 0) == pdTRUE)
+            {
+                pb_underrun_pause();
+            }
+        }
+        else if (member == board_headset_queue())
+        {
+            if (board_headset_irq())
+            {
+                uint8_t type = dac3100_headset_detected();
+                ESP_LOGI(TAG, "Headset detected: %s", type ? "YES" : "NO");
+                pcmgain_set_headphones(type);
+                dac3100_set_mute(!pb_is_playing() || type);
+            }
+        }
+#if PB_GAIN_STAGE
+        else if (member == audio_element_get_event_queue(pcm_gain))
+        {
+            /* its reports only repeat what the decoder tells, they are taken so its queue does not run full */
+            audio_event_iface_msg_t msg;
+            xQueueReceive(member, &msg, 0);
+        }
+#endif
+        else if (member && member != playback_queue)
+        {
+            audio_event_iface_msg_t msg;
+            if (xQueueReceive(member, &msg, 0) == pdTRUE && !pb_event_stale(member))
+            {
+                pb_handle_event(&msg);
             }
         }
+
+        pb_underrun_check();
     }
 }
 
@@ -951,7 +1635,18 @@ void pb_init(esp_periph_set_handle_t set)
 {
     esp_log_level_set(TAG, ESP_LOG_INFO);
 
-    playback_queue = xQueueCreate(PB_QUEUE_SIZE, sizeof(char *));
+    playback_queue = xQueueCreate(PB_QUEUE_SIZE, sizeof(pb_req_t *));
+    playback_free_queue = xQueueCreate(PB_QUEUE_SIZE, sizeof(pb_req_t *));
+    for (int pos = 0; pos < PB_QUEUE_SIZE; pos++)
+    {
+        pb_req_t *req = &playback_req_pool[pos].hdr;
+        xQueueSend(playback_free_queue, &req, 0);
+    }
+    prefetch_init();
+    tafindex_init();
+    tafverify_init();
+    cachemgr_init();
+    tafcache_init();
     ESP_LOGI(TAG, "Create audio pipeline for playback");
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
     pipeline = audio_pipeline_init(&pipeline_cfg);
@@ -960,30 +1655,62 @@ void pb_init(esp_periph_set_handle_t set)
     i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
     i2s_cfg.type = AUDIO_STREAM_WRITER;
     i2s_cfg.i2s_config.use_apll = false;
-    i2s_cfg.i2s_config.dma_buf_count = 4;
-    i2s_cfg.i2s_config.dma_buf_len = 512;
+    i2s_cfg.i2s_config.dma_buf_count = PB_I2S_DMA_BUF_COUNT;
+    i2s_cfg.i2s_config.dma_buf_len = PB_I2S_DMA_BUF_LEN;
 
     i2s_stream_writer = i2s_stream_init(&i2s_cfg);
 
     opus_decoder_cfg_t opus_dec_cfg = DEFAULT_OPUS_DECODER_CONFIG();
     opus_dec_cfg.stack_in_ext = false;
-    opus_dec_cfg.task_prio = 200;
-    opus_dec_cfg.out_rb_size = 4096;
+    opus_dec_cfg.task_prio = PB_DEC_TASK_PRIO;
+    opus_dec_cfg.out_rb_size = PB_DEC_OUT_RB_SIZE;
     music_decoder = decoder_opus_init(&opus_dec_cfg);
 
     audio_pipeline_register(pipeline, music_decoder, "dec");
     audio_pipeline_register(pipeline, i2s_stream_writer, "i2s");
 
+#if PB_GAIN_STAGE
+    pcm_gain = pcmgain_init();
+    audio_pipeline_register(pipeline, pcm_gain, "gain");
+    pcmgain_set_headphones(dac3100_headset_detected());
+
+    const char *link_tag[3] = {"dec", "gain", "i2s"};
+    audio_pipeline_link(pipeline, &link_tag[0], 3);
+#else
     const char *link_tag[2] = {"dec", "i2s"};
     audio_pipeline_link(pipeline, &link_tag[0], 2);
+#endif
     audio_element_set_read_cb(music_decoder, &pb_toniefile_cbr, &pb_toniefile_info);
+    pbstat_init(i2s_stream_writer);
 
     ESP_LOGI(TAG, "Set up  event listener");
-    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
-    evt = audio_event_iface_init(&evt_cfg);
-
-    audio_pipeline_set_listener(pipeline, evt);
-    audio_event_iface_set_listener(esp_periph_set_get_event_iface(set), evt);
+    pb_underrun_sem = xSemaphoreCreateBinary();
+    QueueHandle_t members[] = {
+        playback_queue,
+        pb_underrun_sem,
+        board_headset_queue(),
+        audio_element_get_event_queue(music_decoder),
+        audio_element_get_event_queue(i2s_stream_writer),
+#if PB_GAIN_STAGE
+        audio_element_get_event_queue(pcm_gain),
+#endif
+        esp_periph_set_get_queue(set)};
+    UBaseType_t set_size = 0;
+
+    for (int pos = 0; pos < sizeof(members) / sizeof(members[0]); pos++)
+    {
+        set_size += uxQueueSpacesAvailable(members[pos]) + uxQueueMessagesWaiting(members[pos]);
+    }
+    pb_queue_set = xQueueCreateSet(set_size);
+    for (int pos = 0; pos < sizeof(members) / sizeof(members[0]); pos++)
+    {
+        /* only empty queues can be added, whatever arrived before is of no interest */
+        xQueueReset(members[pos]);
+        if (xQueueAddToSet(members[pos], pb_queue_set) != pdPASS)
+        {
+            ESP_LOGE(TAG, "Failed to add queue %d to set", pos);
+        }
+    }
 
     xTaskCreatePinnedToCore(pb_mainthread, "[TB] Playback", 2500, NULL, PB_TASK_PRIO, NULL, tskNO_AFFINITY);
 }
@@ -998,12 +1725,14 @@ void pb_deinit()
 
     audio_pipeline_unregister(pipeline, i2s_stream_writer);
     audio_pipeline_unregister(pipeline, music_decoder);
-
-    audio_event_iface_destroy(evt);
-
-    audio_pipeline_remove_listener(pipeline);
+#if PB_GAIN_STAGE
+    audio_pipeline_unregister(pipeline, pcm_gain);
+#endif
 
     audio_pipeline_deinit(pipeline);
     audio_element_deinit(i2s_stream_writer);
     audio_element_deinit(music_decoder);
+#if PB_GAIN_STAGE
+    audio_element_deinit(pcm_gain);
+#endif
 }
\ No newline at end of file
@@ -2,13 +2,24 @@
 #pragma once
 
 #include "esp_peripherals.h"
+#include "esp_event.h"
 #include "toniebox.pb.taf-header.pb-c.h"
 
 #define PB_TASK_PRIO 10
 #define PB_QUEUE_SIZE 10
 
-/* minimum number of blocks to download before playback starts */
-#define PB_MIN_DL_BLOCKS 20
+/* while paused because the download fell behind, check this often whether to continue, see prebuffer.h */
+#define PB_UNDERRUN_CHECK_MS 100
+/* switching to another source should not take longer than this until the output runs again */
+#define PB_RESTART_BUDGET_MS 300
+
+/* decoder and output tuning, shared with the decode benchmark in decbench.c */
+#define PB_DEC_TASK_PRIO 200
+#define PB_DEC_OUT_RB_SIZE 4096
+#define PB_I2S_DMA_BUF_COUNT 4
+#define PB_I2S_DMA_BUF_LEN 512
+/* put the software gain stage between decoder and I²S, it enforces the cloud's volume limits, see pcmgain.h */
+#define PB_GAIN_STAGE 1
 
 #define CONTENT_DEFAULT_STARTUP 0x00000000
 #define CONTENT_DEFAULT_TADA 0x00000001
@@ -39,21 +50,71 @@
 #define TONIEFILE_FRAME_SIZE 4096
 #define TONIEFILE_MAX_CHAPTERS 100
 #define TONIEFILE_PAD_END 64
+/* size of the Ogg header pages at the start of the first audio block */
+#define TONIEFILE_OGG_HEADER_SIZE 0x200
 
 #define PB_ERR_GOOD_FILE 0x8100
 #define PB_ERR_NO_FILE 0x8101
 #define PB_ERR_EMPTY_FILE 0x8102
 #define PB_ERR_CORRUPTED_FILE 0x8103
 #define PB_ERR_PARTIAL_FILE 0x8104
+#define PB_ERR_OUTDATED_FILE 0x8105
 
 #define PB_REQ_TYPE_PLAY 1
 #define PB_REQ_TYPE_PLAY_TOKEN 2
 #define PB_REQ_TYPE_STOP 3
 #define PB_REQ_TYPE_DEFAULT 4
 
+/* events posted to the default event loop */
+ESP_EVENT_DECLARE_BASE(PB_EVENT);
+
+typedef enum
+{
+    PB_EVENT_CHAPTER_CHANGED
+} pb_event_id_t;
+
+typedef struct
+{
+    uint64_t nfc_uid;
+    int32_t chapter;
+    int32_t chapters;
+} pb_event_chapter_t;
+
+typedef struct
+{
+    uint32_t restarts;
+    uint32_t last_ms;
+    uint32_t max_ms;
+    uint32_t over_budget;
+} pb_restart_stats_t;
+
+typedef struct
+{
+    uint32_t changes;
+    uint32_t skipped;
+} pb_clock_stats_t;
+
+typedef struct
+{
+    uint32_t underruns;
+    uint32_t paused_ms;
+} pb_underrun_stats_t;
+
+typedef struct
+{
+    uint32_t handled;
+    uint32_t coalesced;
+    uint64_t wait_us_total;
+    uint32_t wait_us_max;
+    uint64_t handle_us_total;
+    uint32_t handle_us_max;
+} pb_req_stats_t;
+
 typedef struct 
 {
     uint32_t type;
+    /* esp_timer time when the request was queued */
+    int64_t queued;
 } pb_req_t;
 
 typedef struct 
@@ -80,6 +141,26 @@ typedef struct
     pb_req_t hdr;
 } pb_req_stop_t;
 
+/* requests are taken from a fixed pool, so every slot has to fit any of them */
+typedef union
+{
+    pb_req_t hdr;
+    pb_req_default_t req_default;
+    pb_req_play_t req_play;
+    pb_req_play_token_t req_play_token;
+    pb_req_stop_t req_stop;
+} pb_req_slot_t;
+
+
+/* the parts of the protobuf header needed for playback, kept as a plain struct so it can be cached, see tafcache.h */
+typedef struct
+{
+    uint32_t audio_id;
+    uint64_t num_bytes;
+    uint8_t sha1_hash[20];
+    uint32_t n_track_page_nums;
+    uint32_t track_page_nums[TONIEFILE_MAX_CHAPTERS];
+} pb_taf_header_t;
 
 typedef struct
 {
@@ -87,26 +168,40 @@ typedef struct
     char *filename;
     FILE *fd;
     int32_t current_block;
-    uint8_t current_block_buffer[TONIEFILE_FRAME_SIZE];
-    int32_t current_block_avail;
+    /* prefetch buffer of the block being handed to the decoder, see prefetch_acquire() */
+    const uint8_t *block_data;
+    int32_t block_data_block;
+    int32_t block_data_avail;
     int32_t current_pos;
     int32_t target_pos;
     int32_t current_chapter;
+    /* audio block range of the current chapter, to spot a chapter change without scanning */
+    int32_t chapter_start_block;
+    int32_t chapter_end_block;
     int32_t target_chapter;
     int32_t seek_blocks;
+    /* Opus position of the current block and where to continue after a seek, see tafindex.h */
+    uint16_t pre_skip;
+    uint64_t current_granule;
+    uint64_t target_granule;
     bool initialized;
-    TonieboxAudioFileHeader *taf;
+    pb_taf_header_t taf;
 } pb_toniefile_t;
 
+esp_err_t pb_toniefile_get_header(FILE *fd, pb_taf_header_t *header);
+esp_err_t pb_toniefile_open(pb_toniefile_t *info, const char *filepath);
+int pb_toniefile_cbr(audio_element_handle_t self, char *buffer, int len, TickType_t ticks_to_wait, void *context);
+void pb_toniefile_close(pb_toniefile_t *info);
+
 void pb_init(esp_periph_set_handle_t set);
 void pb_mainthread(void *arg);
 void pb_deinit(void);
 esp_err_t pb_seek(int32_t blocks);
 esp_err_t pb_seek_chapter(int32_t chapters);
+esp_err_t pb_seek_time(uint32_t time_ms);
 esp_err_t pb_set_chapter(int32_t chapter);
 int32_t pb_get_chapter(void);
 
-esp_err_t pb_play(const char *uri);
 esp_err_t pb_play_default_lang(uint32_t lang, uint32_t id);
 esp_err_t pb_play_default(uint32_t id);
 esp_err_t pb_play_content(uint64_t nfc_uid);
@@ -114,6 +209,12 @@ esp_err_t pb_play_content_token(uint64_t nfc_uid, const uint8_t *token);
 esp_err_t pb_stop();
 bool pb_is_playing();
 char *pb_build_filename(uint64_t id);
+esp_err_t pb_check_file(const char *filename);
 uint32_t pb_get_play_position();
+uint32_t pb_get_play_time();
+void pb_get_restart_stats(pb_restart_stats_t *stats);
+void pb_get_clock_stats(pb_clock_stats_t *stats);
+void pb_get_req_stats(pb_req_stats_t *stats);
+void pb_get_underrun_stats(pb_underrun_stats_t *stats);
 uint64_t pb_get_current_uid();
-void pb_set_last(uint64_t nfc_uid, uint32_t play_position);
+void pb_set_last(uint64_t nfc_uid, uint32_t play_position, uint32_t play_time);
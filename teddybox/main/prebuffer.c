@@ -0,0 +1,80 @@
+
+#include "prebuffer.h"
+
+/* no platform dependencies in here, the start policy only works on the numbers it gets */
+
+/* bytes that have to be downloaded ahead of the start position so playback does not run dry before the download
+   completes. while playing, the buffer shrinks by the difference of both rates until the remaining part arrived */
+uint32_t prebuffer_required(const prebuffer_state_t *state)
+{
+    if (state->received >= state->total)
+    {
+        return 0;
+    }
+    if (!state->download_rate)
+    {
+        return PREBUFFER_FALLBACK_BYTES;
+    }
+
+    uint64_t remaining = state->total - state->received;
+    uint64_t download_rate = (uint64_t)state->download_rate * PREBUFFER_RATE_MARGIN_PCT / 100;
+    uint64_t content_rate = state->content_rate ? state->content_rate : PREBUFFER_DEFAULT_CONTENT_RATE;
+    uint64_t required = PREBUFFER_MIN_BYTES;
+
+    if (download_rate == 0)
+    {
+        return PREBUFFER_FALLBACK_BYTES;
+    }
+    if (download_rate < content_rate)
+    {
+        required += remaining * (content_rate - download_rate) / download_rate;
+    }
+    if (required > state->total - state->start)
+    {
+        required = state->total - state->start;
+    }
+
+    return required;
+}
+
+bool prebuffer_can_start(const prebuffer_state_t *state)
+{
+    if (state->received >= state->total)
+    {
+        return true;
+    }
+    if (state->received < state->start)
+    {
+        return false;
+    }
+    return state->received - state->start >= prebuffer_required(state);
+}
+
+void prebuffer_rate_reset(prebuffer_rate_t *rate)
+{
+    rate->last_bytes = 0;
+    rate->last_time_us = 0;
+    rate->rate = 0;
+}
+
+/* moving average of the download rate, fed with the total received bytes */
+void prebuffer_rate_update(prebuffer_rate_t *rate, uint32_t bytes, int64_t time_us)
+{
+    if (!rate->last_time_us || bytes < rate->last_bytes)
+    {
+        rate->last_bytes = bytes;
+        rate->last_time_us = time_us;
+        return;
+    }
+
+    int64_t elapsed = time_us - rate->last_time_us;
+    if (elapsed < PREBUFFER_RATE_INTERVAL_US)
+    {
+        return;
+    }
+
+    uint32_t sample = (uint64_t)(bytes - rate->last_bytes) * 1000000 / elapsed;
+    rate->rate = rate->rate ? (rate->rate * 3 + sample) / 4 : sample;
+    rate->last_bytes = bytes;
+    rate->last_time_us = time_us;
+}
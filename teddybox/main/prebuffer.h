@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* playback never starts with less than this ahead of the play position */
+#define PREBUFFER_MIN_BYTES (4 * 4096)
+/* used as long as the download rate is unknown, the former fixed start threshold */
+#define PREBUFFER_FALLBACK_BYTES (20 * 4096)
+/* only plan with this share of the measured download rate */
+#define PREBUFFER_RATE_MARGIN_PCT 80
+/* typical Opus rate of the content, until the real one is known */
+#define PREBUFFER_DEFAULT_CONTENT_RATE (96000 / 8)
+/* the download rate is averaged over intervals of this length */
+#define PREBUFFER_RATE_INTERVAL_US 500000
+
+typedef struct
+{
+    /* all in bytes of the TAF file, rates in bytes per second */
+    uint32_t received;
+    uint32_t total;
+    uint32_t start;
+    uint32_t download_rate;
+    uint32_t content_rate;
+} prebuffer_state_t;
+
+typedef struct
+{
+    uint32_t last_bytes;
+    int64_t last_time_us;
+    uint32_t rate;
+} prebuffer_rate_t;
+
+uint32_t prebuffer_required(const prebuffer_state_t *state);
+bool prebuffer_can_start(const prebuffer_state_t *state);
+
+void prebuffer_rate_reset(prebuffer_rate_t *rate);
+void prebuffer_rate_update(prebuffer_rate_t *rate, uint32_t bytes, int64_t time_us);
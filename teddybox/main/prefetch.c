@@ -0,0 +1,316 @@
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+
+#include "prefetch.h"
+#include "playback.h"
+#include "dlcache.h"
+
+typedef struct
+{
+    bool valid;
+    /* handed out to the reader, must not be refilled until released */
+    bool pinned;
+    int32_t block;
+    int32_t avail;
+    uint8_t data[TONIEFILE_FRAME_SIZE];
+} prefetch_slot_t;
+
+static const char *TAG = "[PF]";
+
+static prefetch_slot_t prefetch_slots[PREFETCH_BLOCKS];
+static TaskHandle_t prefetch_task_handle;
+
+/* protects everything below and the slot headers */
+static SemaphoreHandle_t prefetch_mutex;
+/* held while a block is being read from the card, so the file cannot be closed underneath */
+static SemaphoreHandle_t prefetch_io_mutex;
+/* given whenever a block was filled */
+static SemaphoreHandle_t prefetch_filled_sem;
+
+static FILE *prefetch_fd = NULL;
+static cloud_content_req_t *prefetch_dl = NULL;
+/* own read handle for a file being downloaded and the file size it is able to see */
+static FILE *prefetch_dl_fd = NULL;
+static uint32_t prefetch_dl_fd_size = 0;
+static int32_t prefetch_window = 0;
+static int32_t prefetch_eof_block = INT32_MAX;
+static uint32_t prefetch_generation = 0;
+static prefetch_stats_t prefetch_stats;
+
+static bool prefetch_dl_done(cloud_content_req_t *dl)
+{
+    return !dl || (dl->state != CC_STATE_RECEIVING && dl->state != CC_STATE_CONNECTED);
+}
+
+/* while downloading, fresh blocks come from the download cache and older ones from the card.
+   the card is read through a handle of our own, so the downloader's file lock is never needed */
+static int32_t prefetch_read_dl(cloud_content_req_t *dl, int32_t block, uint8_t *data, bool done)
+{
+    int32_t avail = dlcache_read(block, data);
+    if (avail != DLCACHE_NOT_CACHED)
+    {
+        return avail;
+    }
+
+    uint32_t synced = dlcache_get_synced();
+    uint32_t end = (block + 1) * TONIEFILE_FRAME_SIZE;
+    if (!done && end > synced)
+    {
+        /* the block left the RAM ring before it was synced, have the writer make it visible */
+        dlcache_request_sync(end);
+        return PREFETCH_NOT_READY;
+    }
+
+    /* a FAT file handle only knows the size the file had when it was opened */
+    if (!prefetch_dl_fd || (end > prefetch_dl_fd_size && prefetch_dl_fd_size < synced))
+    {
+        if (prefetch_dl_fd)
+        {
+            fclose(prefetch_dl_fd);
+        }
+        prefetch_dl_fd = fopen(dl->filename, "rb");
+        prefetch_dl_fd_size = synced;
+        if (!prefetch_dl_fd)
+        {
+            ESP_LOGE(TAG, "Failed to open '%s'", dl->filename);
+            return PREFETCH_NOT_READY;
+        }
+        setvbuf(prefetch_dl_fd, NULL, _IONBF, 0);
+    }
+
+    fseek(prefetch_dl_fd, block * TONIEFILE_FRAME_SIZE, SEEK_SET);
+    return fread(data, 1, TONIEFILE_FRAME_SIZE, prefetch_dl_fd);
+}
+
+static esp_err_t prefetch_fetch_next()
+{
+    xSemaphoreTake(prefetch_mutex, portMAX_DELAY);
+
+    if (!prefetch_fd && !prefetch_dl)
+    {
+        xSemaphoreGive(prefetch_mutex);
+        return ESP_FAIL;
+    }
+
+    /* find the first block within the window that is not buffered yet */
+    int32_t block = -1;
+    for (int32_t pos = prefetch_window; pos < prefetch_window + PREFETCH_BLOCKS && pos < prefetch_eof_block; pos++)
+    {
+        prefetch_slot_t *slot = &prefetch_slots[pos % PREFETCH_BLOCKS];
+        if (slot->pinned)
+        {
+            continue;
+        }
+        if (!slot->valid || slot->block != pos)
+        {
+            block = pos;
+            break;
+        }
+    }
+
+    if (block < 0)
+    {
+        xSemaphoreGive(prefetch_mutex);
+        return ESP_FAIL;
+    }
+
+    prefetch_slot_t *slot = &prefetch_slots[block % PREFETCH_BLOCKS];
+    FILE *fd = prefetch_fd;
+    cloud_content_req_t *dl = prefetch_dl;
+    uint32_t generation = prefetch_generation;
+
+    slot->valid = false;
+    slot->block = block;
+
+    /* the reader never touches an invalid slot, so the buffer can be filled without holding the state lock */
+    xSemaphoreTake(prefetch_io_mutex, portMAX_DELAY);
+    xSemaphoreGive(prefetch_mutex);
+
+    /* only trust a short block as the end of the file when the download was finished before reading it */
+    bool done = prefetch_dl_done(dl);
+    int32_t avail;
+    if (dl)
+    {
+        avail = prefetch_read_dl(dl, block, slot->data, done);
+    }
+    else
+    {
+        fseek(fd, block * TONIEFILE_FRAME_SIZE, SEEK_SET);
+        avail = fread(slot->data, 1, TONIEFILE_FRAME_SIZE, fd);
+    }
+
+    xSemaphoreGive(prefetch_io_mutex);
+
+    if (avail == PREFETCH_NOT_READY)
+    {
+        return ESP_FAIL;
+    }
+
+    xSemaphoreTake(prefetch_mutex, portMAX_DELAY);
+    if (generation == prefetch_generation && slot->block == block)
+    {
+        slot->avail = avail;
+        slot->valid = true;
+        prefetch_stats.blocks_read++;
+        prefetch_stats.bytes_read += avail;
+
+        /* a short block marks the end of the file, unless it is still being downloaded */
+        if (avail < TONIEFILE_FRAME_SIZE && done)
+        {
+            prefetch_eof_block = block + 1;
+        }
+    }
+    xSemaphoreGive(prefetch_mutex);
+    xSemaphoreGive(prefetch_filled_sem);
+
+    return ESP_OK;
+}
+
+static void prefetch_task(void *arg)
+{
+    while (true)
+    {
+        /* wake up when the reader moved on, but also periodically to pick up downloaded blocks */
+        ulTaskNotifyTake(pdTRUE, PREFETCH_WAIT_MS / portTICK_PERIOD_MS);
+
+        while (prefetch_fetch_next() == ESP_OK)
+        {
+        }
+    }
+}
+
+void prefetch_start(FILE *fd, cloud_content_req_t *dl, int32_t block)
+{
+    xSemaphoreTake(prefetch_mutex, portMAX_DELAY);
+    for (int slot = 0; slot < PREFETCH_BLOCKS; slot++)
+    {
+        prefetch_slots[slot].valid = false;
+        prefetch_slots[slot].pinned = false;
+    }
+    memset(&prefetch_stats, 0x00, sizeof(prefetch_stats));
+    prefetch_fd = fd;
+    prefetch_dl = dl;
+    prefetch_window = block;
+    prefetch_eof_block = INT32_MAX;
+    prefetch_generation++;
+    xSemaphoreGive(prefetch_mutex);
+
+    xTaskNotifyGive(prefetch_task_handle);
+}
+
+void prefetch_stop()
+{
+    xSemaphoreTake(prefetch_mutex, portMAX_DELAY);
+    prefetch_fd = NULL;
+    prefetch_dl = NULL;
+    prefetch_generation++;
+    for (int slot = 0; slot < PREFETCH_BLOCKS; slot++)
+    {
+        prefetch_slots[slot].pinned = false;
+    }
+    xSemaphoreGive(prefetch_mutex);
+
+    /* wait for a read that might still be in progress, the caller is about to close the file */
+    xSemaphoreTake(prefetch_io_mutex, portMAX_DELAY);
+    if (prefetch_dl_fd)
+    {
+        fclose(prefetch_dl_fd);
+        prefetch_dl_fd = NULL;
+        prefetch_dl_fd_size = 0;
+    }
+    xSemaphoreGive(prefetch_io_mutex);
+
+    /* wake up the reader, if any */
+    xSemaphoreGive(prefetch_filled_sem);
+}
+
+/* hand out the buffer of the given block to the reader, which may access it without locking until it is released.
+   returns the number of valid bytes, 0 at the end of the file or PREFETCH_NOT_READY when the block did not arrive in time */
+int32_t prefetch_acquire(int32_t block, const uint8_t **data, TickType_t ticks_to_wait)
+{
+    prefetch_slot_t *slot = &prefetch_slots[block % PREFETCH_BLOCKS];
+    TickType_t max_wait = PREFETCH_WAIT_MS / portTICK_PERIOD_MS;
+
+    if (ticks_to_wait > max_wait)
+    {
+        ticks_to_wait = max_wait;
+    }
+
+    xSemaphoreTake(prefetch_mutex, portMAX_DELAY);
+
+    if (prefetch_window != block)
+    {
+        prefetch_window = block;
+        xTaskNotifyGive(prefetch_task_handle);
+    }
+
+    while (!slot->valid || slot->block != block)
+    {
+        if ((!prefetch_fd && !prefetch_dl) || block >= prefetch_eof_block)
+        {
+            xSemaphoreGive(prefetch_mutex);
+            return 0;
+        }
+        xSemaphoreGive(prefetch_mutex);
+
+        xTaskNotifyGive(prefetch_task_handle);
+        if (!xSemaphoreTake(prefetch_filled_sem, ticks_to_wait))
+        {
+            ESP_LOGW(TAG, "Block %d not available yet", block);
+            prefetch_stats.not_ready++;
+            return PREFETCH_NOT_READY;
+        }
+
+        xSemaphoreTake(prefetch_mutex, portMAX_DELAY);
+    }
+
+    slot->pinned = true;
+    *data = slot->data;
+    int32_t avail = slot->avail;
+
+    xSemaphoreGive(prefetch_mutex);
+
+    return avail;
+}
+
+void prefetch_release(int32_t block)
+{
+    prefetch_slot_t *slot = &prefetch_slots[block % PREFETCH_BLOCKS];
+
+    xSemaphoreTake(prefetch_mutex, portMAX_DELAY);
+    if (slot->block == block)
+    {
+        slot->pinned = false;
+    }
+    xSemaphoreGive(prefetch_mutex);
+
+    xTaskNotifyGive(prefetch_task_handle);
+}
+
+void prefetch_account_copy(size_t bytes)
+{
+    prefetch_stats.bytes_copied += bytes;
+}
+
+void prefetch_get_stats(prefetch_stats_t *stats)
+{
+    xSemaphoreTake(prefetch_mutex, portMAX_DELAY);
+    memcpy(stats, &prefetch_stats, sizeof(prefetch_stats_t));
+    xSemaphoreGive(prefetch_mutex);
+}
+
+void prefetch_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    prefetch_mutex = xSemaphoreCreateMutex();
+    prefetch_io_mutex = xSemaphoreCreateMutex();
+    prefetch_filled_sem = xSemaphoreCreateBinary();
+
+    xTaskCreatePinnedToCore(prefetch_task, "[TB] Prefetch", PREFETCH_TASK_STACK, NULL, PREFETCH_TASK_PRIO, &prefetch_task_handle, tskNO_AFFINITY);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "cloud.h"
+
+#define PREFETCH_TASK_PRIO 11
+#define PREFETCH_TASK_STACK 3072
+
+/* number of TAF blocks kept ahead of the reader, each TONIEFILE_FRAME_SIZE in size */
+#define PREFETCH_BLOCKS 4
+/* how long the reader waits for a missing block before giving the decoder a chance to handle commands */
+#define PREFETCH_WAIT_MS 100
+
+#define PREFETCH_NOT_READY -1
+
+typedef struct
+{
+    uint32_t blocks_read;
+    uint64_t bytes_read;
+    uint64_t bytes_copied;
+    uint32_t not_ready;
+} prefetch_stats_t;
+
+void prefetch_init(void);
+void prefetch_start(FILE *fd, cloud_content_req_t *dl, int32_t block);
+void prefetch_stop(void);
+int32_t prefetch_acquire(int32_t block, const uint8_t **data, TickType_t ticks_to_wait);
+void prefetch_release(int32_t block);
+void prefetch_account_copy(size_t bytes);
+void prefetch_get_stats(prefetch_stats_t *stats);
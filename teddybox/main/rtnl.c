@@ -0,0 +1,214 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "rtnl.h"
+#include "cloud.h"
+#include "toniebox.pb.rtnl.pb-c.h"
+
+static const char *TAG = "[RT]";
+
+/* ring of records not uploaded yet, rtnl_head is the oldest one */
+static rtnl_record_t rtnl_ring[RTNL_RECORDS];
+static uint32_t rtnl_head = 0;
+static uint32_t rtnl_count = 0;
+static uint32_t rtnl_sequence = 0;
+static SemaphoreHandle_t rtnl_mutex;
+
+/* everything the upload needs is allocated once, so logging never depends on the heap */
+static rtnl_record_t rtnl_batch[RTNL_BATCH];
+static uint8_t *rtnl_buffer = NULL;
+static uint8_t rtnl_response[64];
+
+static int64_t rtnl_last_upload = 0;
+static int64_t rtnl_next_upload = 0;
+static int64_t rtnl_hour_start = 0;
+static uint32_t rtnl_hour_bytes = 0;
+static rtnl_stats_t rtnl_stats;
+
+void rtnl_log(rtnl_group_t group, uint8_t function, uint32_t value, const void *data, size_t length)
+{
+    uint32_t uptime_ms = esp_timer_get_time() / 1000;
+
+    if (!rtnl_mutex)
+    {
+        return;
+    }
+    if (length > RTNL_DATA_SIZE)
+    {
+        length = RTNL_DATA_SIZE;
+    }
+
+    xSemaphoreTake(rtnl_mutex, portMAX_DELAY);
+    if (rtnl_count == RTNL_RECORDS)
+    {
+        rtnl_head = (rtnl_head + 1) % RTNL_RECORDS;
+        rtnl_count--;
+        rtnl_stats.dropped++;
+    }
+
+    rtnl_record_t *record = &rtnl_ring[(rtnl_head + rtnl_count) % RTNL_RECORDS];
+    record->uptime_ms = uptime_ms;
+    record->sequence = rtnl_sequence++;
+    record->value = value;
+    record->group = group;
+    record->function = function;
+    record->length = length;
+    memcpy(record->data, data, length);
+
+    rtnl_count++;
+    rtnl_stats.logged++;
+    xSemaphoreGive(rtnl_mutex);
+}
+
+/* frames are prefixed with their length, big endian */
+static size_t rtnl_frame(const TonieRtnlRPC *rpc, uint8_t *buffer, size_t space)
+{
+    size_t length = tonie_rtnl_rpc__get_packed_size(rpc);
+
+    if (length + 4 > space)
+    {
+        return 0;
+    }
+    buffer[0] = length >> 24;
+    buffer[1] = length >> 16;
+    buffer[2] = length >> 8;
+    buffer[3] = length;
+    tonie_rtnl_rpc__pack(rpc, &buffer[4]);
+
+    return length + 4;
+}
+
+/* copy the oldest records and pack as many as fit, returns the number of bytes */
+static size_t rtnl_pack(uint32_t *last_sequence, uint32_t *records)
+{
+    uint32_t count = 0;
+
+    xSemaphoreTake(rtnl_mutex, portMAX_DELAY);
+    while (count < rtnl_count && count < RTNL_BATCH)
+    {
+        memcpy(&rtnl_batch[count], &rtnl_ring[(rtnl_head + count) % RTNL_RECORDS], sizeof(rtnl_record_t));
+        count++;
+    }
+    xSemaphoreGive(rtnl_mutex);
+
+    /* lets the receiver map the uptime of the records to the wall clock */
+    TonieRtnlLog3 log3 = TONIE_RTNL_LOG3__INIT;
+    log3.datetime = time(NULL);
+    log3.field2 = esp_timer_get_time() / 1000;
+
+    TonieRtnlRPC rpc = TONIE_RTNL_RPC__INIT;
+    rpc.log3 = &log3;
+
+    size_t pos = rtnl_frame(&rpc, rtnl_buffer, RTNL_BUFFER_SIZE);
+    uint32_t packed = 0;
+
+    rpc.log3 = NULL;
+    for (; packed < count; packed++)
+    {
+        rtnl_record_t *record = &rtnl_batch[packed];
+        TonieRtnlLog2 log2 = TONIE_RTNL_LOG2__INIT;
+
+        log2.uptime = record->uptime_ms;
+        log2.sequence = record->sequence;
+        log2.function_group = record->group;
+        log2.function = record->function;
+        log2.field6.len = record->length;
+        log2.field6.data = record->data;
+        log2.has_field8 = true;
+        log2.field8 = record->value;
+        rpc.log2 = &log2;
+
+        size_t length = rtnl_frame(&rpc, &rtnl_buffer[pos], RTNL_BUFFER_SIZE - pos);
+        if (!length)
+        {
+            break;
+        }
+        pos += length;
+        *last_sequence = record->sequence;
+    }
+    *records = packed;
+
+    return packed ? pos : 0;
+}
+
+/* drop what was uploaded. records dropped meanwhile moved the head already */
+static void rtnl_consume(uint32_t last_sequence)
+{
+    xSemaphoreTake(rtnl_mutex, portMAX_DELAY);
+    while (rtnl_count && (int32_t)(rtnl_ring[rtnl_head].sequence - last_sequence) <= 0)
+    {
+        rtnl_head = (rtnl_head + 1) % RTNL_RECORDS;
+        rtnl_count--;
+    }
+    xSemaphoreGive(rtnl_mutex);
+}
+
+/* called by the cloud task when it has nothing else to do */
+void rtnl_poll()
+{
+    int64_t now = esp_timer_get_time();
+
+    if (!rtnl_buffer || !rtnl_count)
+    {
+        return;
+    }
+
+    if (now - rtnl_hour_start >= 60 * 60 * 1000000LL)
+    {
+        rtnl_hour_start = now;
+        rtnl_hour_bytes = 0;
+    }
+
+    bool filling = (rtnl_count >= RTNL_RECORDS * 3 / 4) && (now - rtnl_last_upload >= RTNL_MIN_INTERVAL_MS * 1000LL);
+    if ((now < rtnl_next_upload && !filling) || rtnl_hour_bytes >= RTNL_MAX_BYTES_HOUR)
+    {
+        return;
+    }
+
+    uint32_t last_sequence = 0;
+    uint32_t records = 0;
+    size_t length = rtnl_pack(&last_sequence, &records);
+    if (!length)
+    {
+        return;
+    }
+
+    rtnl_last_upload = now;
+    rtnl_next_upload = now + RTNL_INTERVAL_MS * 1000LL;
+    rtnl_hour_bytes += length;
+
+    size_t response_length = sizeof(rtnl_response);
+    if (cloud_post(RTNL_PATH, rtnl_buffer, length, rtnl_response, &response_length) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Upload of %d records failed", records);
+        rtnl_stats.failed++;
+        return;
+    }
+
+    rtnl_consume(last_sequence);
+    rtnl_stats.uploaded += records;
+    rtnl_stats.batches++;
+    rtnl_stats.bytes += length;
+}
+
+void rtnl_get_stats(rtnl_stats_t *stats)
+{
+    memcpy(stats, &rtnl_stats, sizeof(rtnl_stats_t));
+}
+
+void rtnl_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    rtnl_buffer = malloc(RTNL_BUFFER_SIZE);
+    rtnl_next_upload = esp_timer_get_time() + RTNL_INTERVAL_MS * 1000LL;
+    rtnl_mutex = xSemaphoreCreateMutex();
+}
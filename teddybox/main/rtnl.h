@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define RTNL_PATH "/v1/rtnl"
+/* records kept in RAM, the oldest ones get dropped when it is full */
+#define RTNL_RECORDS 64
+#define RTNL_DATA_SIZE 12
+/* records per upload, packed into a buffer allocated once */
+#define RTNL_BATCH 16
+#define RTNL_BUFFER_SIZE 1024
+/* upload at most this often, earlier only when the buffer fills up */
+#define RTNL_INTERVAL_MS (5 * 60 * 1000)
+#define RTNL_MIN_INTERVAL_MS (30 * 1000)
+/* upper limit of bytes sent per hour */
+#define RTNL_MAX_BYTES_HOUR (32 * 1024)
+
+typedef enum
+{
+    RTNL_GROUP_PLAYBACK = 1,
+    RTNL_GROUP_DOWNLOAD,
+    RTNL_GROUP_ERROR
+} rtnl_group_t;
+
+typedef enum
+{
+    RTNL_PB_START = 1,
+    RTNL_PB_STOP,
+    RTNL_PB_SEEK,
+    RTNL_PB_UNDERRUN
+} rtnl_pb_function_t;
+
+typedef enum
+{
+    RTNL_DL_DONE = 1,
+    RTNL_DL_FAILED
+} rtnl_dl_function_t;
+
+typedef enum
+{
+    RTNL_ERR_FILE = 1
+} rtnl_err_function_t;
+
+/* one entry in the ring, turned into a TonieRtnlLog2 when uploaded */
+typedef struct
+{
+    uint32_t uptime_ms;
+    uint32_t sequence;
+    uint32_t value;
+    uint8_t group;
+    uint8_t function;
+    uint8_t length;
+    uint8_t data[RTNL_DATA_SIZE];
+} rtnl_record_t;
+
+typedef struct
+{
+    uint32_t logged;
+    uint32_t dropped;
+    uint32_t uploaded;
+    uint32_t batches;
+    uint32_t failed;
+    uint64_t bytes;
+} rtnl_stats_t;
+
+void rtnl_init(void);
+void rtnl_log(rtnl_group_t group, uint8_t function, uint32_t value, const void *data, size_t length);
+void rtnl_poll(void);
+void rtnl_get_stats(rtnl_stats_t *stats);
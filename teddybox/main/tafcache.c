@@ -0,0 +1,158 @@
+
+#include <string.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "tafcache.h"
+
+typedef struct
+{
+    bool valid;
+    char filename[TAFCACHE_FILENAME_LEN];
+    /* the header is only trusted as long as the file was not touched */
+    off_t size;
+    time_t mtime;
+    uint32_t last_used;
+    pb_taf_header_t header;
+} tafcache_entry_t;
+
+static const char *TAG = "[TC]";
+
+static tafcache_entry_t tafcache_entries[TAFCACHE_ENTRIES];
+static SemaphoreHandle_t tafcache_mutex;
+static uint32_t tafcache_counter = 0;
+static tafcache_stats_t tafcache_stats;
+
+static tafcache_entry_t *tafcache_find(const char *filename)
+{
+    for (int pos = 0; pos < TAFCACHE_ENTRIES; pos++)
+    {
+        tafcache_entry_t *entry = &tafcache_entries[pos];
+        if (entry->valid && !strcmp(entry->filename, filename))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* an unused entry or the least recently used one */
+static tafcache_entry_t *tafcache_victim()
+{
+    tafcache_entry_t *victim = &tafcache_entries[0];
+
+    for (int pos = 0; pos < TAFCACHE_ENTRIES; pos++)
+    {
+        tafcache_entry_t *entry = &tafcache_entries[pos];
+        if (!entry->valid)
+        {
+            return entry;
+        }
+        if (entry->last_used < victim->last_used)
+        {
+            victim = entry;
+        }
+    }
+    return victim;
+}
+
+/* get the parsed header of a TAF file, either from RAM or by parsing it from the given or a newly opened file */
+esp_err_t tafcache_get(const char *filename, const struct stat *st, FILE *fd, pb_taf_header_t *header)
+{
+    struct stat st_local;
+    int64_t start = esp_timer_get_time();
+
+    if (!st)
+    {
+        if (stat(filename, &st_local) != 0)
+        {
+            return ESP_ERR_NOT_FOUND;
+        }
+        st = &st_local;
+    }
+
+    xSemaphoreTake(tafcache_mutex, portMAX_DELAY);
+    tafcache_entry_t *entry = tafcache_find(filename);
+    if (entry && entry->size == st->st_size && entry->mtime == st->st_mtime)
+    {
+        entry->last_used = ++tafcache_counter;
+        memcpy(header, &entry->header, sizeof(pb_taf_header_t));
+        tafcache_stats.hits++;
+        xSemaphoreGive(tafcache_mutex);
+
+        ESP_LOGD(TAG, "Hit for '%s' in %lld us", filename, esp_timer_get_time() - start);
+        return ESP_OK;
+    }
+    tafcache_stats.misses++;
+    xSemaphoreGive(tafcache_mutex);
+
+    /* parse outside the lock, the card may take a while */
+    FILE *own_fd = NULL;
+    if (!fd)
+    {
+        own_fd = fopen(filename, "rb");
+        if (!own_fd)
+        {
+            return ESP_ERR_NOT_FOUND;
+        }
+        fd = own_fd;
+    }
+    esp_err_t ret = pb_toniefile_get_header(fd, header);
+    if (own_fd)
+    {
+        fclose(own_fd);
+    }
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    if (strlen(filename) < TAFCACHE_FILENAME_LEN)
+    {
+        xSemaphoreTake(tafcache_mutex, portMAX_DELAY);
+        entry = tafcache_find(filename);
+        if (!entry)
+        {
+            entry = tafcache_victim();
+        }
+        strcpy(entry->filename, filename);
+        entry->size = st->st_size;
+        entry->mtime = st->st_mtime;
+        entry->last_used = ++tafcache_counter;
+        memcpy(&entry->header, header, sizeof(pb_taf_header_t));
+        entry->valid = true;
+        xSemaphoreGive(tafcache_mutex);
+    }
+
+    ESP_LOGD(TAG, "Miss for '%s', parsed in %lld us", filename, esp_timer_get_time() - start);
+    return ESP_OK;
+}
+
+void tafcache_invalidate(const char *filename)
+{
+    xSemaphoreTake(tafcache_mutex, portMAX_DELAY);
+    tafcache_entry_t *entry = tafcache_find(filename);
+    if (entry)
+    {
+        entry->valid = false;
+    }
+    xSemaphoreGive(tafcache_mutex);
+}
+
+void tafcache_get_stats(tafcache_stats_t *stats)
+{
+    xSemaphoreTake(tafcache_mutex, portMAX_DELAY);
+    memcpy(stats, &tafcache_stats, sizeof(tafcache_stats_t));
+    xSemaphoreGive(tafcache_mutex);
+}
+
+void tafcache_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    tafcache_mutex = xSemaphoreCreateMutex();
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include "esp_err.h"
+
+#include "playback.h"
+
+/* number of parsed TAF headers kept in RAM, each about 0.5 KiB */
+#define TAFCACHE_ENTRIES 8
+#define TAFCACHE_FILENAME_LEN 48
+
+typedef struct
+{
+    uint32_t hits;
+    uint32_t misses;
+} tafcache_stats_t;
+
+void tafcache_init(void);
+esp_err_t tafcache_get(const char *filename, const struct stat *st, FILE *fd, pb_taf_header_t *header);
+void tafcache_invalidate(const char *filename);
+void tafcache_get_stats(tafcache_stats_t *stats);
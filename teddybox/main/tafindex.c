@@ -0,0 +1,401 @@
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "tafindex.h"
+#include "playback.h"
+#include "tafcache.h"
+
+#define OGG_PAGE_HEADER_SIZE 27
+
+static const char *TAG = "[IDX]";
+static QueueHandle_t tafindex_queue;
+
+/********************************************************/
+/* Ogg page helpers, operating on a single TAF block    */
+/********************************************************/
+
+/* returns the length of the Ogg page at the given offset or 0 if there is none */
+static size_t tafindex_page_length(const uint8_t *data, size_t length, size_t offset)
+{
+    if (offset + OGG_PAGE_HEADER_SIZE > length || memcmp(&data[offset], "OggS", 4))
+    {
+        return 0;
+    }
+
+    uint8_t segments = data[offset + 26];
+    size_t page_length = OGG_PAGE_HEADER_SIZE + segments;
+
+    if (offset + page_length > length)
+    {
+        return 0;
+    }
+    for (int seg = 0; seg < segments; seg++)
+    {
+        page_length += data[offset + OGG_PAGE_HEADER_SIZE + seg];
+    }
+    if (offset + page_length > length)
+    {
+        return 0;
+    }
+
+    return page_length;
+}
+
+static uint64_t tafindex_page_granule(const uint8_t *data, size_t offset)
+{
+    uint64_t granule = 0;
+
+    for (int pos = 7; pos >= 0; pos--)
+    {
+        granule = (granule << 8) | data[offset + 6 + pos];
+    }
+    return granule;
+}
+
+/* granule of the first page in the block that finishes a packet */
+uint64_t tafindex_block_first_granule(const uint8_t *data, size_t length)
+{
+    size_t offset = 0;
+    size_t page_length;
+
+    while ((page_length = tafindex_page_length(data, length, offset)) > 0)
+    {
+        uint64_t granule = tafindex_page_granule(data, offset);
+        if (granule != TAFINDEX_GRANULE_INVALID)
+        {
+            return granule;
+        }
+        offset += page_length;
+    }
+
+    return TAFINDEX_GRANULE_INVALID;
+}
+
+/* granule of the last page in the block that finishes a packet, i.e. the end position of the block */
+uint64_t tafindex_block_last_granule(const uint8_t *data, size_t length)
+{
+    uint64_t last = TAFINDEX_GRANULE_INVALID;
+    size_t offset = 0;
+    size_t page_length;
+
+    while ((page_length = tafindex_page_length(data, length, offset)) > 0)
+    {
+        uint64_t granule = tafindex_page_granule(data, offset);
+        if (granule != TAFINDEX_GRANULE_INVALID)
+        {
+            last = granule;
+        }
+        offset += page_length;
+    }
+
+    return last;
+}
+
+/* offset of the page within the block which contains the given granule position */
+size_t tafindex_page_offset(const uint8_t *data, size_t length, uint64_t granule)
+{
+    size_t offset = 0;
+    size_t page_length;
+
+    while ((page_length = tafindex_page_length(data, length, offset)) > 0)
+    {
+        uint64_t page_granule = tafindex_page_granule(data, offset);
+        if (page_granule != TAFINDEX_GRANULE_INVALID && page_granule >= granule)
+        {
+            return offset;
+        }
+        offset += page_length;
+    }
+
+    /* the position is behind this block, so start with the next one */
+    return offset;
+}
+
+/* parse the pre-skip value from the OpusHead packet at the start of the first audio block */
+esp_err_t tafindex_pre_skip(const uint8_t *data, size_t length, uint16_t *pre_skip)
+{
+    size_t page_length = tafindex_page_length(data, length, 0);
+
+    if (!page_length)
+    {
+        return ESP_FAIL;
+    }
+
+    const uint8_t *packet = &data[OGG_PAGE_HEADER_SIZE + data[26]];
+    if (packet + 12 > data + page_length || memcmp(packet, "OpusHead", 8))
+    {
+        return ESP_FAIL;
+    }
+
+    *pre_skip = packet[10] | (packet[11] << 8);
+
+    return ESP_OK;
+}
+
+uint64_t tafindex_ms_to_granule(uint32_t ms, uint16_t pre_skip)
+{
+    return (uint64_t)ms * (TAFINDEX_GRANULE_RATE / 1000) + pre_skip;
+}
+
+uint32_t tafindex_granule_to_ms(uint64_t granule, uint16_t pre_skip)
+{
+    if (granule == TAFINDEX_GRANULE_INVALID || granule < pre_skip)
+    {
+        return 0;
+    }
+    return (granule - pre_skip) / (TAFINDEX_GRANULE_RATE / 1000);
+}
+
+/********************************************************/
+/* sidecar file handling                                */
+/********************************************************/
+
+static char *tafindex_filename(const char *filename, const char *extension)
+{
+    char *index_filename = malloc(strlen(filename) + strlen(extension) + 1);
+
+    strcpy(index_filename, filename);
+    strcat(index_filename, extension);
+
+    return index_filename;
+}
+
+esp_err_t tafindex_build(const char *filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    FILE *fd = fopen(filename, "rb");
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to open '%s'", filename);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    pb_taf_header_t taf;
+    if (tafcache_get(filename, &st, fd, &taf) != ESP_OK)
+    {
+        fclose(fd);
+        return ESP_FAIL;
+    }
+
+    tafindex_header_t header = {
+        .magic = 0,
+        .version = TAFINDEX_VERSION,
+        .pre_skip = 0,
+        .audio_id = taf.audio_id,
+        .blocks = 0};
+    bool complete = (st.st_size == taf.num_bytes + TONIEFILE_FRAME_SIZE);
+
+    /* only index complete files, else the index would have to be rebuilt anyway */
+    if (!complete)
+    {
+        ESP_LOGW(TAG, "'%s' is incomplete, not indexing", filename);
+        fclose(fd);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    char *index_filename = tafindex_filename(filename, TAFINDEX_TEMP_EXTENSION);
+    FILE *index_fd = fopen(index_filename, "wb");
+    if (!index_fd)
+    {
+        ESP_LOGE(TAG, "Failed to create '%s'", index_filename);
+        free(index_filename);
+        fclose(fd);
+        return ESP_FAIL;
+    }
+
+    uint8_t *buffer = malloc(TONIEFILE_FRAME_SIZE);
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = ESP_OK;
+
+    /* header gets written with valid magic when the index is complete */
+    fwrite(&header, sizeof(header), 1, index_fd);
+
+    uint32_t granule = 0;
+    fseek(fd, TONIEFILE_FRAME_SIZE, SEEK_SET);
+    while (true)
+    {
+        size_t length = fread(buffer, 1, TONIEFILE_FRAME_SIZE, fd);
+        if (length == 0)
+        {
+            break;
+        }
+        if (header.blocks == 0)
+        {
+            tafindex_pre_skip(buffer, length, &header.pre_skip);
+        }
+
+        /* blocks without a finished packet keep the previous position */
+        uint64_t last = tafindex_block_last_granule(buffer, length);
+        if (last != TAFINDEX_GRANULE_INVALID)
+        {
+            granule = (last > UINT32_MAX) ? UINT32_MAX : last;
+        }
+        if (fwrite(&granule, sizeof(granule), 1, index_fd) != 1)
+        {
+            ESP_LOGE(TAG, "Failed to write '%s'", index_filename);
+            ret = ESP_FAIL;
+            break;
+        }
+        header.blocks++;
+
+        /* this runs in the background, leave the card to the playback */
+        vTaskDelay(1);
+    }
+
+    if (ret == ESP_OK)
+    {
+        header.magic = TAFINDEX_MAGIC;
+        fseek(index_fd, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, index_fd);
+        ESP_LOGI(TAG, "Indexed %d blocks of '%s' in %lld ms", header.blocks, filename, (esp_timer_get_time() - start) / 1000);
+    }
+
+    free(buffer);
+    fclose(index_fd);
+    fclose(fd);
+
+    if (ret == ESP_OK)
+    {
+        char *final_filename = tafindex_filename(filename, TAFINDEX_EXTENSION);
+        unlink(final_filename);
+        if (rename(index_filename, final_filename) != 0)
+        {
+            ESP_LOGE(TAG, "Failed to rename '%s'", index_filename);
+            ret = ESP_FAIL;
+        }
+        free(final_filename);
+    }
+    if (ret != ESP_OK)
+    {
+        unlink(index_filename);
+    }
+    free(index_filename);
+
+    return ret;
+}
+
+/* binary search the block which contains the given play time, also returns its granule position */
+esp_err_t tafindex_lookup(const char *filename, uint32_t audio_id, uint32_t time_ms, int32_t *block, uint64_t *granule)
+{
+    char *index_filename = tafindex_filename(filename, TAFINDEX_EXTENSION);
+    FILE *fd = fopen(index_filename, "rb");
+
+    if (!fd)
+    {
+        free(index_filename);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    /* built for different content or by an older version, build it again */
+    tafindex_header_t header;
+    if (fread(&header, sizeof(header), 1, fd) != 1 || header.magic != TAFINDEX_MAGIC || header.version != TAFINDEX_VERSION || header.audio_id != audio_id)
+    {
+        ESP_LOGW(TAG, "Index for '%s' is outdated", filename);
+        fclose(fd);
+        unlink(index_filename);
+        free(index_filename);
+        tafindex_request(filename);
+        return ESP_ERR_INVALID_STATE;
+    }
+    free(index_filename);
+
+    if (header.blocks == 0)
+    {
+        fclose(fd);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    /* the index knows the pre-skip even before the first block got read */
+    *granule = tafindex_ms_to_granule(time_ms, header.pre_skip);
+
+    uint32_t low = 0;
+    uint32_t high = header.blocks - 1;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        uint32_t entry = 0;
+
+        fseek(fd, sizeof(header) + mid * sizeof(uint32_t), SEEK_SET);
+        if (fread(&entry, sizeof(entry), 1, fd) != 1)
+        {
+            fclose(fd);
+            return ESP_FAIL;
+        }
+
+        if (entry < *granule)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    fclose(fd);
+
+    /* entry 0 describes block 1, the first audio block */
+    *block = low + 1;
+
+    return ESP_OK;
+}
+
+/********************************************************/
+/* background indexer                                   */
+/********************************************************/
+
+void tafindex_request(const char *filename)
+{
+    char *msg = strdup(filename);
+
+    if (xQueueSend(tafindex_queue, &msg, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Queue full, not indexing '%s'", filename);
+        free(msg);
+    }
+}
+
+static void tafindex_task(void *arg)
+{
+    while (true)
+    {
+        char *filename;
+
+        if (xQueueReceive(tafindex_queue, &filename, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+
+        char *index_filename = tafindex_filename(filename, TAFINDEX_EXTENSION);
+        struct stat st;
+        bool exists = (stat(index_filename, &st) == 0);
+        free(index_filename);
+
+        /* an outdated index gets deleted on lookup, which then requests it again */
+        if (!exists)
+        {
+            tafindex_build(filename);
+        }
+        free(filename);
+    }
+}
+
+void tafindex_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    tafindex_queue = xQueueCreate(TAFINDEX_QUEUE_SIZE, sizeof(char *));
+    xTaskCreatePinnedToCore(tafindex_task, "[TB] Index", 3072, NULL, TAFINDEX_TASK_PRIO, NULL, tskNO_AFFINITY);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define TAFINDEX_TASK_PRIO 2
+#define TAFINDEX_QUEUE_SIZE 4
+
+#define TAFINDEX_MAGIC 0x58444954 /* "TIDX" */
+#define TAFINDEX_VERSION 1
+#define TAFINDEX_EXTENSION ".IDX"
+/* built under this name and renamed when complete, so a lookup never sees a partial index */
+#define TAFINDEX_TEMP_EXTENSION ".IDN"
+
+/* Opus granule positions always count samples at 48 kHz */
+#define TAFINDEX_GRANULE_RATE 48000
+#define TAFINDEX_GRANULE_INVALID UINT64_MAX
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t pre_skip;
+    uint32_t audio_id;
+    /* number of audio blocks, followed by one uint32_t end granule per block starting at block 1 */
+    uint32_t blocks;
+} tafindex_header_t;
+
+void tafindex_init(void);
+void tafindex_request(const char *filename);
+esp_err_t tafindex_build(const char *filename);
+esp_err_t tafindex_lookup(const char *filename, uint32_t audio_id, uint32_t time_ms, int32_t *block, uint64_t *granule);
+
+uint64_t tafindex_block_first_granule(const uint8_t *data, size_t length);
+uint64_t tafindex_block_last_granule(const uint8_t *data, size_t length);
+size_t tafindex_page_offset(const uint8_t *data, size_t length, uint64_t granule);
+esp_err_t tafindex_pre_skip(const uint8_t *data, size_t length, uint16_t *pre_skip);
+
+uint64_t tafindex_ms_to_granule(uint32_t ms, uint16_t pre_skip);
+uint32_t tafindex_granule_to_ms(uint64_t granule, uint16_t pre_skip);
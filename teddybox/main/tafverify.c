@@ -0,0 +1,461 @@
+
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "tafverify.h"
+#include "playback.h"
+#include "tafcache.h"
+#include "dlseg.h"
+#include "cachemgr.h"
+
+static const char *TAG = "[TV]";
+static QueueHandle_t tafverify_queue;
+static tafverify_stats_t tafverify_stats;
+
+/********************************************************/
+/* sidecar file handling                                */
+/********************************************************/
+
+static char *tafverify_filename(const char *filename)
+{
+    char *verify_filename = malloc(strlen(filename) + sizeof(TAFVERIFY_EXTENSION));
+
+    strcpy(verify_filename, filename);
+    strcat(verify_filename, TAFVERIFY_EXTENSION);
+
+    return verify_filename;
+}
+
+static void tafverify_write(const char *filename, tafverify_result_t result, uint32_t size)
+{
+    char *verify_filename = tafverify_filename(filename);
+    FILE *fd = fopen(verify_filename, "wb");
+
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to create '%s'", verify_filename);
+        free(verify_filename);
+        return;
+    }
+
+    tafverify_header_t header = {
+        .magic = TAFVERIFY_MAGIC,
+        .version = TAFVERIFY_VERSION,
+        .result = result,
+        .size = size,
+        .context_size = 0};
+
+    fwrite(&header, sizeof(header), 1, fd);
+    fclose(fd);
+    free(verify_filename);
+}
+
+static esp_err_t tafverify_read(const char *filename, tafverify_header_t *header)
+{
+    char *verify_filename = tafverify_filename(filename);
+    FILE *fd = fopen(verify_filename, "rb");
+    free(verify_filename);
+
+    if (!fd)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t ret = ESP_FAIL;
+    if (fread(header, sizeof(tafverify_header_t), 1, fd) == 1 && header->magic == TAFVERIFY_MAGIC && header->version == TAFVERIFY_VERSION)
+    {
+        ret = ESP_OK;
+    }
+    fclose(fd);
+
+    return ret;
+}
+
+/* returns ESP_OK if the file was verified, ESP_ERR_INVALID_CRC if it did not match and ESP_ERR_NOT_FOUND if unknown */
+esp_err_t tafverify_check(const char *filename, uint32_t size)
+{
+    tafverify_header_t header;
+
+    if (tafverify_read(filename, &header) != ESP_OK || header.size != size)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    switch (header.result)
+    {
+    case TAFVERIFY_GOOD:
+        return ESP_OK;
+    case TAFVERIFY_BAD:
+        return ESP_ERR_INVALID_CRC;
+    default:
+        return ESP_ERR_NOT_FOUND;
+    }
+}
+
+static esp_err_t tafverify_compare(const char *filename, mbedtls_sha1_context *ctx, const pb_taf_header_t *taf, uint32_t size)
+{
+    uint8_t hash[20];
+
+    mbedtls_sha1_finish_ret(ctx, hash);
+
+    bool good = !memcmp(hash, taf->sha1_hash, sizeof(hash));
+    tafverify_write(filename, good ? TAFVERIFY_GOOD : TAFVERIFY_BAD, size);
+    dljournal_remove(filename);
+    tafverify_stats.files++;
+
+    if (!good)
+    {
+        tafverify_stats.failed++;
+        ESP_LOGE(TAG, "'%s' does not match its hash", filename);
+        cachemgr_refresh_file(filename);
+        return ESP_ERR_INVALID_CRC;
+    }
+    ESP_LOGI(TAG, "'%s' verified", filename);
+
+    return ESP_OK;
+}
+
+/********************************************************/
+/* incremental hashing while downloading                */
+/********************************************************/
+
+/* continue the hash of a download starting at the given file position, if the journal has it there */
+tafverify_state_t *tafverify_start(const char *filename, uint32_t pos)
+{
+    tafverify_state_t *state = calloc(1, sizeof(tafverify_state_t));
+
+    mbedtls_sha1_init(&state->ctx);
+
+    if (pos <= TONIEFILE_FRAME_SIZE)
+    {
+        /* entries of an earlier attempt must not win over the new ones */
+        dljournal_remove(filename);
+        mbedtls_sha1_starts_ret(&state->ctx);
+        state->pos = TONIEFILE_FRAME_SIZE;
+        state->valid = true;
+    }
+    else if (dljournal_load(filename, &state->checkpoint) == ESP_OK && state->checkpoint.pos == pos)
+    {
+        memcpy(&state->ctx, &state->checkpoint.ctx, sizeof(mbedtls_sha1_context));
+        state->pos = pos;
+        state->valid = true;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "No hash state for '%s' at %d, verifying when complete", filename, pos);
+    }
+    state->committed = state->pos;
+
+    return state;
+}
+
+/* hash in pieces that end at the checkpoint boundaries, keeping a copy of the state there */
+static void tafverify_hash(tafverify_state_t *state, const uint8_t *data, size_t length)
+{
+    const uint32_t interval = DLJOURNAL_BLOCKS * TONIEFILE_FRAME_SIZE;
+
+    while (length > 0)
+    {
+        uint32_t boundary = (state->pos / interval + 1) * interval;
+        size_t chunk = boundary - state->pos;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+        mbedtls_sha1_update_ret(&state->ctx, data, chunk);
+        state->pos += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (state->pos == boundary)
+        {
+            memcpy(&state->checkpoint.ctx, &state->ctx, sizeof(mbedtls_sha1_context));
+            state->checkpoint.pos = boundary;
+        }
+    }
+}
+
+/* hash data received at the given file position, which has to continue where the last call ended */
+void tafverify_update(tafverify_state_t *state, uint32_t pos, const uint8_t *data, size_t length)
+{
+    if (!state || !state->valid || pos + length <= state->pos)
+    {
+        return;
+    }
+    if (pos > state->pos)
+    {
+        ESP_LOGW(TAG, "Gap at %d, expected %d", pos, state->pos);
+        state->valid = false;
+        return;
+    }
+
+    size_t offset = state->pos - pos;
+    tafverify_hash(state, &data[offset], length - offset);
+}
+
+/* hash what was written to the file by someone else, e.g. the helpers of a split download */
+esp_err_t tafverify_update_file(tafverify_state_t *state, FILE *fd, uint32_t end)
+{
+    if (!state || !state->valid)
+    {
+        return ESP_FAIL;
+    }
+
+    uint8_t *buffer = malloc(TONIEFILE_FRAME_SIZE);
+    if (!buffer)
+    {
+        state->valid = false;
+        return ESP_ERR_NO_MEM;
+    }
+
+    fseek(fd, state->pos, SEEK_SET);
+    while (state->pos < end)
+    {
+        size_t chunk = end - state->pos;
+        if (chunk > TONIEFILE_FRAME_SIZE)
+        {
+            chunk = TONIEFILE_FRAME_SIZE;
+        }
+        if (fread(buffer, 1, chunk, fd) != chunk)
+        {
+            ESP_LOGE(TAG, "Failed to read back at %d", state->pos);
+            state->valid = false;
+            break;
+        }
+        tafverify_hash(state, buffer, chunk);
+    }
+    free(buffer);
+
+    return state->valid ? ESP_OK : ESP_FAIL;
+}
+
+/* journal the last checkpoint, once the card has everything up to it. a resume after a power cut starts there */
+void tafverify_commit(tafverify_state_t *state, const char *filename, uint32_t synced)
+{
+    if (!state || !state->valid || state->checkpoint.pos <= state->committed || state->checkpoint.pos > synced)
+    {
+        return;
+    }
+    if (dljournal_commit(filename, &state->checkpoint) == ESP_OK)
+    {
+        state->committed = state->checkpoint.pos;
+    }
+}
+
+/* keep the hash state of an unfinished download for the next attempt */
+void tafverify_save(tafverify_state_t *state, const char *filename, uint32_t synced)
+{
+    /* an older entry stays, the next attempt goes back to where the hash state is known */
+    if (!state || !state->valid)
+    {
+        return;
+    }
+    if (state->pos <= synced)
+    {
+        memcpy(&state->checkpoint.ctx, &state->ctx, sizeof(mbedtls_sha1_context));
+        state->checkpoint.pos = state->pos;
+    }
+    tafverify_commit(state, filename, synced);
+}
+
+/* compare the hash of a finished download. ESP_ERR_INVALID_STATE if it has to be verified from the card instead */
+esp_err_t tafverify_finish(tafverify_state_t *state, const char *filename)
+{
+    pb_taf_header_t taf;
+
+    if (!state || !state->valid || tafcache_get(filename, NULL, NULL, &taf) != ESP_OK || state->pos != taf.num_bytes + TONIEFILE_FRAME_SIZE)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return tafverify_compare(filename, &state->ctx, &taf, state->pos);
+}
+
+void tafverify_free(tafverify_state_t *state)
+{
+    if (state)
+    {
+        mbedtls_sha1_free(&state->ctx);
+        free(state);
+    }
+}
+
+/********************************************************/
+/* background verifier                                  */
+/********************************************************/
+
+esp_err_t tafverify_file(const char *filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    /* incomplete files get verified when their download is done */
+    pb_taf_header_t taf;
+    if (dlseg_pending(filename) || tafcache_get(filename, &st, NULL, &taf) != ESP_OK || st.st_size != taf.num_bytes + TONIEFILE_FRAME_SIZE)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    FILE *fd = fopen(filename, "rb");
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to open '%s'", filename);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint8_t *buffer = malloc(TONIEFILE_FRAME_SIZE);
+    if (!buffer)
+    {
+        fclose(fd);
+        return ESP_ERR_NO_MEM;
+    }
+
+    mbedtls_sha1_context ctx;
+    mbedtls_sha1_init(&ctx);
+    mbedtls_sha1_starts_ret(&ctx);
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = ESP_OK;
+    uint32_t pos = TONIEFILE_FRAME_SIZE;
+
+    fseek(fd, pos, SEEK_SET);
+    while (pos < st.st_size)
+    {
+        size_t length = fread(buffer, 1, TONIEFILE_FRAME_SIZE, fd);
+        if (length == 0)
+        {
+            ESP_LOGE(TAG, "Failed to read '%s' at %d", filename, pos);
+            ret = ESP_FAIL;
+            break;
+        }
+        mbedtls_sha1_update_ret(&ctx, buffer, length);
+        pos += length;
+
+        /* this runs in the background, leave the card to the playback */
+        vTaskDelay(1);
+    }
+    free(buffer);
+    fclose(fd);
+
+    if (ret == ESP_OK)
+    {
+        int64_t duration = esp_timer_get_time() - start;
+        tafverify_stats.bytes += pos - TONIEFILE_FRAME_SIZE;
+        tafverify_stats.us += duration;
+        ESP_LOGI(TAG, "Hashed %d bytes of '%s' in %lld ms", pos - TONIEFILE_FRAME_SIZE, filename, duration / 1000);
+
+        ret = tafverify_compare(filename, &ctx, &taf, st.st_size);
+    }
+    mbedtls_sha1_free(&ctx);
+
+    return ret;
+}
+
+void tafverify_request(const char *filename)
+{
+    char *msg = strdup(filename);
+
+    if (xQueueSend(tafverify_queue, &msg, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Queue full, not verifying '%s'", filename);
+        free(msg);
+    }
+}
+
+/* verify the content files which were not checked yet, CONTENT/<dir>/<file> */
+static void tafverify_scan()
+{
+    DIR *dir = opendir(TAFVERIFY_CONTENT_DIR);
+    if (!dir)
+    {
+        return;
+    }
+
+    char *path = malloc(64);
+    struct dirent *de;
+    while ((de = readdir(dir)))
+    {
+        if (de->d_name[0] == '.' || strlen(de->d_name) != 8)
+        {
+            continue;
+        }
+        snprintf(path, 64, "%s/%s", TAFVERIFY_CONTENT_DIR, de->d_name);
+
+        DIR *subdir = opendir(path);
+        if (!subdir)
+        {
+            continue;
+        }
+
+        struct dirent *sub_de;
+        while ((sub_de = readdir(subdir)))
+        {
+            /* sidecar files have an extension */
+            if (strlen(sub_de->d_name) != 8 || strchr(sub_de->d_name, '.'))
+            {
+                continue;
+            }
+            snprintf(path, 64, "%s/%s/%s", TAFVERIFY_CONTENT_DIR, de->d_name, sub_de->d_name);
+
+            struct stat st;
+            if (stat(path, &st) == 0 && tafverify_check(path, st.st_size) == ESP_ERR_NOT_FOUND)
+            {
+                tafverify_file(path);
+            }
+        }
+        closedir(subdir);
+    }
+    closedir(dir);
+    free(path);
+
+    ESP_LOGI(TAG, "Scan done, %d files verified, %d failed", tafverify_stats.files, tafverify_stats.failed);
+}
+
+static void tafverify_task(void *arg)
+{
+    bool scanned = false;
+
+    while (true)
+    {
+        char *filename;
+
+        if (xQueueReceive(tafverify_queue, &filename, scanned ? portMAX_DELAY : TAFVERIFY_SCAN_DELAY_MS / portTICK_PERIOD_MS) != pdTRUE)
+        {
+            tafverify_scan();
+            scanned = true;
+            continue;
+        }
+
+        struct stat st;
+        if (stat(filename, &st) == 0 && tafverify_check(filename, st.st_size) == ESP_ERR_NOT_FOUND)
+        {
+            tafverify_file(filename);
+        }
+        free(filename);
+    }
+}
+
+void tafverify_get_stats(tafverify_stats_t *stats)
+{
+    memcpy(stats, &tafverify_stats, sizeof(tafverify_stats_t));
+    stats->rate = stats->us ? stats->bytes * 1000000ULL / stats->us : 0;
+}
+
+void tafverify_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_INFO);
+
+    tafverify_queue = xQueueCreate(TAFVERIFY_QUEUE_SIZE, sizeof(char *));
+    xTaskCreatePinnedToCore(tafverify_task, "[TB] Verify", 3072, NULL, TAFVERIFY_TASK_PRIO, NULL, tskNO_AFFINITY);
+}
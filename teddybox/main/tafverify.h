@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mbedtls/sha1.h"
+#include "dljournal.h"
+
+/* below the indexer, only run when nothing else has to be done */
+#define TAFVERIFY_TASK_PRIO 1
+#define TAFVERIFY_QUEUE_SIZE 4
+/* give the system time to start up before checking the stored content */
+#define TAFVERIFY_SCAN_DELAY_MS 30000
+#define TAFVERIFY_CONTENT_DIR "/sdcard/CONTENT"
+
+#define TAFVERIFY_MAGIC 0x41485354 /* "TSHA" */
+#define TAFVERIFY_VERSION 1
+#define TAFVERIFY_EXTENSION ".SHA"
+
+typedef enum
+{
+    /* not finished yet, the hash state is in the journal, see dljournal.h */
+    TAFVERIFY_PARTIAL = 0,
+    TAFVERIFY_GOOD,
+    TAFVERIFY_BAD
+} tafverify_result_t;
+
+/* sidecar next to the content */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t result;
+    /* file size the result is valid for, or bytes hashed so far */
+    uint32_t size;
+    uint32_t context_size;
+} tafverify_header_t;
+
+/* the SHA-1 of a TAF covers everything behind the header block, which is hashed while downloading */
+typedef struct tafverify_state_s
+{
+    mbedtls_sha1_context ctx;
+    /* file position hashed up to */
+    uint32_t pos;
+    bool valid;
+    /* hash state at the last DLJOURNAL_BLOCKS boundary and how far the journal has it */
+    dljournal_entry_t checkpoint;
+    uint32_t committed;
+} tafverify_state_t;
+
+typedef struct
+{
+    uint32_t files;
+    uint32_t failed;
+    uint64_t bytes;
+    uint64_t us;
+    /* bytes per second, filled in by tafverify_get_stats() */
+    uint32_t rate;
+} tafverify_stats_t;
+
+void tafverify_init(void);
+void tafverify_request(const char *filename);
+esp_err_t tafverify_file(const char *filename);
+esp_err_t tafverify_check(const char *filename, uint32_t size);
+
+tafverify_state_t *tafverify_start(const char *filename, uint32_t pos);
+void tafverify_update(tafverify_state_t *state, uint32_t pos, const uint8_t *data, size_t length);
+esp_err_t tafverify_update_file(tafverify_state_t *state, FILE *fd, uint32_t end);
+void tafverify_commit(tafverify_state_t *state, const char *filename, uint32_t synced);
+void tafverify_save(tafverify_state_t *state, const char *filename, uint32_t synced);
+esp_err_t tafverify_finish(tafverify_state_t *state, const char *filename);
+void tafverify_free(tafverify_state_t *state);
+
+void tafverify_get_stats(tafverify_stats_t *stats);
@@ -27,6 +27,8 @@ static const char *TAG = "WWW";
 #include "esp_spiffs.h"
 #include "esp_http_server.h"
 
+#include "pbstat.h"
+
 /* Max length a file path can have on storage */
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
 
@@ -70,6 +72,17 @@ static esp_err_t favicon_get_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+/* Handler to respond with the playback pipeline counters, see pbstat.h */
+static esp_err_t pbstat_get_handler(httpd_req_t *req)
+{
+    pbstat_snapshot_t snapshot;
+
+    pbstat_snapshot(&snapshot, false);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_send(req, (const char *)&snapshot, sizeof(snapshot));
+    return ESP_OK;
+}
+
 /* Send HTTP response with a run-time generated html consisting of
  * a list of all files and folders under the requested path.
  * In case of SPIFFS this returns empty list when path is any
@@ -279,6 +292,10 @@ static esp_err_t download_get_handler(httpd_req_t *req)
         {
             return favicon_get_handler(req);
         }
+        else if (strcmp(filename, "/pbstat.bin") == 0)
+        {
+            return pbstat_get_handler(req);
+        }
          
         ESP_LOGE(TAG, "Failed to stat file : %s", filepath);
         /* Respond with 404 Not Found */